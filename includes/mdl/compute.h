@@ -28,4 +28,14 @@
 
 #include "../../src/lib/h/compute_exception.h"
 #include "../../src/lib/h/arg_buffers.h"
-#include "../../src/lib/h/metal_compute_engine.h"
\ No newline at end of file
+#include "../../src/lib/h/adaptive_compute_engine.h"
+#include "../../src/lib/h/artifact_cache.h"
+#include "../../src/lib/h/compute_engine.h"
+#include "../../src/lib/h/cpu_compute_engine.h"
+#include "../../src/lib/h/host_memory.h"
+#include "../../src/lib/h/parallel_copy.h"
+#include "../../src/lib/h/staging_ring.h"
+#include "../../src/lib/h/work_group_tuner.h"
+#ifdef MDL_COMPUTE_METAL
+#include "../../src/lib/h/metal_compute_engine.h"
+#endif
\ No newline at end of file
@@ -0,0 +1,82 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <benchmark/benchmark.h>
+
+#include <mdl/compute.h>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "../../lib/h/thread_pool.h"
+
+namespace mdl {
+namespace compute {
+namespace compute_benchmark {
+
+  // Contention on the submit path: per-thread time should stay flat as 
+  // threads are added.
+
+  // Tasks submitted from many threads into one pool, each thread waiting 
+  // for its own tasks every 64 of them.
+  void BM_PoolSubmit(benchmark::State& state) {
+    static ThreadPool pool;
+    constexpr std::size_t kTasks = 64;
+    std::atomic_size_t done = 0;
+    for (auto _ : state) {
+      for (std::size_t i = 0; i < kTasks; i++) {
+        pool.Submit([&done]() { done.fetch_add(1, std::memory_order_release); });
+      }
+      while (done.load(std::memory_order_acquire) != kTasks) {
+        std::this_thread::yield();
+      }
+      done.store(0, std::memory_order_relaxed);
+    }
+    state.SetItemsProcessed(state.iterations() * kTasks);
+  }
+  BENCHMARK(BM_PoolSubmit)->ThreadRange(1, 16)->UseRealTime();
+
+  // Batches dispatched from many threads into one engine.
+  void BM_ConcurrentSubmit(benchmark::State& state) {
+    static CpuComputeEngine engine;
+    [[maybe_unused]] static bool registered = [&]() {
+      engine.RegisterKernel("noop", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {});
+      return true;
+    }();
+    Kernel noop = engine.GetKernel("noop");
+    std::vector<float> v(256);
+    for (auto _ : state) {
+      engine.NewBatch().WithGrid(1, 1, 1, 1).Call(noop, in(v), out(v)).Dispatch().Wait();
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+  BENCHMARK(BM_ConcurrentSubmit)->ThreadRange(1, 16)->UseRealTime();
+} // compute_benchmark
+} // compute
+} // mdl
@@ -0,0 +1,77 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <benchmark/benchmark.h>
+
+#include <mdl/compute.h>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+namespace compute_benchmark {
+
+  // Copy-back bandwidth: ParallelCopy() (what backends copy results back 
+  // with) against a single-threaded memcpy() of the same size.
+  void BM_Memcpy(benchmark::State& state) {
+    std::vector<std::byte> src(state.range(0), std::byte(1));
+    std::vector<std::byte> dst(state.range(0));
+    for (auto _ : state) {
+      std::memcpy(dst.data(), src.data(), src.size());
+      benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+  }
+  BENCHMARK(BM_Memcpy)->RangeMultiplier(4)->Range(1 << 20, 256 << 20)->UseRealTime();
+
+  void BM_StreamingCopy(benchmark::State& state) {
+    std::vector<std::byte> src(state.range(0), std::byte(1));
+    std::vector<std::byte> dst(state.range(0));
+    for (auto _ : state) {
+      StreamingCopy(dst.data(), src.data(), src.size());
+      benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+  }
+  BENCHMARK(BM_StreamingCopy)->RangeMultiplier(4)->Range(1 << 20, 256 << 20)->UseRealTime();
+
+  void BM_ParallelCopy(benchmark::State& state) {
+    static ThreadPool pool(4);
+    std::vector<std::byte> src(state.range(0), std::byte(1));
+    std::vector<std::byte> dst(state.range(0));
+    for (auto _ : state) {
+      ParallelCopy(dst.data(), src.data(), src.size(), pool);
+      benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+  }
+  BENCHMARK(BM_ParallelCopy)->RangeMultiplier(4)->Range(1 << 20, 256 << 20)->UseRealTime();
+} // compute_benchmark
+} // compute
+} // mdl
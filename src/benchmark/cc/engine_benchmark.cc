@@ -0,0 +1,214 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <benchmark/benchmark.h>
+
+#include <mdl/compute.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+namespace compute_benchmark {
+
+  CpuComputeEngine& Engine() {
+    // shared by all benchmarks (and threads), like a service would
+    static CpuComputeEngine engine;
+    [[maybe_unused]] static bool registered = [&]() {
+      engine.RegisterKernel("noop", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {});
+      engine.RegisterKernel("fill", 
+          [](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+            float * out = args.Get<float>(0);
+            for (std::size_t col = group.colBegin; col < group.colEnd; col++) {
+              out[col] = 1.0f;
+            }
+          });
+      return true;
+    }();
+    return engine;
+  }
+
+  void BM_EmptyBatch(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    for (auto _ : state) {
+      engine.NewBatch().Dispatch().Wait();
+    }
+  }
+  BENCHMARK(BM_EmptyBatch);
+
+  void BM_NoArguments(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    for (auto _ : state) {
+      engine.NewBatch().WithGrid(1, 1, 1, 1).Call("noop").Dispatch().Wait();
+    }
+  }
+  BENCHMARK(BM_NoArguments);
+
+  // Same as BM_NoArguments, with instrumentation on.
+  void BM_Instrumented(benchmark::State& state) {
+    CpuComputeEngine engine;
+    engine.RegisterKernel("noop", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {});
+    engine.EnableInstrumentation();
+    for (auto _ : state) {
+      engine.NewBatch().WithGrid(1, 1, 1, 1).Call("noop").Dispatch().Wait();
+    }
+  }
+  BENCHMARK(BM_Instrumented);
+
+  // Binding cost per argument: one call with 8 arguments of the same kind. 
+  // Subtract BM_NoArguments to get the cost of the arguments alone.
+  template <class Arg>
+  void DispatchWith8(benchmark::State& state, Arg arg) {
+    CpuComputeEngine& engine = Engine();
+    Kernel noop = engine.GetKernel("noop");
+    for (auto _ : state) {
+      engine.NewBatch()
+          .WithGrid(1, 1, 1, 1).Call(noop, arg(), arg(), arg(), arg(), arg(), arg(), arg(), arg())
+          .Dispatch().Wait();
+    }
+    state.SetItemsProcessed(state.iterations() * 8);
+  }
+
+  void BM_BindIn(benchmark::State& state) {
+    std::vector<float> v(256);
+    DispatchWith8(state, [&]() { return in(v); });
+  }
+  BENCHMARK(BM_BindIn);
+
+  void BM_BindOut(benchmark::State& state) {
+    std::vector<float> v(256);
+    DispatchWith8(state, [&]() { return out(v); });
+  }
+  BENCHMARK(BM_BindOut);
+
+  void BM_BindInOut(benchmark::State& state) {
+    std::vector<float> v(256);
+    DispatchWith8(state, [&]() { return inout(v); });
+  }
+  BENCHMARK(BM_BindInOut);
+
+  void BM_BindShared(benchmark::State& state) {
+    std::vector<float> v(256);
+    DispatchWith8(state, [&]() { return shared(v); });
+  }
+  BENCHMARK(BM_BindShared);
+
+  void BM_BindPrivate(benchmark::State& state) {
+    DispatchWith8(state, [&]() { return priv(256 * sizeof(float)); });
+  }
+  BENCHMARK(BM_BindPrivate);
+
+  void BM_BindResident(benchmark::State& state) {
+    ResidentBuffer resident = Engine().NewResidentBuffer(256 * sizeof(float));
+    DispatchWith8(state, [&]() -> const ResidentBuffer& { return resident; });
+  }
+  BENCHMARK(BM_BindResident);
+
+  // Scalars are passed inline; forcing them through a buffer shows what that
+  // saves.
+  void BM_ScalarInline(benchmark::State& state) {
+    float value = 1.0f;
+    DispatchWith8(state, [&]() { return value; });
+  }
+  BENCHMARK(BM_ScalarInline);
+
+  void BM_ScalarAsBuffer(benchmark::State& state) {
+    float value = 1.0f;
+    DispatchWith8(state, [&]() { return in(value); });
+  }
+  BENCHMARK(BM_ScalarAsBuffer);
+
+  // Private buffers of growing sizes, all coming from the buffer pool once 
+  // it's warm.
+  void BM_AllocationChurn(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    std::size_t size = state.range(0);
+    for (auto _ : state) {
+      engine.NewBatch().WithGrid(1, 1, 1, 1).Call("noop", priv(size)).Dispatch().Wait();
+    }
+    state.counters["pool_hits"] = engine.GetBufferPool().GetStats().hits;
+    state.counters["pool_misses"] = engine.GetBufferPool().GetStats().misses;
+  }
+  BENCHMARK(BM_AllocationChurn)->RangeMultiplier(16)->Range(256, 16 << 20);
+
+  // Bytes written to application memory through an "out" buffer per 
+  // dispatch, kernel writes included. The CPU binds outputs in place, so 
+  // there's no copy back to measure here: see BM_ParallelCopy for that.
+  void BM_InPlaceOutput(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    std::vector<float> v(state.range(0) / sizeof(float));
+    for (auto _ : state) {
+      engine.NewBatch(true)
+          .WithGrid(1, v.size(), 1, 4096).Call("fill", out(v))
+          .Dispatch().Wait();
+    }
+    state.SetBytesProcessed(state.iterations() * v.size() * sizeof(float));
+  }
+  BENCHMARK(BM_InPlaceOutput)->RangeMultiplier(16)->Range(4 << 10, 64 << 20)->UseRealTime();
+
+  void BM_GetKernel(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    std::string name = "noop";
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(engine.GetKernel(name));
+    }
+  }
+  BENCHMARK(BM_GetKernel);
+
+  void BM_CallByName(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    for (auto _ : state) {
+      engine.NewBatch().WithGrid(1, 1, 1, 1).Call("noop").Dispatch().Wait();
+    }
+  }
+  BENCHMARK(BM_CallByName);
+
+  void BM_CallByKernel(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    Kernel noop = engine.GetKernel("noop");
+    for (auto _ : state) {
+      engine.NewBatch().WithGrid(1, 1, 1, 1).Call(noop).Dispatch().Wait();
+    }
+  }
+  BENCHMARK(BM_CallByKernel);
+
+  void BM_TemplateDispatch(benchmark::State& state) {
+    CpuComputeEngine& engine = Engine();
+    std::vector<float> v(256);
+    ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+        .WithGrid(1, 1, 1, 1).Call("noop", in(v), out(v), 1.0f)
+        .Record();
+    for (auto _ : state) {
+      tmpl.Dispatch().Wait();
+    }
+  }
+  BENCHMARK(BM_TemplateDispatch);
+} // compute_benchmark
+} // compute
+} // mdl
@@ -0,0 +1,303 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/adaptive_compute_engine.h"
+#include "../h/compute_exception.h"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <set>
+
+namespace mdl {
+namespace compute {
+
+  namespace {
+    // weight of the latest sample in a moving average
+    constexpr double kHistoryWeight = 0.25;
+
+    Kernel Resolve(ComputeEngine& engine, const std::string& functionName) {
+      try {
+        return engine.GetKernel(functionName);
+      } catch (const FunctionNotFoundException&) {
+        return Kernel();
+      }
+    }
+  }
+
+  AdaptiveComputeEngine::AdaptiveBatch::AdaptiveBatch(
+      AdaptiveComputeEngine * engine, bool parallel) : Batch(engine, parallel) {}
+
+  void AdaptiveComputeEngine::AdaptiveBatch::Encode(const KernelInfo& kernel) {
+    AdaptiveCall call {
+      .kernel = &kernel,
+      .grid = grid,
+      .args = args,
+      .inlineArgs = inlineArgs
+    };
+    for (auto it = call.args.begin(); it != call.args.end(); it++) {
+      if (it->type == BufferType::Resident) {
+        throw RuntimeException("Resident buffers are not supported by the adaptive engine");
+      }
+      if (it->type == BufferType::Inline) {
+        std::size_t offset = static_cast<std::byte *>(it->data) - inlineArgs.data();
+        it->data = call.inlineArgs.data() + offset;
+      }
+    }
+    // moving the call keeps its inline arguments where they are
+    calls.push_back(std::move(call));
+  }
+
+  void AdaptiveComputeEngine::AdaptiveBatch::Submit() {
+    std::shared_ptr<AdaptiveBatch> self = 
+        std::static_pointer_cast<AdaptiveBatch>(shared_from_this());
+    static_cast<AdaptiveComputeEngine *>(engine)->Submit(self);
+  }
+
+  void AdaptiveComputeEngine::AdaptiveBatch::Absorb(Batch& other) {
+    AdaptiveBatch& batch = static_cast<AdaptiveBatch&>(other);
+    std::move(batch.calls.begin(), batch.calls.end(), std::back_inserter(calls));
+    batch.calls.clear();
+  }
+
+
+  AdaptiveComputeEngine::AdaptiveComputeEngine(
+      ComputeEngine& cpu, ComputeEngine& device, const AdaptiveCostModel& model)
+      : cpu(cpu), device(device), model(model) {}
+
+  AdaptiveComputeEngine::~AdaptiveComputeEngine() {
+    StopCoalescing();
+  }
+
+  const char * AdaptiveComputeEngine::Backend() const {
+    return "adaptive";
+  }
+
+  bool AdaptiveComputeEngine::Available() const {
+    return cpu.Available() && device.Available();
+  }
+
+  void AdaptiveComputeEngine::LoadLibrary(const std::string& sourceCode) {
+    device.LoadLibrary(sourceCode);
+  }
+
+  bool AdaptiveComputeEngine::ContainsFunction(const std::string& functionName) const {
+    return cpu.ContainsFunction(functionName) || device.ContainsFunction(functionName);
+  }
+
+  BufferPool& AdaptiveComputeEngine::GetBufferPool() {
+    return device.GetBufferPool();
+  }
+
+  std::size_t AdaptiveComputeEngine::CpuBatches() const {
+    std::lock_guard<std::mutex> lock(historyMutex);
+    return cpuBatches;
+  }
+
+  std::size_t AdaptiveComputeEngine::DeviceBatches() const {
+    std::lock_guard<std::mutex> lock(historyMutex);
+    return deviceBatches;
+  }
+
+  std::shared_ptr<ComputeEngine::Batch> AdaptiveComputeEngine::CreateBatch(bool parallel) {
+    return std::make_shared<AdaptiveBatch>(this, parallel);
+  }
+
+  std::shared_ptr<ResidentStorage> AdaptiveComputeEngine::CreateResidentStorage(
+      std::size_t size) {
+    throw RuntimeException("Resident buffers are not supported by the adaptive engine");
+  }
+
+  void AdaptiveComputeEngine::LoadKernel(KernelInfo& kernel) {
+    // resolved, and compiled, on both engines up front
+    std::unique_ptr<AdaptiveKernel> adaptive(new AdaptiveKernel {
+      .cpu = Resolve(cpu, kernel.name),
+      .device = Resolve(device, kernel.name)
+    });
+    if (!adaptive->cpu && !adaptive->device) {
+      throw FunctionNotFoundException(std::string("Function not found: ") + kernel.name);
+    }
+
+    // calls must fit whichever engine they run on
+    kernel.handle = adaptive.get();
+    kernel.maxThreadsPerWorkGroup = std::min(
+        adaptive->cpu ? adaptive->cpu.MaxThreadsPerWorkGroup() : std::numeric_limits<std::size_t>::max(),
+        adaptive->device ? adaptive->device.MaxThreadsPerWorkGroup() : std::numeric_limits<std::size_t>::max());
+    kernel.executionWidth = adaptive->device 
+        ? adaptive->device.ExecutionWidth() 
+        : adaptive->cpu.ExecutionWidth();
+
+    std::lock_guard<std::mutex> lock(adaptiveKernelsMutex);
+    adaptiveKernels.push_back(std::move(adaptive));
+  }
+
+  std::vector<std::string> AdaptiveComputeEngine::FunctionNames() const {
+    std::set<std::string> names;
+    std::vector<std::string> cpuNames = cpu.FunctionNames();
+    std::vector<std::string> deviceNames = device.FunctionNames();
+    names.insert(cpuNames.begin(), cpuNames.end());
+    names.insert(deviceNames.begin(), deviceNames.end());
+    return std::vector<std::string>(names.begin(), names.end());
+  }
+
+  void AdaptiveComputeEngine::SizeWorkGroup(
+      const KernelInfo& kernel, Grid& grid, const std::vector<Argument>& args) const {}
+
+  void AdaptiveComputeEngine::Submit(const std::shared_ptr<AdaptiveBatch>& batch) {
+    if (batch->calls.empty()) {
+      batch->Complete(nullptr);
+      return;
+    }
+
+    // what the batch looks like: its kernels, how many threads it runs and
+    // how many bytes a device would copy in and out for it
+    std::uint64_t kernels = 0;
+    std::size_t numThreads = 0;
+    std::size_t numBytes = 0;
+    bool onCpu = true;
+    bool onDevice = true;
+    for (auto call = batch->calls.begin(); call != batch->calls.end(); call++) {
+      const AdaptiveKernel * kernel = static_cast<const AdaptiveKernel *>(call->kernel->handle);
+      kernels = kernels * 31 + std::hash<std::string>{}(call->kernel->name);
+      numThreads += call->grid.NumThreads();
+      onCpu = onCpu && kernel->cpu;
+      onDevice = onDevice && kernel->device;
+      for (auto arg = call->args.begin(); arg != call->args.end(); arg++) {
+        if (arg->type == BufferType::In || arg->type == BufferType::Out) {
+          numBytes += arg->size;
+        } else if (arg->type == BufferType::InOut) {
+          numBytes += 2 * arg->size;
+        }
+      }
+    }
+
+    if (!onCpu && !onDevice) {
+      batch->Complete(std::make_exception_ptr(RuntimeException(
+          "No engine has all the kernels of the batch")));
+      return;
+    }
+
+    HistoryKey cpuKey(kernels, std::bit_width(numThreads), std::bit_width(numBytes), false);
+    HistoryKey deviceKey(kernels, std::bit_width(numThreads), std::bit_width(numBytes), true);
+    bool useDevice;
+    {
+      std::lock_guard<std::mutex> lock(historyMutex);
+      if (onCpu && onDevice) {
+        useDevice = Estimate(deviceKey, numThreads, numBytes) 
+            < Estimate(cpuKey, numThreads, numBytes);
+        History& picked = history[useDevice ? deviceKey : cpuKey];
+        if (model.explorationInterval && ++picked.picks % model.explorationInterval == 0) {
+          useDevice = !useDevice;
+        }
+      } else {
+        useDevice = onDevice;
+      }
+      (useDevice ? deviceBatches : cpuBatches)++;
+    }
+
+    ComputeEngine& engine = useDevice ? device : cpu;
+    std::shared_ptr<Batch> inner;
+    try {
+      inner = engine.CreateBatch(batch->parallel);
+      if (batch->trace && engine.instrumented.load(std::memory_order_relaxed)) {
+        engine.StartTrace(*inner);
+      }
+      for (auto call = batch->calls.begin(); call != batch->calls.end(); call++) {
+        const AdaptiveKernel * kernel = static_cast<const AdaptiveKernel *>(call->kernel->handle);
+        inner->grid = call->grid;
+        inner->args = std::move(call->args);
+        inner->inlineArgs = std::move(call->inlineArgs);
+        inner->EncodeCall(*(useDevice ? kernel->device : kernel->cpu).GetInfo());
+      }
+    } catch (...) {
+      batch->Complete(std::current_exception());
+      return;
+    }
+    batch->calls.clear();
+    if (inner->trace) {
+      inner->trace->dispatched = std::chrono::steady_clock::now();
+    }
+
+    // the inner batch is alive while it runs its callbacks
+    Batch * running = inner.get();
+    TraceTime begin = std::chrono::steady_clock::now();
+    inner->Then([this, batch, running, key = useDevice ? deviceKey : cpuKey, begin](
+        std::exception_ptr error) {
+      TraceTime end = std::chrono::steady_clock::now();
+      if (!error) {
+        Record(key, std::chrono::duration<double>(end - begin).count());
+      }
+      if (batch->trace) {
+        BatchTrace& trace = *batch->trace;
+        if (running->trace) {
+          trace.uploaded = running->trace->uploaded;
+          trace.started = running->trace->started;
+          trace.executed = running->trace->executed;
+          for (std::size_t i = 0; i < trace.calls.size(); i++) {
+            trace.calls[i].executeBegin = running->trace->calls[i].executeBegin;
+            trace.calls[i].executeEnd = running->trace->calls[i].executeEnd;
+          }
+          trace.bytesUploaded = running->trace->bytesUploaded;
+          trace.bytesDownloaded = running->trace->bytesDownloaded;
+        } else {
+          trace.started = trace.uploaded;
+          trace.executed = end;
+        }
+      }
+      batch->Complete(error);
+    });
+    inner->Start();
+  }
+
+  double AdaptiveComputeEngine::Estimate(
+      const HistoryKey& key, std::size_t numThreads, std::size_t numBytes) const {
+    auto it = history.find(key);
+    if (it != history.end() && it->second.samples) {
+      return it->second.seconds;
+    }
+    if (std::get<3>(key)) {
+      return model.deviceLaunchOverhead 
+          + numThreads * model.deviceTimePerThread 
+          + numBytes / model.deviceBytesPerSecond;
+    }
+    return model.cpuLaunchOverhead + numThreads * model.cpuTimePerThread;
+  }
+
+  void AdaptiveComputeEngine::Record(const HistoryKey& key, double seconds) {
+    std::lock_guard<std::mutex> lock(historyMutex);
+    History& entry = history[key];
+    entry.seconds = entry.samples 
+        ? entry.seconds + kHistoryWeight * (seconds - entry.seconds) 
+        : seconds;
+    entry.samples++;
+  }
+} // compute
+} // mdl
@@ -40,5 +40,12 @@ namespace compute {
       .size = size
     };
   }
+
+  local_buffer local(std::size_t size) {
+    return {
+      .id = ++idSeq, 
+      .size = size
+    };
+  }
 }
 }
\ No newline at end of file
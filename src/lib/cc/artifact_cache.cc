@@ -0,0 +1,89 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/artifact_cache.h"
+#include "../h/file_util.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+namespace mdl {
+namespace compute {
+  namespace {
+    std::string ToHex(std::uint64_t value) {
+      char hex[17];
+      std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(value));
+      return hex;
+    }
+  }
+
+  std::uint64_t HashSource(std::string_view source) {
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (auto it = source.begin(); it != source.end(); it++) {
+      hash ^= static_cast<unsigned char>(*it);
+      hash *= 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  std::string ArtifactKey::ToString() const {
+    return backend + "-" + ToHex(sourceHash) + "-" + ToHex(HashSource(options));
+  }
+
+
+  ArtifactCache::~ArtifactCache() {}
+
+
+  DiskArtifactCache::DiskArtifactCache(const std::string& directory) 
+      : directory(directory) {}
+
+  bool DiskArtifactCache::Load(const ArtifactKey& key, std::vector<std::byte>& data) {
+    std::ifstream file(PathOf(key), std::ios::binary | std::ios::ate);
+    if (!file) {
+      return false;
+    }
+    std::streamsize size = file.tellg();
+    file.seekg(0);
+    data.resize(size);
+    return static_cast<bool>(file.read(reinterpret_cast<char *>(data.data()), size));
+  }
+
+  void DiskArtifactCache::Store(const ArtifactKey& key, const std::vector<std::byte>& data) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    // concurrent readers never see a partial artifact
+    WriteFileAtomically(PathOf(key), data.data(), data.size());
+  }
+
+  std::string DiskArtifactCache::PathOf(const ArtifactKey& key) const {
+    return (std::filesystem::path(directory) / (key.ToString() + ".bin")).string();
+  }
+} // compute
+} // mdl
@@ -0,0 +1,138 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/buffer_pool.h"
+
+#include <algorithm>
+#include <bit>
+#include <new>
+
+namespace mdl {
+namespace compute {
+
+  BufferAllocator::~BufferAllocator() {}
+
+
+  BufferPool::BufferPool(BufferAllocator * allocator, std::size_t highWaterMark) 
+      : allocator(allocator), highWaterMark(highWaterMark) {}
+
+  BufferPool::~BufferPool() {
+    DoTrim(0);
+  }
+
+  std::size_t BufferPool::SizeClass(std::size_t size) {
+    return std::bit_width(std::max(size, kMinBlockSize) - 1);
+  }
+
+  BufferPool::Block BufferPool::Acquire(std::size_t size, std::uint32_t storageMode) {
+    std::size_t sizeClass = SizeClass(size);
+    std::size_t capacity = std::size_t(1) << sizeClass;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stats.bytesInUse += capacity;
+
+      std::vector<std::vector<void *>>& lists = freeLists[storageMode];
+      if (sizeClass < lists.size() && !lists[sizeClass].empty()) {
+        void * handle = lists[sizeClass].back();
+        lists[sizeClass].pop_back();
+        stats.hits++;
+        stats.bytesRetained -= capacity;
+        return Block { .handle = handle, .capacity = capacity, .storageMode = storageMode };
+      }
+      stats.misses++;
+    }
+
+    // allocate outside of the lock, it's the slow path
+    void * handle = allocator->Allocate(capacity, storageMode);
+    if (!handle) {
+      std::lock_guard<std::mutex> lock(mutex);
+      stats.bytesInUse -= capacity;
+      throw std::bad_alloc();
+    }
+    return Block { .handle = handle, .capacity = capacity, .storageMode = storageMode };
+  }
+
+  void BufferPool::Release(const Block& block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::vector<void *>>& lists = freeLists[block.storageMode];
+    std::size_t sizeClass = SizeClass(block.capacity);
+    if (lists.size() <= sizeClass) {
+      lists.resize(sizeClass + 1);
+    }
+    lists[sizeClass].push_back(block.handle);
+    stats.bytesInUse -= block.capacity;
+    stats.bytesRetained += block.capacity;
+
+    if (stats.bytesRetained > highWaterMark) {
+      DoTrim(highWaterMark);
+    }
+  }
+
+  void BufferPool::Trim(std::size_t maxBytesRetained) {
+    std::lock_guard<std::mutex> lock(mutex);
+    DoTrim(maxBytesRetained);
+  }
+
+  void BufferPool::DoTrim(std::size_t maxBytesRetained) {
+    // largest buffers first: fewest frees to get under the limit, and small 
+    // buffers are the ones churned the most by small batches
+    for (std::size_t i = 64; i > 0 && stats.bytesRetained > maxBytesRetained; i--) {
+      std::size_t sizeClass = i - 1;
+      for (auto it = freeLists.begin(); it != freeLists.end(); it++) {
+        if (sizeClass >= it->second.size()) {
+          continue;
+        }
+        std::vector<void *>& list = it->second[sizeClass];
+        std::size_t capacity = std::size_t(1) << sizeClass;
+        while (!list.empty() && stats.bytesRetained > maxBytesRetained) {
+          allocator->Free(list.back(), capacity, it->first);
+          list.pop_back();
+          stats.bytesRetained -= capacity;
+          stats.evictions++;
+        }
+      }
+    }
+  }
+
+  void BufferPool::SetHighWaterMark(std::size_t highWaterMark) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->highWaterMark = highWaterMark;
+    DoTrim(highWaterMark);
+  }
+
+  std::size_t BufferPool::GetHighWaterMark() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return highWaterMark;
+  }
+
+  BufferPoolStats BufferPool::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+} // compute
+} // mdl
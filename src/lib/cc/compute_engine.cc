@@ -0,0 +1,1183 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/compute_engine.h"
+#include "../h/compute_exception.h"
+#include "../h/cpu_compute_engine.h"
+#ifdef MDL_COMPUTE_METAL
+#include "../h/metal_compute_engine.h"
+#endif
+
+#include <algorithm>
+#include <bit>
+#include <string>
+#include <thread>
+
+namespace mdl {
+namespace compute {
+
+  namespace {
+    std::unique_ptr<ComputeEngine> NewEngine(const std::string& backend) {
+#ifdef MDL_COMPUTE_METAL
+      if (backend == "metal") {
+        return std::make_unique<MetalComputeEngine>();
+      } 
+#endif
+      if (backend == "cpu") {
+        return std::make_unique<CpuComputeEngine>();
+      }
+      throw RuntimeException(std::string("Unknown compute backend: ") + backend);
+    }
+  }
+
+  bool ComputeEngine::Access::Conflicts(const Access& other) const {
+    if (!write && !other.write) {
+      return false;
+    }
+    if (resource || other.resource) {
+      return resource == other.resource;
+    }
+    std::less<const void *> less;
+    return less(data, static_cast<const std::byte *>(other.data) + other.size)
+        && less(other.data, static_cast<const std::byte *>(data) + size);
+  }
+
+  ComputeEngine::Batch::Batch(ComputeEngine * engine, bool parallel) 
+      : engine(engine), parallel(parallel) {}
+
+  ComputeEngine::Batch::~Batch() {}
+
+  void ComputeEngine::Batch::AddAccess(const Argument& arg) {
+    switch (arg.type) {
+      case BufferType::Inline:
+      case BufferType::Local:
+      case BufferType::Private:
+        // private buffers belong to the batch: batches reusing the same 
+        // handle get buffers of their own, and can't conflict
+        return;
+      case BufferType::Resident:
+        // assumed to be written unless declared otherwise
+        accesses.push_back(Access { .resource = arg.id, .size = arg.size, .write = true });
+        return;
+      default:
+        accesses.push_back(Access {
+          .resource = 0,
+          .data = arg.data,
+          .size = arg.size,
+          .write = arg.type != BufferType::In
+        });
+    }
+  }
+
+  void ComputeEngine::Batch::EncodeCall(const KernelInfo& kernel) {
+    if (!grid.workGroupRows || !grid.workGroupCols || !grid.workGroupLayers) {
+      engine->SizeWorkGroup(kernel, grid, args);
+    }
+    if (!trace) {
+      Encode(kernel);
+      return;
+    }
+
+    TraceTime begin = std::chrono::steady_clock::now();
+    Encode(kernel);
+    trace->calls.push_back(CallTrace {
+      .kernel = kernel.name.c_str(),
+      .encodeBegin = begin,
+      .encodeEnd = std::chrono::steady_clock::now()
+    });
+  }
+
+  void ComputeEngine::Batch::Absorb(Batch& other) {
+    throw RuntimeException("Batch can't be coalesced");
+  }
+
+  void ComputeEngine::Batch::Start() {
+    // batches waiting for a batch to be submitted may form long chains: they
+    // are started in turn rather than recursively
+    std::vector<std::shared_ptr<Batch>> ready = Launch();
+    while (!ready.empty()) {
+      std::shared_ptr<Batch> next = std::move(ready.back());
+      ready.pop_back();
+      std::vector<std::shared_ptr<Batch>> more = next->Launch();
+      ready.insert(ready.end(), more.begin(), more.end());
+    }
+  }
+
+  std::vector<std::shared_ptr<ComputeEngine::Batch>> ComputeEngine::Batch::Launch() {
+    if (trace) {
+      trace->submitted = std::chrono::steady_clock::now();
+      // backends that upload stamp "uploaded" themselves
+      trace->uploaded = trace->submitted;
+    }
+    try {
+      if (engine->coalescing.load(std::memory_order_relaxed)) {
+        // submitted along with its group
+        engine->Coalesce(shared_from_this());
+        return {};
+      }
+      Submit();
+    } catch (...) {
+      // may be running on the thread that completed a batch this one waited
+      // for, with no one to catch: fail the batch instead, which also 
+      // retires it so that batches waiting for it aren't stuck
+      Complete(std::current_exception());
+    }
+    // the batch may have completed, and the engine be gone: only batches 
+    // that haven't started yet, and so keep the engine alive, are touched
+    return MarkSubmitted();
+  }
+
+  std::vector<std::shared_ptr<ComputeEngine::Batch>> ComputeEngine::Batch::MarkSubmitted() {
+    std::vector<std::shared_ptr<Batch>> waiting;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      submitted = true;
+      waiting.swap(submissionDependents);
+    }
+    std::vector<std::shared_ptr<Batch>> ready;
+    for (auto it = waiting.begin(); it != waiting.end(); it++) {
+      if ((*it)->pendingDependencies.fetch_sub(1) == 1) {
+        ready.push_back(std::move(*it));
+      }
+    }
+    return ready;
+  }
+
+  void ComputeEngine::Batch::Complete(std::exception_ptr error) {
+    if (!members.empty()) {
+      // coalesced: this batch only ran the calls of its members, which get 
+      // its timings (and bytes, all on the first member)
+      std::size_t call = 0;
+      for (auto it = members.begin(); it != members.end(); it++) {
+        BatchTrace * memberTrace = (*it)->trace.get();
+        if (trace && memberTrace) {
+          memberTrace->uploaded = trace->uploaded;
+          memberTrace->started = trace->started;
+          memberTrace->executed = trace->executed;
+          for (auto c = memberTrace->calls.begin(); c != memberTrace->calls.end(); c++, call++) {
+            c->executeBegin = trace->calls[call].executeBegin;
+            c->executeEnd = trace->calls[call].executeEnd;
+          }
+          if (it == members.begin()) {
+            memberTrace->bytesUploaded = trace->bytesUploaded;
+            memberTrace->bytesDownloaded = trace->bytesDownloaded;
+          }
+        }
+        (*it)->Complete(error);
+      }
+      members.clear();
+      return;
+    }
+
+    if (trace) {
+      // recorded before waking anyone up, so that stats include the batch 
+      // once Wait() returns
+      trace->completed = std::chrono::steady_clock::now();
+      engine->RecordTrace(*trace);
+    }
+
+    // retired before the batch is marked as done: once Wait() returns the 
+    // application may destroy the engine. Only dependents, batches of the 
+    // engine that haven't completed yet, are started past that point.
+    std::vector<std::shared_ptr<Batch>> ready = engine->Retire(this);
+    // in case it completes without having been submitted, e.g. failing
+    std::vector<std::shared_ptr<Batch>> unblocked = MarkSubmitted();
+    ready.insert(ready.end(), unblocked.begin(), unblocked.end());
+    after.clear();
+
+    std::vector<std::function<void(std::exception_ptr)>> toRun;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      this->error = error;
+      done = true;
+      toRun.swap(callbacks);
+    }
+    completed.notify_all();
+    // dependents run whether or not this batch succeeded, and are started 
+    // before callbacks, which may take a while
+    for (auto it = ready.begin(); it != ready.end(); it++) {
+      (*it)->Start();
+    }
+    for (auto it = toRun.begin(); it != toRun.end(); it++) {
+      (*it)(error);
+    }
+  }
+
+  bool ComputeEngine::Batch::Done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return done;
+  }
+
+  void ComputeEngine::Batch::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    completed.wait(lock, [this]() { return done; });
+  }
+
+  void ComputeEngine::Batch::Then(std::function<void(std::exception_ptr)>&& callback) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!done) {
+        callbacks.push_back(std::move(callback));
+        return;
+      }
+    }
+    callback(error);
+  }
+
+
+  std::unique_ptr<ComputeEngine> ComputeEngine::Create(const std::string& backend) {
+    if (backend.empty()) {
+      for (const std::string& name : Backends()) {
+        std::unique_ptr<ComputeEngine> engine = NewEngine(name);
+        if (engine->Available()) {
+          return engine;
+        }
+      }
+      throw RuntimeException("No compute backend available");
+    }
+
+    std::unique_ptr<ComputeEngine> engine = NewEngine(backend);
+    if (!engine->Available()) {
+      throw RuntimeException(std::string("Compute backend not available: ") + backend);
+    }
+    return engine;
+  }
+
+  std::vector<std::string> ComputeEngine::Backends() {
+    return {
+#ifdef MDL_COMPUTE_METAL
+      "metal",
+#endif
+      "cpu"
+    };
+  }
+
+  ComputeEngine::~ComputeEngine() {
+    // backends have stopped it already, this only joins the thread if not
+    StopCoalescing();
+  }
+
+  ComputeEngine::BatchBuilder ComputeEngine::NewBatch(bool parallel) {
+    std::shared_ptr<Batch> batch = CreateBatch(parallel);
+    if (instrumented.load(std::memory_order_relaxed)) {
+      StartTrace(*batch);
+    }
+    return ComputeEngine::BatchBuilder(std::move(batch));
+  }
+
+  ComputeEngine::BatchBuilder ComputeEngine::NewBatchTemplate(bool parallel) {
+    return ComputeEngine::BatchBuilder(std::make_shared<RecordingBatch>(this, parallel));
+  }
+
+  KernelInfo * ComputeEngine::Find(const KernelTable& table, std::string_view name) {
+    std::size_t mask = table.capacity - 1;
+    for (std::size_t i = std::hash<std::string_view>{}(name) & mask; ; i = (i + 1) & mask) {
+      KernelInfo * kernel = table.slots[i].load(std::memory_order_acquire);
+      if (!kernel || kernel->name == name) {
+        return kernel;
+      }
+    }
+  }
+
+  void ComputeEngine::Insert(KernelTable& table, KernelInfo * kernel) {
+    std::size_t mask = table.capacity - 1;
+    std::size_t i = std::hash<std::string_view>{}(kernel->name) & mask;
+    while (table.slots[i].load(std::memory_order_relaxed)) {
+      i = (i + 1) & mask;
+    }
+    table.slots[i].store(kernel, std::memory_order_release);
+  }
+
+  Kernel ComputeEngine::GetKernel(std::string_view functionName) {
+    const KernelTable * table = kernels.load(std::memory_order_acquire);
+    if (table) {
+      if (KernelInfo * found = Find(*table, functionName)) {
+        return Kernel(found);
+      }
+    }
+
+    // loaded without holding the lock, so that kernels can be compiled in
+    // parallel
+    std::unique_ptr<KernelInfo> kernel(new KernelInfo {
+      .name = std::string(functionName), 
+      .engine = this
+    });
+    LoadKernel(*kernel);
+
+    std::lock_guard<std::mutex> lock(kernelsMutex);
+    if (!kernelTables.empty()) {
+      // some other thread may have loaded it in the meantime
+      if (KernelInfo * found = Find(*kernelTables.back(), functionName)) {
+        return Kernel(found);
+      }
+    }
+
+    // tables are kept at most half full, so probes stay short and always 
+    // end on an empty slot
+    if (kernelTables.empty() || (kernelInfos.size() + 1) * 2 > kernelTables.back()->capacity) {
+      std::unique_ptr<KernelTable> next = std::make_unique<KernelTable>(
+          kernelTables.empty() ? 16 : kernelTables.back()->capacity * 2);
+      for (auto& info : kernelInfos) {
+        Insert(*next, info.get());
+      }
+      Insert(*next, kernel.get());
+      kernels.store(next.get(), std::memory_order_release);
+      kernelTables.push_back(std::move(next));
+    } else {
+      Insert(*kernelTables.back(), kernel.get());
+    }
+
+    Kernel handle(kernel.get());
+    kernelInfos.push_back(std::move(kernel));
+    return handle;
+  }
+
+  void ComputeEngine::PrecompileAll() {
+    std::vector<std::string> names = FunctionNames();
+    std::atomic_size_t next = 0;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto work = [&]() {
+      for (std::size_t i = next++; i < names.size(); i = next++) {
+        try {
+          GetKernel(names[i]);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(errorMutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      }
+    };
+
+    std::size_t numThreads = std::min<std::size_t>(
+        names.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < numThreads; i++) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+      it->join();
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  void ComputeEngine::EnableInstrumentation(bool enabled) {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    if (enabled && !instrumented) {
+      traceEpoch = std::chrono::steady_clock::now();
+    }
+    instrumented = enabled;
+  }
+
+  EngineStats ComputeEngine::GetStats() {
+    EngineStats snapshot;
+    {
+      std::lock_guard<std::mutex> lock(statsMutex);
+      snapshot = stats;
+    }
+    snapshot.bufferPool = GetBufferPool().GetStats();
+    return snapshot;
+  }
+
+  std::vector<BatchTrace> ComputeEngine::GetTraces() const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return std::vector<BatchTrace>(traces.begin(), traces.end());
+  }
+
+  void ComputeEngine::ResetStats() {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats = EngineStats();
+    traces.clear();
+  }
+
+  void ComputeEngine::StartTrace(Batch& batch) {
+    batch.trace = std::make_unique<BatchTrace>();
+    batch.trace->id = ++nextBatchId;
+    batch.trace->parallel = batch.parallel;
+    batch.trace->created = std::chrono::steady_clock::now();
+  }
+
+  void ComputeEngine::RecordTrace(const BatchTrace& trace) {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats.batches++;
+    stats.calls += trace.calls.size();
+    if (trace.coalesced > 1) {
+      stats.coalescedBatches++;
+    }
+    for (std::size_t i = 0; i < kNumBufferTypes; i++) {
+      stats.bytesUploaded[i] += trace.bytesUploaded[i];
+      stats.bytesDownloaded[i] += trace.bytesDownloaded[i];
+    }
+    stats.encodeTime += trace.dispatched - trace.created;
+    stats.dependencyTime += trace.submitted - trace.dispatched;
+    stats.uploadTime += trace.uploaded - trace.submitted;
+    stats.queueTime += trace.started - trace.uploaded;
+    stats.executeTime += trace.executed - trace.started;
+    stats.copyBackTime += trace.completed - trace.executed;
+
+    if (traces.size() == kMaxTraces) {
+      traces.pop_front();
+    }
+    traces.push_back(trace);
+  }
+
+  void ComputeEngine::WriteChromeTrace(std::ostream& out) const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    auto micros = [this](TraceTime time) {
+      return std::chrono::duration<double, std::micro>(time - traceEpoch).count();
+    };
+    bool first = true;
+    // one complete ("X") event per stage; each batch gets its own track
+    auto event = [&](const std::string& name, const char * category, 
+        std::uint64_t track, TraceTime begin, TraceTime end, const std::string& args) {
+      if (end < begin || begin < traceEpoch) {
+        return;
+      }
+      out << (first ? "\n" : ",\n") 
+          << "{\"name\":\"" << name << "\",\"cat\":\"" << category 
+          << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << track 
+          << ",\"ts\":" << micros(begin) << ",\"dur\":" << micros(end) - micros(begin);
+      if (!args.empty()) {
+        out << ",\"args\":{" << args << "}";
+      }
+      out << "}";
+      first = false;
+    };
+
+    out << "{\"traceEvents\":[";
+    for (auto it = traces.begin(); it != traces.end(); it++) {
+      std::size_t uploaded = 0;
+      std::size_t downloaded = 0;
+      for (std::size_t i = 0; i < kNumBufferTypes; i++) {
+        uploaded += it->bytesUploaded[i];
+        downloaded += it->bytesDownloaded[i];
+      }
+
+      event("encode", "batch", it->id, it->created, it->dispatched, 
+          "\"calls\":" + std::to_string(it->calls.size()));
+      event("dependencies", "batch", it->id, it->dispatched, it->submitted, "");
+      event("upload", "batch", it->id, it->submitted, it->uploaded, 
+          "\"bytes\":" + std::to_string(uploaded));
+      event("queued", "batch", it->id, it->uploaded, it->started, "");
+      event("execute", "batch", it->id, it->started, it->executed, "");
+      event("copy-back", "batch", it->id, it->executed, it->completed, 
+          "\"bytes\":" + std::to_string(downloaded));
+      for (auto call = it->calls.begin(); call != it->calls.end(); call++) {
+        std::string name;
+        for (const char * c = call->kernel; *c; c++) {
+          if (*c == '"' || *c == '\\') {
+            name += '\\';
+          }
+          if (static_cast<unsigned char>(*c) >= 0x20) {
+            name += *c;
+          }
+        }
+        event("encode " + name, "call", it->id, call->encodeBegin, call->encodeEnd, "");
+        if (call->executeBegin != TraceTime()) {
+          event(name, "call", it->id, call->executeBegin, call->executeEnd, "");
+        }
+      }
+    }
+    out << "\n]}\n";
+  }
+
+  void ComputeEngine::SetArtifactCache(const std::shared_ptr<ArtifactCache>& cache) {
+    artifactCache = cache;
+  }
+
+  std::shared_ptr<ArtifactCache> ComputeEngine::GetArtifactCache() const {
+    return artifactCache;
+  }
+
+  void ComputeEngine::SetWorkGroupTuner(const std::shared_ptr<WorkGroupTuner>& tuner) {
+    workGroupTuner = tuner;
+  }
+
+  void ComputeEngine::SizeWorkGroup(
+      const KernelInfo& kernel, Grid& grid, const std::vector<Argument>& args) const {
+    if (FindTunedWorkGroup(kernel, grid)) {
+      return;
+    }
+
+    // rows of whole SIMD groups, as wide as the grid allows, then as many of
+    // them as fit
+    std::size_t width = std::max<std::size_t>(1, kernel.executionWidth);
+    std::size_t maxThreads = std::max(width, kernel.maxThreadsPerWorkGroup);
+    std::size_t cols = (std::max<std::size_t>(1, grid.numCols) + width - 1) / width * width;
+    grid.workGroupCols = std::min(cols, maxThreads / width * width);
+    grid.workGroupRows = std::clamp<std::size_t>(
+        maxThreads / grid.workGroupCols, 1, std::max<std::size_t>(1, grid.numRows));
+    grid.workGroupLayers = 1;
+  }
+
+  bool ComputeEngine::FindTunedWorkGroup(const KernelInfo& kernel, Grid& grid) const {
+    WorkGroupShape shape;
+    if (!workGroupTuner 
+        || !workGroupTuner->Find(
+            WorkGroupKey(Backend(), kernel.name, grid.numRows, grid.numCols), shape)) {
+      return false;
+    }
+    grid.workGroupRows = shape.rows;
+    grid.workGroupCols = shape.cols;
+    grid.workGroupLayers = 1;
+    return true;
+  }
+
+  std::vector<WorkGroupShape> ComputeEngine::WorkGroupCandidates(
+      const KernelInfo& kernel, std::size_t numRows, std::size_t numCols) const {
+    // larger shapes than the grid only add idle threads
+    std::size_t maxRows = std::bit_ceil(std::max<std::size_t>(1, numRows));
+    std::size_t maxCols = std::bit_ceil(std::max<std::size_t>(1, numCols));
+    std::size_t maxThreads = std::min(kernel.maxThreadsPerWorkGroup, maxRows * maxCols);
+
+    std::vector<WorkGroupShape> candidates;
+    for (std::size_t size = std::max<std::size_t>(1, kernel.executionWidth); 
+        size <= maxThreads; size *= 2) {
+      // widest first, then narrower by factors of 4
+      std::size_t cols = std::min(size, maxCols);
+      for (int i = 0; i < 3 && cols && size / cols <= maxRows; i++, cols /= 4) {
+        candidates.push_back(WorkGroupShape { .rows = size / cols, .cols = cols });
+      }
+    }
+    if (candidates.empty()) {
+      candidates.push_back(WorkGroupShape { .rows = 1, .cols = 1 });
+    }
+    return candidates;
+  }
+
+  ResidentBuffer ComputeEngine::NewResidentBuffer(std::size_t size) {
+    return ResidentBuffer(CreateResidentStorage(size));
+  }
+
+  void ComputeEngine::Schedule(const std::shared_ptr<Batch>& batch) {
+    if (batch->trace) {
+      batch->trace->dispatched = std::chrono::steady_clock::now();
+    }
+
+    // declared accesses to a resource replace the ones inferred for it
+    if (!batch->declared.empty()) {
+      std::vector<Access> accesses;
+      for (auto it = batch->accesses.begin(); it != batch->accesses.end(); it++) {
+        bool overridden = false;
+        for (auto decl = batch->declared.begin(); decl != batch->declared.end(); decl++) {
+          overridden = overridden || (it->resource && it->resource == decl->resource);
+        }
+        if (!overridden) {
+          accesses.push_back(*it);
+        }
+      }
+      accesses.insert(accesses.end(), batch->declared.begin(), batch->declared.end());
+      batch->accesses.swap(accesses);
+    }
+
+    // batches that touch no memory can't conflict with anything
+    if (batch->accesses.empty()) {
+      batch->Start();
+      return;
+    }
+
+    // Conflicts through application memory hold the batch until the other
+    // batch completes: it's read when the batch is submitted, and written 
+    // back when the other one completes. Resident buffers never leave the
+    // device, so on backends that order batches there, conflicts through 
+    // them only hold the batch until the other batch has been submitted, 
+    // rather than for a round trip through the host.
+    bool ordersOnDevice = OrdersOnDevice();
+    // held until it's scheduled, so that batches completing meanwhile don't
+    // start it
+    batch->pendingDependencies = 1;
+    {
+      std::lock_guard<std::mutex> lock(schedulerMutex);
+      for (auto it = inFlight.begin(); it != inFlight.end(); it++) {
+        bool onHost = false;
+        bool onDevice = false;
+        for (auto a = (*it)->accesses.begin(); !onHost && a != (*it)->accesses.end(); a++) {
+          for (auto b = batch->accesses.begin(); !onHost && b != batch->accesses.end(); b++) {
+            if (a->Conflicts(*b)) {
+              onDevice = onDevice || (ordersOnDevice && a->resource);
+              onHost = onHost || !(ordersOnDevice && a->resource);
+            }
+          }
+        }
+        if (onHost) {
+          (*it)->dependents.push_back(batch);
+          batch->pendingDependencies++;
+        } else if (onDevice) {
+          batch->after.push_back(*it);
+          std::lock_guard<std::mutex> batchLock((*it)->mutex);
+          if (!(*it)->submitted) {
+            (*it)->submissionDependents.push_back(batch);
+            batch->pendingDependencies++;
+          }
+        }
+      }
+      batch->scheduled = true;
+      batch->inFlight = inFlight.insert(inFlight.end(), batch);
+    }
+    if (batch->pendingDependencies.fetch_sub(1) == 1) {
+      batch->Start();
+    }
+  }
+
+  bool ComputeEngine::OrdersOnDevice() const {
+    return false;
+  }
+
+  std::vector<std::shared_ptr<ComputeEngine::Batch>> ComputeEngine::Retire(Batch * batch) {
+    std::vector<std::shared_ptr<Batch>> ready;
+    {
+      std::lock_guard<std::mutex> lock(schedulerMutex);
+      if (!batch->scheduled) {
+        return ready;
+      }
+      batch->scheduled = false;
+      for (auto it = batch->dependents.begin(); it != batch->dependents.end(); it++) {
+        if (--(*it)->pendingDependencies == 0) {
+          ready.push_back(*it);
+        }
+      }
+      batch->dependents.clear();
+      // may drop the last reference to the batch besides the caller's
+      inFlight.erase(batch->inFlight);
+    }
+    return ready;
+  }
+
+  void ComputeEngine::EnableCoalescing(bool enabled, const CoalescingOptions& options) {
+    if (!enabled) {
+      StopCoalescing();
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(coalescingMutex);
+    coalescingOptions = options;
+    if (!coalescer.joinable()) {
+      stopCoalescer = false;
+      coalescer = std::thread(&ComputeEngine::RunCoalescer, this);
+    }
+    coalescing = true;
+  }
+
+  void ComputeEngine::StopCoalescing() {
+    std::vector<std::shared_ptr<Batch>> group;
+    std::thread stopped;
+    {
+      std::lock_guard<std::mutex> lock(coalescingMutex);
+      coalescing = false;
+      stopCoalescer = true;
+      group.swap(coalesced);
+      stopped.swap(coalescer);
+    }
+    coalescingWakeUp.notify_all();
+    if (stopped.joinable()) {
+      stopped.join();
+    }
+    if (!group.empty()) {
+      SubmitCoalesced(std::move(group));
+    }
+  }
+
+  void ComputeEngine::Coalesce(const std::shared_ptr<Batch>& batch) {
+    std::vector<std::shared_ptr<Batch>> group;
+    {
+      std::lock_guard<std::mutex> lock(coalescingMutex);
+      if (!coalescing) {
+        // turned off since the caller checked
+        group.push_back(batch);
+      } else {
+        coalesced.push_back(batch);
+        if (coalesced.size() == 1) {
+          windowStart = std::chrono::steady_clock::now();
+          window++;
+          coalescingWakeUp.notify_all();
+        }
+        if (coalesced.size() >= coalescingOptions.maxBatches) {
+          group.swap(coalesced);
+        }
+      }
+    }
+    if (!group.empty()) {
+      SubmitCoalesced(std::move(group));
+    }
+  }
+
+  void ComputeEngine::SubmitCoalesced(std::vector<std::shared_ptr<Batch>>&& group) {
+    // the leader lets go of its members as it completes
+    std::vector<std::shared_ptr<Batch>> submitted = group;
+    std::shared_ptr<Batch> leader;
+    try {
+      if (group.size() == 1) {
+        group.front()->Submit();
+      } else {
+        bool parallel = true;
+        bool traced = true;
+        for (auto it = group.begin(); it != group.end(); it++) {
+          parallel = parallel && (*it)->parallel;
+          traced = traced && (*it)->trace;
+        }
+
+        // a batch of any member's kind would do: all run the same backend
+        leader = CreateBatch(parallel);
+        TraceTime now = std::chrono::steady_clock::now();
+        if (traced) {
+          leader->trace = std::make_unique<BatchTrace>();
+          leader->trace->submitted = now;
+          leader->trace->uploaded = now;
+        }
+        for (auto it = group.begin(); it != group.end(); it++) {
+          leader->Absorb(**it);
+          if (traced) {
+            // time spent in the window counts as waiting to be submitted
+            BatchTrace& memberTrace = *(*it)->trace;
+            memberTrace.submitted = now;
+            memberTrace.coalesced = group.size();
+            leader->trace->calls.insert(
+                leader->trace->calls.end(), memberTrace.calls.begin(), memberTrace.calls.end());
+          }
+        }
+        leader->members = std::move(group);
+        leader->Submit();
+      }
+    } catch (...) {
+      // may be running on the coalescer thread, with no one to catch: fail 
+      // the members instead, through the leader once it has taken them
+      std::exception_ptr error = std::current_exception();
+      if (leader && !leader->members.empty()) {
+        leader->Complete(error);
+      } else {
+        for (auto it = group.begin(); it != group.end(); it++) {
+          (*it)->Complete(error);
+        }
+      }
+    }
+
+    for (auto it = submitted.begin(); it != submitted.end(); it++) {
+      std::vector<std::shared_ptr<Batch>> ready = (*it)->MarkSubmitted();
+      for (auto r = ready.begin(); r != ready.end(); r++) {
+        (*r)->Start();
+      }
+    }
+  }
+
+  void ComputeEngine::RunCoalescer() {
+    std::unique_lock<std::mutex> lock(coalescingMutex);
+    while (!stopCoalescer) {
+      if (coalesced.empty()) {
+        coalescingWakeUp.wait(lock);
+        continue;
+      }
+
+      std::uint64_t current = window;
+      bool interrupted = coalescingWakeUp.wait_until(
+          lock, windowStart + coalescingOptions.window, [&]() { 
+            return stopCoalescer || window != current || coalesced.empty(); 
+          });
+      if (interrupted) {
+        // stopping, or the group was submitted for being full
+        continue;
+      }
+
+      std::vector<std::shared_ptr<Batch>> group;
+      group.swap(coalesced);
+      lock.unlock();
+      SubmitCoalesced(std::move(group));
+      lock.lock();
+    }
+  }
+
+
+
+  ComputeEngine::BatchBuilder::BatchBuilder(
+      const std::shared_ptr<ComputeEngine::Batch>& batch) : batch(batch) {}
+  ComputeEngine::BatchBuilder::BatchBuilder(
+      std::shared_ptr<ComputeEngine::Batch>&& batch) : batch(std::move(batch)) {}
+
+  ComputeEngine::CallBuilder ComputeEngine::BatchBuilder::WithGrid(
+      std::size_t numRows, std::size_t numCols, 
+      std::size_t workGroupRows, std::size_t workGroupCols) {
+
+    batch->grid = Grid {
+      .numRows = numRows,
+      .numCols = numCols,
+      .workGroupRows = workGroupRows,
+      .workGroupCols = workGroupCols
+    };
+
+    return ComputeEngine::CallBuilder(batch);
+  }
+
+  ComputeEngine::CallBuilder ComputeEngine::BatchBuilder::WithGrid(
+      std::size_t numRows, std::size_t numCols) {
+    return WithGrid(numRows, numCols, 0, 0);
+  }
+
+  ComputeEngine::CallBuilder ComputeEngine::BatchBuilder::WithGrid3D(
+      std::size_t numCols, std::size_t numRows, std::size_t numLayers,
+      std::size_t workGroupCols, std::size_t workGroupRows, std::size_t workGroupLayers) {
+
+    batch->grid = Grid {
+      .numRows = numRows,
+      .numCols = numCols,
+      .workGroupRows = workGroupRows,
+      .workGroupCols = workGroupCols,
+      .numLayers = numLayers,
+      .workGroupLayers = workGroupLayers
+    };
+
+    return ComputeEngine::CallBuilder(batch);
+  }
+
+  ComputeEngine::CallBuilder ComputeEngine::BatchBuilder::WithWorkGroups(
+      std::size_t numGroupCols, std::size_t numGroupRows, std::size_t numGroupLayers,
+      std::size_t workGroupCols, std::size_t workGroupRows, std::size_t workGroupLayers) {
+    if (!workGroupCols || !workGroupRows || !workGroupLayers) {
+      throw RuntimeException("Work-group dimensions must not be 0");
+    }
+
+    batch->grid = Grid {
+      .numRows = numGroupRows * workGroupRows,
+      .numCols = numGroupCols * workGroupCols,
+      .workGroupRows = workGroupRows,
+      .workGroupCols = workGroupCols,
+      .numLayers = numGroupLayers * workGroupLayers,
+      .workGroupLayers = workGroupLayers,
+      .byWorkGroups = true
+    };
+
+    return ComputeEngine::CallBuilder(batch);
+  }
+
+  ComputeEngine::CallBuilder ComputeEngine::BatchBuilder::WithIndirectGrid(
+      const private_buffer& buff, std::size_t offset, 
+      std::size_t workGroupCols, std::size_t workGroupRows, std::size_t workGroupLayers) {
+    if (batch->parallel) {
+      throw RuntimeException("Indirect grids can only be used in serial batches");
+    }
+    if (offset % alignof(IndirectGrid) || offset + sizeof(IndirectGrid) > buff.size) {
+      throw RuntimeException("Indirect grid out of the bounds of its buffer");
+    }
+    // validated before the grid is replaced, so that a call that throws 
+    // leaves the builder as it was. Dimensions are all 0 until it's read.
+    CallBuilder builder = WithWorkGroups(0, 0, 0, workGroupCols, workGroupRows, workGroupLayers);
+    batch->grid.indirect = true;
+    batch->grid.indirectId = buff.id;
+    batch->grid.indirectOffset = offset;
+    return builder;
+  }
+
+  ComputeEngine::CallBuilder ComputeEngine::BatchBuilder::WithIndirectGrid(
+      const ResidentBuffer& buff, std::size_t offset, 
+      std::size_t workGroupCols, std::size_t workGroupRows, std::size_t workGroupLayers) {
+    if (batch->parallel) {
+      throw RuntimeException("Indirect grids can only be used in serial batches");
+    }
+    if (!buff.GetStorage()) {
+      throw RuntimeException("Empty resident buffer");
+    }
+    if (offset % alignof(IndirectGrid) || offset + sizeof(IndirectGrid) > buff.Size()) {
+      throw RuntimeException("Indirect grid out of the bounds of its buffer");
+    }
+    CallBuilder builder = WithWorkGroups(0, 0, 0, workGroupCols, workGroupRows, workGroupLayers);
+    batch->grid.indirect = true;
+    batch->grid.indirectId = buff.Id();
+    batch->grid.indirectResident = buff.GetStorage();
+    batch->grid.indirectOffset = offset;
+    batch->residents.push_back(buff.GetSharedStorage());
+    batch->accesses.push_back(Access { 
+      .resource = buff.Id(), 
+      .size = buff.Size(), 
+      .write = false 
+    });
+    return builder;
+  }
+
+  ComputeEngine::BatchBuilder ComputeEngine::BatchBuilder::Reads(const ResidentBuffer& buff) {
+    batch->declared.push_back(Access {
+      .resource = buff.Id(),
+      .data = nullptr,
+      .size = buff.Size(),
+      .write = false
+    });
+    return *this;
+  }
+
+  ComputeEngine::BatchBuilder ComputeEngine::BatchBuilder::Writes(const ResidentBuffer& buff) {
+    batch->declared.push_back(Access {
+      .resource = buff.Id(),
+      .data = nullptr,
+      .size = buff.Size(),
+      .write = true
+    });
+    return *this;
+  }
+
+  ComputeEngine::Gate ComputeEngine::BatchBuilder::Dispatch() {
+    // a usage error, reported right away rather than through the Gate
+    if (dynamic_cast<RecordingBatch *>(batch.get())) {
+      throw RuntimeException("Batch templates are finished with Record(), not dispatched");
+    }
+    batch->engine->Schedule(batch);
+    return ComputeEngine::Gate(batch);
+  }
+
+  ComputeEngine::BatchTemplate ComputeEngine::BatchBuilder::Record() {
+    RecordingBatch * recording = dynamic_cast<RecordingBatch *>(batch.get());
+    if (!recording) {
+      throw RuntimeException("Only batches started with NewBatchTemplate() can be recorded");
+    }
+    BatchTemplate recorded = recording->recorded;
+    recorded.declared = batch->declared;
+    recorded.values = batch->values;
+    return recorded;
+  }
+
+
+  ComputeEngine::RecordingBatch::RecordingBatch(ComputeEngine * engine, bool parallel) 
+      : Batch(engine, parallel), recorded(engine, parallel) {}
+
+  void ComputeEngine::RecordingBatch::Encode(const KernelInfo& kernel) {
+    recorded.calls.push_back(BatchTemplate::RecordedCall {
+      .kernel = &kernel,
+      .grid = grid,
+      .firstArg = recorded.args.size(),
+      .numArgs = args.size(),
+      .inlineBegin = recorded.inlineValues.size(),
+      .inlineSize = inlineArgs.size()
+    });
+    recorded.inlineValues.insert(
+        recorded.inlineValues.end(), inlineArgs.begin(), inlineArgs.end());
+    if (grid.indirectResident) {
+      for (auto r = residents.begin(); r != residents.end(); r++) {
+        if (r->get() == grid.indirectResident) {
+          recorded.calls.back().indirectResident = *r;
+        }
+      }
+    } else if (grid.indirect) {
+      // private buffers get new ids on every dispatch
+      auto slot = slotsById.find(grid.indirectId);
+      if (slot == slotsById.end()) {
+        throw RuntimeException("Indirect grid read from a buffer no earlier call uses");
+      }
+      recorded.calls.back().grid.indirectId = slot->second;
+    }
+
+    for (auto it = args.begin(); it != args.end(); it++) {
+      recorded.args.push_back(*it);
+      recorded.residents.emplace_back();
+      if (it->type == BufferType::Inline) {
+        recorded.slots.push_back(static_cast<std::byte *>(it->data) - inlineArgs.data());
+        recorded.args.back().data = nullptr;
+      } else if (it->type == BufferType::Resident) {
+        recorded.slots.push_back(0);
+        for (auto r = residents.begin(); r != residents.end(); r++) {
+          if (r->get() == it->resident) {
+            recorded.residents.back() = *r;
+          }
+        }
+      } else {
+        auto slot = slotsById.emplace(it->id, recorded.numIds);
+        if (slot.second) {
+          recorded.numIds++;
+        }
+        recorded.slots.push_back(slot.first->second);
+      }
+    }
+  }
+
+  void ComputeEngine::RecordingBatch::Submit() {
+    throw RuntimeException("Batch templates are finished with Record(), not dispatched");
+  }
+
+
+  ComputeEngine::BatchTemplate::BatchTemplate(ComputeEngine * engine, bool parallel) 
+      : engine(engine), parallel(parallel) {}
+
+  std::size_t ComputeEngine::BatchTemplate::NumCalls() const {
+    return calls.size();
+  }
+
+  ComputeEngine::Argument& ComputeEngine::BatchTemplate::ArgumentAt(
+      std::size_t call, std::size_t arg, BufferType type) {
+    if (call >= calls.size() || arg >= calls[call].numArgs) {
+      throw RuntimeException("No such argument in batch template");
+    }
+    Argument& argument = args[calls[call].firstArg + arg];
+    if (argument.type != type) {
+      throw RuntimeException("Argument bound to a different kind of buffer than recorded");
+    }
+    return argument;
+  }
+
+  void ComputeEngine::BatchTemplate::Bind(
+      std::size_t call, std::size_t arg, const ResidentBuffer& buff) {
+    if (!buff.GetStorage()) {
+      throw RuntimeException("Empty resident buffer");
+    }
+    Argument& argument = ArgumentAt(call, arg, BufferType::Resident);
+    argument.id = buff.Id();
+    argument.size = buff.Size();
+    argument.resident = buff.GetStorage();
+    residents[calls[call].firstArg + arg] = buff.GetSharedStorage();
+  }
+
+  ComputeEngine::Gate ComputeEngine::BatchTemplate::Dispatch() const {
+    std::shared_ptr<Batch> batch = engine->CreateBatch(parallel);
+    if (engine->instrumented.load(std::memory_order_relaxed)) {
+      engine->StartTrace(*batch);
+    }
+    // buffers get fresh ids every time, so that dispatches in flight at the
+    // same time don't share device buffers
+    std::uint64_t firstId = idSeq.fetch_add(numIds) + 1;
+    batch->residents = residents;
+    batch->declared = declared;
+    batch->values = values;
+    for (auto it = boundValues.begin(); it != boundValues.end(); it++) {
+      if (*it) {
+        batch->values.push_back(*it);
+      }
+    }
+
+    for (auto call = calls.begin(); call != calls.end(); call++) {
+      batch->grid = call->grid;
+      if (call->indirectResident) {
+        batch->residents.push_back(call->indirectResident);
+        batch->accesses.push_back(Access { 
+          .resource = call->grid.indirectId, 
+          .size = call->indirectResident->Size(), 
+          .write = false 
+        });
+      } else if (call->grid.indirect) {
+        batch->grid.indirectId = firstId + call->grid.indirectId;
+      }
+      batch->inlineArgs.assign(
+          inlineValues.begin() + call->inlineBegin, 
+          inlineValues.begin() + call->inlineBegin + call->inlineSize);
+      batch->args.assign(
+          args.begin() + call->firstArg, args.begin() + call->firstArg + call->numArgs);
+      for (std::size_t i = 0; i < call->numArgs; i++) {
+        Argument& arg = batch->args[i];
+        std::size_t slot = slots[call->firstArg + i];
+        if (arg.type == BufferType::Inline) {
+          arg.data = batch->inlineArgs.data() + slot;
+        } else if (arg.type != BufferType::Resident) {
+          arg.id = firstId + slot;
+        }
+        batch->AddAccess(arg);
+      }
+      batch->EncodeCall(*call->kernel);
+    }
+
+    engine->Schedule(batch);
+    return Gate(batch);
+  }
+
+  ComputeEngine::CallBuilder::CallBuilder(
+      const std::shared_ptr<ComputeEngine::Batch>& batch) : batch(batch) {}
+  ComputeEngine::CallBuilder::CallBuilder(
+      std::shared_ptr<ComputeEngine::Batch>&& batch) : batch(std::move(batch)) {}
+
+
+  void ComputeEngine::CallBuilder::AddArgument(const ResidentBuffer& buff) {
+    if (!buff.GetStorage()) {
+      throw RuntimeException("Empty resident buffer");
+    }
+    batch->args.push_back(Argument {
+      .type = BufferType::Resident,
+      .id = buff.Id(),
+      .data = nullptr,
+      .size = buff.Size(),
+      .resident = buff.GetStorage()
+    });
+    batch->residents.push_back(buff.GetSharedStorage());
+    batch->AddAccess(batch->args.back());
+  }
+
+
+  ComputeEngine::Gate::Gate(const std::shared_ptr<ComputeEngine::Batch>& batch) 
+      : batch(batch) {}
+
+  void ComputeEngine::Gate::Wait() const {
+    batch->Wait();
+    if (batch->error) {
+      std::rethrow_exception(batch->error);
+    }
+  }
+
+  bool ComputeEngine::Gate::Done() const {
+    return batch->Done();
+  }
+
+  void ComputeEngine::Gate::Then(std::function<void(std::exception_ptr)> callback) const {
+    batch->Then(std::move(callback));
+  }
+
+  std::future<void> ComputeEngine::Gate::ToFuture() const {
+    std::shared_ptr<std::promise<void>> promise = std::make_shared<std::promise<void>>();
+    std::future<void> future = promise->get_future();
+    batch->Then([promise](std::exception_ptr error) {
+      if (error) {
+        promise->set_exception(error);
+      } else {
+        promise->set_value();
+      }
+    });
+    return future;
+  }
+
+  ComputeEngine::Gate::Awaiter ComputeEngine::Gate::operator co_await() const {
+    return Awaiter { .batch = batch };
+  }
+
+  bool ComputeEngine::Gate::Awaiter::await_ready() const {
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    return batch->done;
+  }
+
+  bool ComputeEngine::Gate::Awaiter::await_suspend(std::coroutine_handle<> handle) const {
+    // not through Then(): it would resume the coroutine on this thread, from
+    // within await_suspend, if the batch is already done
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    if (batch->done) {
+      return false;
+    }
+    batch->callbacks.push_back([handle](std::exception_ptr error) { handle.resume(); });
+    return true;
+  }
+
+  void ComputeEngine::Gate::Awaiter::await_resume() const {
+    if (batch->error) {
+      std::rethrow_exception(batch->error);
+    }
+  }
+} // compute
+} // mdl
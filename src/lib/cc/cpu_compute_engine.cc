@@ -0,0 +1,449 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/compute_exception.h"
+#include "../h/cpu_compute_engine.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+
+namespace mdl {
+namespace compute {
+  namespace {
+    // local arguments start on cache line boundaries
+    constexpr std::size_t kLocalAlignment = 64;
+
+    // Scratch memory for the local arguments of work-groups run by the 
+    // calling thread. "size" is a multiple of kLocalAlignment.
+    std::byte * LocalScratch(std::size_t size) {
+      thread_local std::unique_ptr<std::byte, decltype(&std::free)> scratch(nullptr, &std::free);
+      thread_local std::size_t capacity = 0;
+      if (capacity < size) {
+        scratch.reset(static_cast<std::byte *>(std::aligned_alloc(kLocalAlignment, size)));
+        capacity = scratch ? size : 0;
+        if (!scratch) {
+          throw std::bad_alloc();
+        }
+      }
+      return scratch.get();
+    }
+  }
+
+  CpuKernelArgs::CpuKernelArgs(void * const * args, std::size_t count)
+      : args(args), count(count) {}
+
+  std::size_t CpuKernelArgs::Count() const {
+    return count;
+  }
+
+
+  void * CpuComputeEngine::CpuBufferAllocator::Allocate(
+      std::size_t capacity, std::uint32_t storageMode) {
+    // capacities are powers of two, no smaller than BufferPool::kMinBlockSize
+    return std::aligned_alloc(64, capacity);
+  }
+
+  void CpuComputeEngine::CpuBufferAllocator::Free(
+      void * handle, std::size_t capacity, std::uint32_t storageMode) {
+    std::free(handle);
+  }
+
+
+  CpuComputeEngine::CpuResidentStorage::CpuResidentStorage(std::size_t size) 
+      : ResidentStorage(size), memory(new std::byte[size]) {}
+
+  void CpuComputeEngine::CpuResidentStorage::Update(
+      const void * data, std::size_t size, std::size_t offset) {
+    std::memcpy(memory.get() + offset, data, size);
+  }
+
+  void CpuComputeEngine::CpuResidentStorage::Download(
+      void * data, std::size_t size, std::size_t offset) const {
+    std::memcpy(data, memory.get() + offset, size);
+  }
+
+
+  CpuComputeEngine::CpuBatch::CpuBatch(CpuComputeEngine * engine, bool parallel) 
+      : Batch(engine, parallel) {}
+
+  CpuComputeEngine::CpuBatch::~CpuBatch() {
+    ReleaseBuffers();
+  }
+
+  void CpuComputeEngine::CpuBatch::ReleaseBuffers() {
+    BufferPool& bufferPool = static_cast<CpuComputeEngine *>(engine)->bufferPool;
+    for (auto it = privateBuffers.begin(); it != privateBuffers.end(); it++) {
+      bufferPool.Release(it->second);
+    }
+    privateBuffers.clear();
+  }
+
+  void CpuComputeEngine::CpuBatch::Encode(const KernelInfo& kernel) {
+    Command command {
+      .kernel = static_cast<const CpuKernel *>(kernel.handle),
+      .grid = grid
+    };
+    command.grid.workGroupRows = std::max<std::size_t>(1, grid.workGroupRows);
+    command.grid.workGroupCols = std::max<std::size_t>(1, grid.workGroupCols);
+    command.grid.workGroupLayers = std::max<std::size_t>(1, grid.workGroupLayers);
+
+    // inline arguments are captured by value: the batch's copy is only good
+    // until the next call is built
+    command.inlineArgs.assign(inlineArgs.begin(), inlineArgs.end());
+    command.args.reserve(args.size());
+    for (auto it = args.begin(); it != args.end(); it++) {
+      if (it->type == BufferType::Inline) {
+        std::size_t offset = static_cast<std::byte *>(it->data) - inlineArgs.data();
+        command.args.push_back(command.inlineArgs.data() + offset);
+      } else if (it->type == BufferType::Local) {
+        // bound to scratch memory as work-groups run
+        command.locals.emplace_back(command.args.size(), command.localSize);
+        command.localSize += (it->size + kLocalAlignment - 1) / kLocalAlignment * kLocalAlignment;
+        command.args.push_back(nullptr);
+      } else {
+        command.args.push_back(GetBuffer(*it));
+      }
+    }
+    if (grid.indirect) {
+      const std::byte * memory;
+      if (grid.indirectResident) {
+        memory = static_cast<CpuResidentStorage *>(grid.indirectResident)->memory.get();
+      } else {
+        auto it = privateBuffers.find(grid.indirectId);
+        if (it == privateBuffers.end()) {
+          throw RuntimeException("Indirect grid read from a buffer no earlier call uses");
+        }
+        memory = static_cast<const std::byte *>(it->second.handle);
+      }
+      command.indirect = reinterpret_cast<const IndirectGrid *>(memory + grid.indirectOffset);
+    }
+    commands.push_back(std::move(command));
+  }
+
+  void CpuComputeEngine::CpuBatch::Absorb(Batch& other) {
+    CpuBatch& batch = static_cast<CpuBatch&>(other);
+    // commands own their inline arguments, so they can move as they are
+    std::move(batch.commands.begin(), batch.commands.end(), std::back_inserter(commands));
+    batch.commands.clear();
+    privateBuffers.merge(batch.privateBuffers);
+  }
+
+  void * CpuComputeEngine::CpuBatch::GetBuffer(const Argument& arg) {
+    // all buffers but "private" and resident ones are bound in place. Kernels 
+    // must not write to "in" buffers.
+    if (arg.type == BufferType::Resident) {
+      return static_cast<CpuResidentStorage *>(arg.resident)->memory.get();
+    }
+    if (arg.type != BufferType::Private) {
+      return arg.data;
+    }
+
+    auto it = privateBuffers.find(arg.id);
+    if (it == privateBuffers.end()) {
+      BufferPool& bufferPool = static_cast<CpuComputeEngine *>(engine)->bufferPool;
+      it = privateBuffers.emplace(arg.id, bufferPool.Acquire(arg.size, 0)).first;
+    }
+    return it->second.handle;
+  }
+
+  void CpuComputeEngine::CpuBatch::Submit() {
+    if (trace) {
+      trace->started = std::chrono::steady_clock::now();
+    }
+    static_cast<CpuComputeEngine *>(engine)->StartCommands(
+        std::static_pointer_cast<CpuBatch>(shared_from_this()));
+  }
+
+
+  CpuComputeEngine::CpuComputeEngine(std::size_t numThreads) 
+      : bufferPool(&allocator), pool(numThreads), cacheSize(kDefaultCacheSize) {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 > 0) {
+      cacheSize = l2;
+    }
+#endif
+  }
+
+  CpuComputeEngine::~CpuComputeEngine() {
+    StopCoalescing();
+  }
+
+  const char * CpuComputeEngine::Backend() const {
+    return "cpu";
+  }
+
+  bool CpuComputeEngine::Available() const {
+    return true;
+  }
+
+  void CpuComputeEngine::LoadLibrary(const std::string& sourceCode) {
+    throw CompilationException(
+        "The CPU backend can't compile kernel source, use RegisterKernel() instead");
+  }
+
+  BufferPool& CpuComputeEngine::GetBufferPool() {
+    return bufferPool;
+  }
+
+  std::size_t CpuComputeEngine::NumThreads() const {
+    return pool.Size();
+  }
+
+  void CpuComputeEngine::RegisterKernel(
+      const std::string& functionName, const CpuKernel& kernel) {
+    std::lock_guard<std::mutex> lock(kernelsByFnMutex);
+    kernelsByFn[functionName] = kernel;
+  }
+
+  bool CpuComputeEngine::ContainsFunction(const std::string& functionName) const {
+    std::lock_guard<std::mutex> lock(kernelsByFnMutex);
+    return kernelsByFn.count(functionName);
+  }
+
+  std::shared_ptr<ComputeEngine::Batch> CpuComputeEngine::CreateBatch(bool parallel) {
+    return std::make_shared<CpuBatch>(this, parallel);
+  }
+
+  std::shared_ptr<ResidentStorage> CpuComputeEngine::CreateResidentStorage(std::size_t size) {
+    return std::make_shared<CpuResidentStorage>(size);
+  }
+
+  void CpuComputeEngine::LoadKernel(KernelInfo& kernel) {
+    std::lock_guard<std::mutex> lock(kernelsByFnMutex);
+    auto it = kernelsByFn.find(kernel.name);
+    if (it == kernelsByFn.end()) {
+      throw FunctionNotFoundException(std::string("Function not found: ") + kernel.name);
+    }
+    // work-groups run sequentially on a single thread, so there's no real 
+    // limit to their size
+    kernel.handle = &it->second;
+    kernel.maxThreadsPerWorkGroup = std::numeric_limits<std::size_t>::max();
+    kernel.executionWidth = 1;
+  }
+
+  std::vector<std::string> CpuComputeEngine::FunctionNames() const {
+    std::lock_guard<std::mutex> lock(kernelsByFnMutex);
+    std::vector<std::string> names;
+    for (auto it = kernelsByFn.begin(); it != kernelsByFn.end(); it++) {
+      names.push_back(it->first);
+    }
+    return names;
+  }
+
+
+  void CpuComputeEngine::SizeWorkGroup(
+      const KernelInfo& kernel, Grid& grid, const std::vector<Argument>& args) const {
+    if (FindTunedWorkGroup(kernel, grid)) {
+      return;
+    }
+
+    std::size_t numThreads = std::max<std::size_t>(1, grid.NumThreads());
+    std::size_t maxGroups = pool.Size() * 4;
+    std::size_t size = (numThreads + maxGroups - 1) / maxGroups;
+    std::size_t numBytes = 0;
+    for (auto it = args.begin(); it != args.end(); it++) {
+      if (it->type != BufferType::Inline) {
+        numBytes += it->size;
+      }
+    }
+    std::size_t bytesPerThread = (numBytes + numThreads - 1) / numThreads;
+    if (bytesPerThread) {
+      size = std::clamp<std::size_t>(cacheSize / bytesPerThread, 1, size);
+    }
+
+    // whole rows where possible, as they are contiguous in memory
+    std::size_t numCols = std::max<std::size_t>(1, grid.numCols);
+    if (size >= numCols) {
+      grid.workGroupRows = std::min(size / numCols, std::max<std::size_t>(1, grid.numRows));
+      grid.workGroupCols = numCols;
+    } else {
+      grid.workGroupRows = 1;
+      grid.workGroupCols = size;
+    }
+    grid.workGroupLayers = 1;
+  }
+
+  void CpuComputeEngine::StartCommands(const std::shared_ptr<CpuBatch>& batch) {
+    // Serial batches run one command at a time, the last task of a command
+    // starting the next one. Parallel batches schedule every command at once.
+    // Commands with empty grids schedule nothing, so we just skip past them.
+    if (batch->trace) {
+      TraceCommands(*batch);
+    }
+
+    while (batch->nextCommand < batch->commands.size()) {
+      std::size_t first = batch->nextCommand;
+      std::size_t last = batch->parallel ? batch->commands.size() : first + 1;
+
+      std::size_t numTasks = 0;
+      for (std::size_t i = first; i < last; i++) {
+        Command& command = batch->commands[i];
+        if (command.indirect) {
+          // written by the commands before, which have all finished
+          command.grid.numCols = command.indirect->numGroupCols * command.grid.workGroupCols;
+          command.grid.numRows = command.indirect->numGroupRows * command.grid.workGroupRows;
+          command.grid.numLayers = 
+              command.indirect->numGroupLayers * command.grid.workGroupLayers;
+        }
+        numTasks += NumTasks(command);
+      }
+
+      batch->nextCommand = last;
+      if (batch->trace) {
+        TraceTime now = std::chrono::steady_clock::now();
+        for (std::size_t i = first; i < last; i++) {
+          batch->trace->calls[i].executeBegin = now;
+        }
+      }
+      if (numTasks == 0) {
+        continue;
+      }
+
+      // one extra count held by this thread until all tasks are submitted, so
+      // that the batch can't complete (or move on) while still scheduling
+      batch->pendingTasks = numTasks + 1;
+      for (std::size_t i = first; i < last; i++) {
+        SubmitCommand(batch, batch->commands[i]);
+      }
+      FinishTask(batch);
+      return;
+    }
+
+    Complete(batch);
+  }
+
+  void CpuComputeEngine::TraceCommands(CpuBatch& batch) {
+    // commands started so far have all finished
+    TraceTime now = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < batch.nextCommand; i++) {
+      CallTrace& call = batch.trace->calls[i];
+      if (call.executeEnd == TraceTime()) {
+        call.executeEnd = now;
+      }
+    }
+  }
+
+  std::size_t CpuComputeEngine::GroupsPerTask(const Command& command) const {
+    // a few tasks per worker gives stealing something to balance with without
+    // paying for a task per (possibly tiny) work-group
+    std::size_t numGroups = command.NumGroups();
+    std::size_t maxTasks = pool.Size() * 4;
+    return std::max<std::size_t>(1, (numGroups + maxTasks - 1) / maxTasks);
+  }
+
+  std::size_t CpuComputeEngine::NumTasks(const Command& command) const {
+    std::size_t numGroups = command.NumGroups();
+    std::size_t groupsPerTask = GroupsPerTask(command);
+    return (numGroups + groupsPerTask - 1) / groupsPerTask;
+  }
+
+  void CpuComputeEngine::SubmitCommand(
+      const std::shared_ptr<CpuBatch>& batch, const Command& command) {
+    std::size_t numGroups = command.NumGroups();
+    std::size_t groupsPerTask = GroupsPerTask(command);
+
+    for (std::size_t begin = 0; begin < numGroups; begin += groupsPerTask) {
+      std::size_t end = std::min(numGroups, begin + groupsPerTask);
+      pool.Submit([this, batch, &command, begin, end]() {
+        try {
+          const Grid& grid = command.grid;
+          // work-groups of a task run one after the other, so they can all 
+          // use the same scratch memory
+          std::vector<void *> bound;
+          if (command.localSize) {
+            bound = command.args;
+            std::byte * scratch = LocalScratch(command.localSize);
+            for (auto it = command.locals.begin(); it != command.locals.end(); it++) {
+              bound[it->first] = scratch + it->second;
+            }
+          }
+          CpuKernelArgs args(
+              command.localSize ? bound.data() : command.args.data(), command.args.size());
+          std::size_t groupCols = command.NumGroupCols();
+          std::size_t groupsPerLayer = command.NumGroupRows() * groupCols;
+          for (std::size_t g = begin; g < end; g++) {
+            CpuWorkGroup group;
+            group.layer = g / groupsPerLayer;
+            group.row = g % groupsPerLayer / groupCols;
+            group.col = g % groupCols;
+            group.layerBegin = group.layer * grid.workGroupLayers;
+            group.layerEnd = std::min(grid.numLayers, group.layerBegin + grid.workGroupLayers);
+            group.rowBegin = group.row * grid.workGroupRows;
+            group.rowEnd = std::min(grid.numRows, group.rowBegin + grid.workGroupRows);
+            group.colBegin = group.col * grid.workGroupCols;
+            group.colEnd = std::min(grid.numCols, group.colBegin + grid.workGroupCols);
+            (*command.kernel)(group, args);
+          }
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(batch->mutex);
+          if (!batch->kernelError) {
+            batch->kernelError = std::current_exception();
+          }
+        }
+        FinishTask(batch);
+      });
+    }
+  }
+
+  void CpuComputeEngine::FinishTask(const std::shared_ptr<CpuBatch>& batch) {
+    if (batch->pendingTasks.fetch_sub(1) == 1) {
+      StartCommands(batch);
+    }
+  }
+
+  void CpuComputeEngine::Complete(const std::shared_ptr<CpuBatch>& batch) {
+    if (batch->trace) {
+      TraceCommands(*batch);
+      batch->trace->executed = std::chrono::steady_clock::now();
+    }
+    // give buffers back to the pool right away rather than whenever the last
+    // reference to the batch goes away, which may be after the engine is 
+    // gone. Coalesced batches may hold private buffers too.
+    batch->ReleaseBuffers();
+    for (auto it = batch->members.begin(); it != batch->members.end(); it++) {
+      static_cast<CpuBatch&>(**it).ReleaseBuffers();
+    }
+
+    std::exception_ptr error;
+    {
+      std::lock_guard<std::mutex> lock(batch->mutex);
+      error = batch->kernelError;
+    }
+    batch->Complete(error);
+  }
+} // compute
+} // mdl
@@ -0,0 +1,68 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/compute_exception.h"
+#include "../h/file_util.h"
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+namespace mdl {
+namespace compute {
+  namespace {
+    std::atomic_size_t seq = 0;
+    const std::uint64_t processTag = std::random_device{}();
+  }
+
+  std::string UniquePath(const std::string& base) {
+    return base + std::to_string(processTag) + "-" + std::to_string(++seq);
+  }
+
+  void WriteFileAtomically(const std::string& path, const void * data, std::size_t size) {
+    std::string tmpPath = UniquePath(path + ".tmp");
+    {
+      std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+      if (!file.write(static_cast<const char *>(data), size) || !file.flush()) {
+        file.close();
+        std::error_code ignored;
+        std::filesystem::remove(tmpPath, ignored);
+        throw RuntimeException(std::string("Could not write file: ") + tmpPath);
+      }
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path, error);
+    if (error) {
+      std::filesystem::remove(tmpPath, error);
+      throw RuntimeException(std::string("Could not write file: ") + path);
+    }
+  }
+} // compute
+} // mdl
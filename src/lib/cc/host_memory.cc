@@ -0,0 +1,168 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/host_memory.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <new>
+
+namespace mdl {
+namespace compute {
+  namespace {
+#ifdef __linux__
+    // THP uses 2MB pages on the platforms we run on
+    constexpr std::size_t kHugePageSize = 2 * 1024 * 1024;
+
+    void AdviseHugePages(void * data, std::size_t size) {
+      madvise(data, size, MADV_HUGEPAGE);
+    }
+
+    void BindToNode(void * data, std::size_t size, int numaNode) {
+      constexpr std::size_t kBitsPerWord = sizeof(unsigned long) * CHAR_BIT;
+      if (static_cast<std::size_t>(numaNode) >= kBitsPerWord * 16) {
+        return;
+      }
+      unsigned long nodeMask[16] = {};
+      nodeMask[numaNode / kBitsPerWord] = 1ul << (numaNode % kBitsPerWord);
+      // a preference rather than a hard binding, so that allocations still
+      // succeed when the node runs out of memory. Nothing to do if it fails.
+      syscall(SYS_mbind, data, size, MPOL_PREFERRED, nodeMask, kBitsPerWord * 16, 0);
+    }
+#else
+    constexpr std::size_t kHugePageSize = 0;
+
+    void AdviseHugePages(void * data, std::size_t size) {}
+
+    void BindToNode(void * data, std::size_t size, int numaNode) {}
+#endif
+
+    void * Map(std::size_t size) {
+      // mmap hands out whole, zeroed pages
+      void * data = mmap(nullptr, size, PROT_READ | PROT_WRITE, 
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (data == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      return data;
+    }
+
+    // Live allocations: mapped size by address. Function statics, so that
+    // memory can be allocated during static initialization.
+    struct Allocations {
+      std::mutex mutex;
+      std::map<std::uintptr_t, std::size_t> sizes;
+    };
+
+    Allocations& LiveAllocations() {
+      static Allocations allocations;
+      return allocations;
+    }
+
+    // Maps "size" bytes aligned to "alignment" (a multiple of the page size),
+    // by mapping extra and unmapping what's left on either side.
+    void * MapAligned(std::size_t size, std::size_t alignment) {
+      std::byte * data = static_cast<std::byte *>(Map(size + alignment));
+      std::size_t head = (alignment 
+          - reinterpret_cast<std::uintptr_t>(data) % alignment) % alignment;
+      if (head > 0) {
+        munmap(data, head);
+      }
+      munmap(data + head + size, alignment - head);
+      return data + head;
+    }
+  }
+
+  std::size_t HostPageSize() {
+    static const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+    return pageSize;
+  }
+
+  bool IsPageAligned(const void * data) {
+    return reinterpret_cast<std::uintptr_t>(data) % HostPageSize() == 0;
+  }
+
+  std::size_t RoundUpToPage(std::size_t size) {
+    std::size_t pageSize = HostPageSize();
+    return (size + pageSize - 1) / pageSize * pageSize;
+  }
+
+  void * AllocateHostMemory(std::size_t size, const HostMemoryOptions& options) {
+    std::size_t mappedSize = RoundUpToPage(size == 0 ? 1 : size);
+    // huge pages only back whole, aligned huge page ranges
+    bool hugePages = options.hugePages && kHugePageSize > 0 && mappedSize >= kHugePageSize;
+    void * data = hugePages ? MapAligned(mappedSize, kHugePageSize) : Map(mappedSize);
+    if (hugePages) {
+      AdviseHugePages(data, mappedSize);
+    }
+    if (options.numaNode >= 0) {
+      BindToNode(data, mappedSize, options.numaNode);
+    }
+
+    Allocations& allocations = LiveAllocations();
+    std::lock_guard<std::mutex> lock(allocations.mutex);
+    allocations.sizes[reinterpret_cast<std::uintptr_t>(data)] = mappedSize;
+    return data;
+  }
+
+  void FreeHostMemory(void * data, std::size_t size) {
+    if (data) {
+      {
+        Allocations& allocations = LiveAllocations();
+        std::lock_guard<std::mutex> lock(allocations.mutex);
+        allocations.sizes.erase(reinterpret_cast<std::uintptr_t>(data));
+      }
+      munmap(data, RoundUpToPage(size == 0 ? 1 : size));
+    }
+  }
+
+  bool IsHostMemory(const void * data, std::size_t size) {
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(data);
+    Allocations& allocations = LiveAllocations();
+    std::lock_guard<std::mutex> lock(allocations.mutex);
+    // the allocation starting at or before "data", if any
+    auto it = allocations.sizes.upper_bound(address);
+    if (it == allocations.sizes.begin()) {
+      return false;
+    }
+    it--;
+    std::size_t offset = address - it->first;
+    return offset < it->second && size <= it->second - offset;
+  }
+} // compute
+} // mdl
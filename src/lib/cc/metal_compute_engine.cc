@@ -27,6 +27,9 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "../h/compute_exception.h"
+#include "../h/file_util.h"
+#include "../h/host_memory.h"
+#include "../h/parallel_copy.h"
 #include "../h/metal_compute_engine.h"
 
 #define NS_PRIVATE_IMPLEMENTATION
@@ -36,7 +39,13 @@
 #include <Metal/Metal.hpp>
 #include <QuartzCore/QuartzCore.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <string_view>
 
@@ -45,80 +54,567 @@ using std::endl;
 
 namespace mdl {
 namespace compute {
+  namespace {
+    // binary archives can only be read from and written to files
+    std::string TempArchivePath() {
+      return UniquePath((std::filesystem::temp_directory_path() / "mdlcompute-").string()) 
+          + ".metallib";
+    }
 
-  MetalComputeEngine::Batch::Batch(
-      MetalComputeEngine * engine, bool parallel) 
-      : autoReleasePool(NS::AutoreleasePool::alloc()->init()),
-        engine(engine), commandBuffer(engine->commandQueue->commandBuffer()), 
-        encoder(commandBuffer->computeCommandEncoder(parallel 
-            ? MTL::DispatchType::DispatchTypeConcurrent 
-            : MTL::DispatchType::DispatchTypeSerial)) {
+    NS::URL * FileUrl(const std::string& path) {
+      return NS::URL::fileURLWithPath(NS::String::string(path.c_str(), NS::UTF8StringEncoding));
+    }
+  }
+
+  void * MetalComputeEngine::MetalBufferAllocator::Allocate(
+      std::size_t capacity, std::uint32_t storageMode) {
+    return device->newBuffer(capacity, MTL::ResourceOptions(storageMode));
+  }
+
+  void MetalComputeEngine::MetalBufferAllocator::Free(
+      void * handle, std::size_t capacity, std::uint32_t storageMode) {
+    static_cast<MTL::Buffer *>(handle)->release();
+  }
+
+
+  MetalComputeEngine::MetalResidentStorage::MetalResidentStorage(
+      MTL::Device * device, MTL::CommandQueue * commandQueue, std::size_t size) 
+      : ResidentStorage(size), 
+        mtlBuffer(device->newBuffer(size, MTL::ResourceStorageModeManaged)),
+        commandQueue(commandQueue->retain()) {}
+
+  MetalComputeEngine::MetalResidentStorage::~MetalResidentStorage() {
+    mtlBuffer->release();
+    commandQueue->release();
   }
 
-  MetalComputeEngine::Batch::~Batch() {
+  void MetalComputeEngine::MetalResidentStorage::Update(
+      const void * data, std::size_t size, std::size_t offset) {
+    std::memcpy(static_cast<std::byte *>(mtlBuffer->contents()) + offset, data, size);
+    mtlBuffer->didModifyRange(NS::Range::Make(offset, size));
+  }
+
+  void MetalComputeEngine::MetalResidentStorage::Download(
+      void * data, std::size_t size, std::size_t offset) const {
+    // batches leave what they wrote on the GPU, so that a buffer bound to
+    // many batches isn't copied back after each of them: it is only brought
+    // back here, when the application asks for it
+    NS::AutoreleasePool* autoReleasePool = NS::AutoreleasePool::alloc()->init();
+    MTL::CommandBuffer * commandBuffer = commandQueue->commandBuffer();
+    MTL::BlitCommandEncoder * bltEncoder = commandBuffer->blitCommandEncoder();
+    bltEncoder->synchronizeResource(mtlBuffer);
+    bltEncoder->endEncoding();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+    autoReleasePool->release();
+
+    std::memcpy(data, static_cast<std::byte *>(mtlBuffer->contents()) + offset, size);
+  }
+
+
+  MetalComputeEngine::MetalBatch::MetalBatch(
+      MetalComputeEngine * engine, bool parallel) 
+      : Batch(engine, parallel), commandBuffer(nullptr), encoder(nullptr), event(nullptr) {}
+
+  MetalComputeEngine::MetalBatch::~MetalBatch() {
     if (encoder) {
       encoder->endEncoding();
+      encoder->release();
+    }
+    if (commandBuffer) {
+      commandBuffer->release();
     }
+    if (event) {
+      event->release();
+    }
+    ReleaseBuffers();
+  }
 
-    if (autoReleasePool) {
-      autoReleasePool->release();
+  std::vector<MetalComputeEngine::MetalBatch *> MetalComputeEngine::MetalBatch::Submitted() {
+    std::vector<MetalBatch *> submitted;
+    if (members.empty()) {
+      submitted.push_back(this);
+    }
+    for (auto it = members.begin(); it != members.end(); it++) {
+      submitted.push_back(static_cast<MetalBatch *>(it->get()));
+    }
+    return submitted;
+  }
+
+  void MetalComputeEngine::MetalBatch::ReleaseBuffers() {
+    MetalComputeEngine * metalEngine = static_cast<MetalComputeEngine *>(engine);
+    for (auto it = regions.begin(); it != regions.end(); it++) {
+      if (it->wrapped) {
+        it->mtlBuffer->release();
+      } else if (it->staged.handle) {
+        metalEngine->stagingRing.Release(it->staged);
+      } else if (it->block.handle) {
+        metalEngine->bufferPool.Release(it->block);
+      }
     }
+    regions.clear();
     for (auto it = buffers.begin(); it != buffers.end(); it++) {
-      engine->ReleaseBuffer(it->first);
+      metalEngine->bufferPool.Release(it->second);
     }
+    buffers.clear();
   }
 
-  template <>
-  void MetalComputeEngine::Batch::AddBuffer<in_buffer>(const in_buffer& buff) {
-    if (!buffers.contains(buff.id)) {
-      buffers[buff.id] = BufferDescriptor {
-        .mtlBuffer = engine->GetBuffer(buff),
-        .appBuffer = nullptr,
-        .size = buff.size,
-        .bufferType = buff.GetType()
-      };
+  void MetalComputeEngine::MetalBatch::Encode(const KernelInfo& kernel) {
+    MetalCommand command {
+      .pipeline = static_cast<MTL::ComputePipelineState *>(kernel.handle),
+      .grid = grid,
+      .args = args
+    };
+
+    // inline arguments are captured by value: the batch's copy is only good
+    // until the next call is built
+    command.inlineArgs.assign(inlineArgs.begin(), inlineArgs.end());
+    for (auto it = command.args.begin(); it != command.args.end(); it++) {
+      if (it->type == BufferType::Inline) {
+        std::size_t offset = static_cast<std::byte *>(it->data) - inlineArgs.data();
+        it->data = command.inlineArgs.data() + offset;
+      }
     }
-    encoder->setBuffer(buffers[buff.id].mtlBuffer, 0, argIndex);
-    argIndex++;
+    if (grid.indirect && !grid.indirectResident) {
+      // the buffer is allocated as the first call using it is encoded
+      bool found = false;
+      for (auto c = commands.begin(); c != commands.end() && !found; c++) {
+        for (auto arg = c->args.begin(); arg != c->args.end() && !found; arg++) {
+          found = arg->type == BufferType::Private && arg->id == grid.indirectId;
+        }
+      }
+      if (!found) {
+        throw RuntimeException("Indirect grid read from a buffer no earlier call uses");
+      }
+    }
+    commands.push_back(std::move(command));
   }
 
-  template <>
-  void MetalComputeEngine::Batch::AddBuffer<private_buffer>(const private_buffer& buff) {
-    if (!buffers.contains(buff.id)) {
-      buffers[buff.id] = BufferDescriptor {
-        .mtlBuffer = engine->GetBuffer(buff),
-        .appBuffer = nullptr,
-        .size = buff.size,
-        .bufferType = buff.GetType()
-      };
+  void MetalComputeEngine::MetalBatch::Absorb(Batch& other) {
+    // calls are only encoded on submission, so absorbing a batch is just 
+    // taking its commands. Batches coalesced together may use the same 
+    // private buffer handles, but not the same buffers: their private ids 
+    // are renamed.
+    MetalBatch& batch = static_cast<MetalBatch&>(other);
+    std::unordered_map<std::size_t, std::size_t> privateIds;
+    auto rename = [&privateIds](std::size_t id) {
+      auto it = privateIds.find(id);
+      if (it == privateIds.end()) {
+        it = privateIds.emplace(id, ++idSeq).first;
+      }
+      return it->second;
+    };
+    for (auto command = batch.commands.begin(); command != batch.commands.end(); command++) {
+      for (auto arg = command->args.begin(); arg != command->args.end(); arg++) {
+        if (arg->type == BufferType::Private) {
+          arg->id = rename(arg->id);
+        }
+      }
+      if (command->grid.indirect && !command->grid.indirectResident) {
+        command->grid.indirectId = rename(command->grid.indirectId);
+      }
     }
-    encoder->setBuffer(buffers[buff.id].mtlBuffer, 0, argIndex);
-    argIndex++;
+    std::move(batch.commands.begin(), batch.commands.end(), std::back_inserter(commands));
+    batch.commands.clear();
   }
 
+  void MetalComputeEngine::MetalBatch::MapRegions() {
+    struct HostArgument {
+      std::byte * data;
+      std::size_t size;
+      BufferType type;
+      std::size_t command;
+      std::size_t arg;
+    };
+
+    std::vector<HostArgument> hostArgs;
+    for (std::size_t i = 0; i < commands.size(); i++) {
+      MetalCommand& command = commands[i];
+      command.regions.resize(command.args.size());
+      for (std::size_t j = 0; j < command.args.size(); j++) {
+        const Argument& arg = command.args[j];
+        if (arg.type == BufferType::In || arg.type == BufferType::Out
+            || arg.type == BufferType::InOut || arg.type == BufferType::Shared) {
+          hostArgs.push_back(HostArgument {
+            .data = static_cast<std::byte *>(arg.data),
+            .size = arg.size,
+            .type = arg.type,
+            .command = i,
+            .arg = j
+          });
+        }
+      }
+    }
+    std::sort(hostArgs.begin(), hostArgs.end(), 
+        [](const HostArgument& a, const HostArgument& b) { return a.data < b.data; });
+
+    // sweep arguments by address, starting a new region at every gap
+    std::vector<bool> allShared;
+    for (auto it = hostArgs.begin(); it != hostArgs.end(); it++) {
+      if (regions.empty() || it->data > regions.back().data + regions.back().size) {
+        regions.push_back(HostRegion {
+          .data = it->data,
+          .size = 0,
+          .mtlBuffer = nullptr,
+          .offset = 0,
+          .staged = {},
+          .block = {},
+          .wrapped = false,
+          .upload = false,
+          .uploadType = it->type
+        });
+        allShared.push_back(true);
+      }
 
-  MetalComputeEngine::MetalComputeEngine() {
+      HostRegion& region = regions.back();
+      std::size_t offset = it->data - region.data;
+      region.size = std::max(region.size, offset + it->size);
+      if (it->type != BufferType::Out && !region.upload) {
+        region.upload = true;
+        region.uploadType = it->type;
+      }
+      if (it->type != BufferType::In) {
+        region.writes.push_back(HostRange {
+          .offset = offset,
+          .size = it->size,
+          .bufferType = it->type
+        });
+      }
+      allShared.back() = allShared.back() && it->type == BufferType::Shared;
+      commands[it->command].regions[it->arg] = regions.size() - 1;
+    }
+
+    MetalComputeEngine * metalEngine = static_cast<MetalComputeEngine *>(engine);
+    MTL::Device * device = metalEngine->device;
+    for (std::size_t i = 0; i < regions.size(); i++) {
+      HostRegion& region = regions[i];
+      // arguments binding the same range copy it back once
+      std::sort(region.writes.begin(), region.writes.end(), 
+          [](const HostRange& a, const HostRange& b) {
+            return a.offset < b.offset || (a.offset == b.offset && a.size < b.size);
+          });
+      region.writes.erase(
+          std::unique(region.writes.begin(), region.writes.end(), 
+              [](const HostRange& a, const HostRange& b) {
+                return a.offset == b.offset && a.size == b.size;
+              }),
+          region.writes.end());
+
+      // Metal only wraps memory that was mapped whole, page by page: memory
+      // from AllocateHostMemory() (e.g. a host_vector) qualifies, anything 
+      // else is copied. The buffer is rounded up to a page, which is still 
+      // part of the allocation.
+      std::size_t wrappedSize = RoundUpToPage(region.size);
+      bool hostMemory = IsPageAligned(region.data) && IsHostMemory(region.data, wrappedSize);
+      if (hostMemory && (allShared[i] || device->hasUnifiedMemory())) {
+        // used in place: always for shared buffers, and for the others when
+        // the GPU reads host memory as fast as its own
+        region.mtlBuffer = device->newBuffer(region.data, wrappedSize, 
+            MTL::ResourceStorageModeShared, nullptr);
+        region.wrapped = region.mtlBuffer != nullptr;
+      }
+      if (!region.wrapped && region.size <= kMaxStagedSize) {
+        region.staged = metalEngine->stagingRing.Allocate(region.size);
+        region.mtlBuffer = static_cast<MTL::Buffer *>(region.staged.handle);
+        region.offset = region.staged.offset;
+      }
+      if (!region.wrapped && !region.staged.handle) {
+        region.block = metalEngine->bufferPool.Acquire(region.size, allShared[i] 
+            ? MTL::ResourceStorageModeShared 
+            : MTL::ResourceStorageModeManaged);
+        region.mtlBuffer = static_cast<MTL::Buffer *>(region.block.handle);
+      }
+    }
+
+    for (auto command = commands.begin(); command != commands.end(); command++) {
+      for (auto arg = command->args.begin(); arg != command->args.end(); arg++) {
+        if (arg->type == BufferType::Private && !buffers.contains(arg->id)) {
+          buffers.emplace(arg->id, metalEngine->bufferPool.Acquire(
+              arg->size, MTL::ResourceStorageModePrivate));
+        }
+      }
+    }
+  }
+
+  void MetalComputeEngine::MetalBatch::EncodeCommands() {
+    for (auto command = commands.begin(); command != commands.end(); command++) {
+      encoder->setComputePipelineState(command->pipeline);
+
+      NS::UInteger threadgroupIndex = 0;
+      for (std::size_t i = 0; i < command->args.size(); i++) {
+        const Argument& arg = command->args[i];
+        switch (arg.type) {
+          case BufferType::Inline:
+            encoder->setBytes(arg.data, arg.size, i);
+            break;
+          case BufferType::Local:
+            // threadgroup memory lengths must be multiples of 16 bytes
+            encoder->setThreadgroupMemoryLength((arg.size + 15) / 16 * 16, threadgroupIndex++);
+            break;
+          case BufferType::Resident:
+            encoder->setBuffer(static_cast<MetalResidentStorage *>(arg.resident)->mtlBuffer, 0, i);
+            break;
+          case BufferType::Private:
+            encoder->setBuffer(static_cast<MTL::Buffer *>(buffers[arg.id].handle), 0, i);
+            break;
+          default: {
+            HostRegion& region = regions[command->regions[i]];
+            encoder->setBuffer(region.mtlBuffer, 
+                region.offset + (static_cast<std::byte *>(arg.data) - region.data), i);
+          }
+        }
+      }
+
+      const Grid& grid = command->grid;
+      MTL::Size threadGroupSize(grid.workGroupCols, grid.workGroupRows, grid.workGroupLayers);
+      if (grid.indirect) {
+        MTL::Buffer * indirectBuffer;
+        if (grid.indirectResident) {
+          indirectBuffer = static_cast<MetalResidentStorage *>(grid.indirectResident)->mtlBuffer;
+        } else {
+          indirectBuffer = static_cast<MTL::Buffer *>(buffers[grid.indirectId].handle);
+        }
+        encoder->dispatchThreadgroups(indirectBuffer, grid.indirectOffset, threadGroupSize);
+      } else if (grid.byWorkGroups) {
+        MTL::Size numGroups(
+            grid.numCols / grid.workGroupCols, 
+            grid.numRows / grid.workGroupRows, 
+            grid.numLayers / grid.workGroupLayers);
+        encoder->dispatchThreadgroups(numGroups, threadGroupSize);
+      } else {
+        MTL::Size gridSize(grid.numCols, grid.numRows, grid.numLayers);
+        encoder->dispatchThreads(gridSize, threadGroupSize);
+      }
+    }
+    commands.clear();
+
+    encoder->endEncoding();
+    encoder->release();
+    encoder = nullptr;
+  }
+
+  std::size_t MetalComputeEngine::MetalBatch::NumUploadChunks() const {
+    std::size_t numChunks = 0;
+    for (auto it = regions.begin(); it != regions.end(); it++) {
+      if (!it->wrapped && it->upload && it->size >= 2 * kCopyChunkSize) {
+        numChunks += (it->size + kCopyChunkSize - 1) / kCopyChunkSize;
+      }
+    }
+    return numChunks;
+  }
+
+  void MetalComputeEngine::MetalBatch::StartUploads(std::latch& fence) {
+    ThreadPool& copyPool = static_cast<MetalComputeEngine *>(engine)->copyPool;
+    for (auto it = regions.begin(); it != regions.end(); it++) {
+      if (it->wrapped || !it->upload) {
+        continue;
+      }
+      std::byte * contents = static_cast<std::byte *>(it->mtlBuffer->contents()) + it->offset;
+      if (it->size < 2 * kCopyChunkSize) {
+        // not worth handing off
+        std::memcpy(contents, it->data, it->size);
+        continue;
+      }
+      for (std::size_t offset = 0; offset < it->size; offset += kCopyChunkSize) {
+        std::size_t size = std::min(kCopyChunkSize, it->size - offset);
+        const std::byte * data = it->data + offset;
+        copyPool.Submit([contents, data, offset, size, &fence]() {
+          std::memcpy(contents + offset, data, size);
+          fence.count_down();
+        });
+      }
+    }
+  }
+
+  void MetalComputeEngine::MetalBatch::Submit() {
+    NS::AutoreleasePool* autoReleasePool = NS::AutoreleasePool::alloc()->init();
+    // created only now, and only by batches that get submitted (not by those
+    // coalesced into others), so that batches waiting to be submitted don't 
+    // hold command queue slots. The batch may be completed and destroyed on a
+    // Metal thread, so it can't hold on to an autorelease pool: it retains 
+    // what it needs instead.
+    MetalComputeEngine * metalEngine = static_cast<MetalComputeEngine *>(engine);
+    commandBuffer = metalEngine->NextCommandQueue()->commandBuffer()->retain();
+    // batches ordered after others on the device (see 
+    // ComputeEngine::Schedule()) are submitted once those have been, and 
+    // wait for them here, ahead of any encoder. Batches that have completed,
+    // or failed before signaling, have nothing to wait for.
+    std::vector<MetalBatch *> submitted = Submitted();
+    for (auto batch = submitted.begin(); batch != submitted.end(); batch++) {
+      for (auto it = (*batch)->after.begin(); it != (*batch)->after.end(); it++) {
+        MetalBatch * predecessor = static_cast<MetalBatch *>(it->get());
+        if (predecessor->event && !predecessor->Done()) {
+          commandBuffer->encodeWait(predecessor->event, 1);
+        }
+      }
+    }
+    encoder = commandBuffer->computeCommandEncoder(parallel 
+        ? MTL::DispatchType::DispatchTypeConcurrent 
+        : MTL::DispatchType::DispatchTypeSerial)->retain();
+    try {
+      MapRegions();
+    } catch (...) {
+      // e.g. std::bad_alloc from the buffer pool. This may run on a Metal or
+      // coalescer thread, so the error goes to the batch's Gate. Nothing was
+      // uploaded or encoded yet.
+      ReleaseBuffers();
+      autoReleasePool->release();
+      Complete(std::current_exception());
+      return;
+    }
+
+    // uploads happen on submission rather than on Call(), so that batches 
+    // held back by the scheduler see what the batches they depend on wrote.
+    // Large ones overlap with encoding, and are fenced before committing.
+    std::latch fence(NumUploadChunks());
+    StartUploads(fence);
+    EncodeCommands();
+    fence.wait();
+
+    for (auto it = regions.begin(); it != regions.end(); it++) {
+      if (it->wrapped || !it->upload) {
+        continue;
+      }
+      if (it->mtlBuffer->storageMode() == MTL::StorageModeManaged) {
+        it->mtlBuffer->didModifyRange(NS::Range::Make(it->offset, it->size));
+      }
+      if (trace) {
+        trace->bytesUploaded[static_cast<std::size_t>(it->uploadType)] += it->size;
+      }
+    }
+    if (trace) {
+      trace->uploaded = std::chrono::steady_clock::now();
+    }
+
+    MTL::BlitCommandEncoder * bltEncoder = commandBuffer->blitCommandEncoder();
+    for (auto it = regions.begin(); it != regions.end(); it++) {
+      if (!it->wrapped && !it->writes.empty() 
+          && it->mtlBuffer->storageMode() == MTL::StorageModeManaged) {
+        bltEncoder->synchronizeResource(it->mtlBuffer);
+      }
+    }
+    bltEncoder->endEncoding();
+
+    // created last, so that batches only find events that get signaled
+    for (auto batch = submitted.begin(); batch != submitted.end(); batch++) {
+      bool resident = false;
+      for (auto it = (*batch)->accesses.begin(); it != (*batch)->accesses.end(); it++) {
+        resident = resident || it->resource;
+      }
+      if (resident) {
+        (*batch)->event = metalEngine->device->newSharedEvent();
+        commandBuffer->encodeSignalEvent((*batch)->event, 1);
+      }
+    }
+
+    // keeps the batch alive until the GPU is done with it
+    std::shared_ptr<MetalBatch> self = std::static_pointer_cast<MetalBatch>(shared_from_this());
+    commandBuffer->addCompletedHandler([self](MTL::CommandBuffer* buffer) {
+      self->Finish();
+    });
+    commandBuffer->commit();
+    autoReleasePool->release();
+  }
+
+  void MetalComputeEngine::MetalBatch::Finish() {
+    NS::AutoreleasePool* autoReleasePool = NS::AutoreleasePool::alloc()->init();
+    if (trace) {
+      // GPU timestamps are in a different time base, only their difference
+      // is meaningful here
+      trace->executed = std::chrono::steady_clock::now();
+      trace->started = trace->executed 
+          - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(
+                  commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime()));
+    }
+
+    std::exception_ptr error;
+    if (commandBuffer->error()) {
+      error = std::make_exception_ptr(
+          RuntimeException(commandBuffer->error()->description()->utf8String()));
+      // batches waiting on the device for this one would wait forever if it
+      // failed before signaling them
+      std::vector<MetalBatch *> submitted = Submitted();
+      for (auto it = submitted.begin(); it != submitted.end(); it++) {
+        if ((*it)->event) {
+          (*it)->event->setSignaledValue(1);
+        }
+      }
+    } else {
+      for (auto region = regions.begin(); region != regions.end(); region++) {
+        if (region->wrapped) {
+          continue;
+        }
+        std::byte * contents = 
+            static_cast<std::byte *>(region->mtlBuffer->contents()) + region->offset;
+        for (auto it = region->writes.begin(); it != region->writes.end(); it++) {
+          ParallelCopy(region->data + it->offset, contents + it->offset, it->size, 
+              static_cast<MetalComputeEngine *>(engine)->copyPool);
+          if (trace) {
+            trace->bytesDownloaded[static_cast<std::size_t>(it->bufferType)] += it->size;
+          }
+        }
+      }
+    }
+    ReleaseBuffers();
+    autoReleasePool->release();
+
+    Complete(error);
+  }
+
+
+  MetalComputeEngine::MetalComputeEngine() 
+      : bufferPool(&allocator), 
+        stagingRing(&allocator, kStagingRingSize, MTL::ResourceStorageModeShared),
+        copyPool(kNumCopyThreads) {
     device = MTL::CreateSystemDefaultDevice()->retain();
-    commandQueue = device->newCommandQueue();
+    for (std::size_t i = 0; device && i < kNumCommandQueues; i++) {
+      commandQueues.push_back(device->newCommandQueue());
+    }
+    allocator.device = device;
   }
 
   MetalComputeEngine::~MetalComputeEngine() {
+      StopCoalescing();
+      try {
+        // pipelines compiled lazily since the last save
+        SaveArchives();
+      } catch (...) {
+        // the artifact cache is only an optimization: next run recompiles
+      }
+      bufferPool.Trim();
+      stagingRing.Trim();
       for (auto it = pipelinesByFn.begin(); it != pipelinesByFn.end(); it++) {
         it->second->release();
       }
       for (auto it = libraries.begin(); it != libraries.end(); it++) {
-        (*it)->release();
+        it->library->release();
+        Release(it->archive);
       }
       libraries.clear();
-      Release(commandQueue);
+      for (auto it = commandQueues.begin(); it != commandQueues.end(); it++) {
+        Release(*it);
+      }
       Release(device);
   }
 
+  const char * MetalComputeEngine::Backend() const {
+    return "metal";
+  }
+
   bool MetalComputeEngine::Available() const {
-    return device != nullptr && commandQueue != nullptr;
+    return device != nullptr && !commandQueues.empty() && commandQueues.front() != nullptr;
   }
 
   void MetalComputeEngine::LoadLibrary(const std::string& sourceCode) {
+    std::uint64_t sourceHash = HashSource(sourceCode);
+    {
+      std::lock_guard<std::mutex> lock(libraryMutex);
+      if (librariesByHash.contains(sourceHash)) {
+        return;
+      }
+    }
+
     NS::Error* error = nullptr;
     MTL::Library* library = device->newLibrary(
         NS::String::string(sourceCode.c_str(), NS::StringEncoding::UTF8StringEncoding), 
@@ -128,183 +624,205 @@ namespace compute {
       throw CompilationException(error->description()->utf8String());
     }
 
-    libraries.push_back(library);
+    // pipelines are specific to the GPU they were compiled for
+    ArtifactKey key {
+      .sourceHash = sourceHash,
+      .backend = Backend(),
+      .options = device->name()->utf8String()
+    };
+    MTL::BinaryArchive * archive = OpenArchive(key);
+
+    std::lock_guard<std::mutex> lock(libraryMutex);
+    if (librariesByHash.contains(sourceHash)) {
+      library->release();
+      Release(archive);
+      return;
+    }
+    libraries.push_back(LoadedLibrary {
+      .library = library,
+      .key = key,
+      .archive = archive,
+      .archiveModified = false
+    });
+    LoadedLibrary * loaded = &libraries.back();
+    librariesByHash[sourceHash] = loaded;
     NS::Array * functions = library->functionNames();
     for (int i = 0; i < functions->count(); i++) {
-      libraryByFn[functions->object(i)->description()->utf8String()] = library;
+      libraryByFn[functions->object(i)->description()->utf8String()] = loaded;
     }
   }
 
-  bool MetalComputeEngine::ContainsFunction(const std::string& functionName) const {
-    return libraryByFn.count(functionName);
-  }
-
-  MetalComputeEngine::BatchBuilder MetalComputeEngine::NewBatch(bool parallel) {
-    return MetalComputeEngine::BatchBuilder(
-        std::shared_ptr<MetalComputeEngine::Batch>(
-            new MetalComputeEngine::Batch(this, parallel)));
-  }
-
-  MTL::ComputePipelineState* MetalComputeEngine::GetPipeline(const std::string& functionName) {
-    if (pipelinesByFn.contains(functionName)) {
-      return pipelinesByFn[functionName];
+  MTL::BinaryArchive * MetalComputeEngine::OpenArchive(const ArtifactKey& key) {
+    std::shared_ptr<ArtifactCache> cache = GetArtifactCache();
+    if (!cache) {
+      return nullptr;
     }
 
-    if (!libraryByFn.count(functionName)) {
-      throw FunctionNotFoundException(std::string("Function not found: ") + functionName);
-    }
-
-    MTL::Library * library = libraryByFn[functionName];
-    MTL::Function * fn = library->newFunction(
-        NS::String::string(functionName.c_str(), NS::UTF8StringEncoding));
-
-    if (!fn) {
-      throw FunctionNotFoundException(std::string("Could not load function object: ") + functionName);
+    MTL::BinaryArchiveDescriptor * descriptor = MTL::BinaryArchiveDescriptor::alloc()->init();
+    std::vector<std::byte> data;
+    std::string path;
+    if (cache->Load(key, data)) {
+      path = TempArchivePath();
+      std::ofstream file(path, std::ios::binary);
+      file.write(reinterpret_cast<const char *>(data.data()), data.size());
+      file.close();
+      descriptor->setUrl(FileUrl(path));
     }
 
     NS::Error* error = nullptr;
-    MTL::ComputePipelineState * pipeline = device->newComputePipelineState(fn, &error);
-
-    if (!pipeline) {
-      throw FunctionNotFoundException(std::string(error->description()->utf8String()));
+    MTL::BinaryArchive * archive = device->newBinaryArchive(descriptor, &error);
+    if (!archive && !path.empty()) {
+      // stale or corrupt artifact, start from an empty archive
+      descriptor->setUrl(nullptr);
+      archive = device->newBinaryArchive(descriptor, &error);
     }
-
-    pipelinesByFn[functionName] = pipeline;
-    Release(fn);
-
-    return pipeline;
-  }
-
-  MTL::Buffer * MetalComputeEngine::GetBuffer(const in_buffer& buffer) {
-    if (!buffersById.contains(buffer.id)) {
-      buffersById[buffer.id] = device->newBuffer(
-        buffer.data, buffer.size, MTL::ResourceStorageModeManaged);
+    descriptor->release();
+    if (!path.empty()) {
+      std::error_code ignored;
+      std::filesystem::remove(path, ignored);
     }
-    return buffersById[buffer.id];
+    return archive;
   }
 
-  MTL::Buffer * MetalComputeEngine::GetBuffer(const inout_buffer& buffer) {
-    if (!buffersById.contains(buffer.id)) {
-      buffersById[buffer.id] = device->newBuffer(
-        buffer.data, buffer.size, MTL::ResourceStorageModeManaged);
+  void MetalComputeEngine::SaveArchives() {
+    std::shared_ptr<ArtifactCache> cache = GetArtifactCache();
+    if (!cache) {
+      return;
     }
-    return buffersById[buffer.id];
-  }
 
-  MTL::Buffer * MetalComputeEngine::GetBuffer(const out_buffer& buffer) {
-    if (!buffersById.contains(buffer.id)) {
-      buffersById[buffer.id] = device->newBuffer(buffer.size, MTL::ResourceStorageModeManaged);
-    }
-    return buffersById[buffer.id];
-  }
+    std::lock_guard<std::mutex> lock(libraryMutex);
+    for (auto it = libraries.begin(); it != libraries.end(); it++) {
+      if (!it->archive || !it->archiveModified) {
+        continue;
+      }
 
-  MTL::Buffer * MetalComputeEngine::GetBuffer(const private_buffer& buffer) {
-    if (!buffersById.contains(buffer.id)) {
-      buffersById[buffer.id] = device->newBuffer(buffer.size, MTL::ResourceStorageModePrivate);
+      std::string path = TempArchivePath();
+      NS::Error* error = nullptr;
+      if (!it->archive->serializeToURL(FileUrl(path), &error)) {
+        throw RuntimeException(error->description()->utf8String());
+      }
+      std::ifstream file(path, std::ios::binary | std::ios::ate);
+      std::vector<std::byte> data(file.tellg());
+      file.seekg(0);
+      file.read(reinterpret_cast<char *>(data.data()), data.size());
+      file.close();
+      std::error_code ignored;
+      std::filesystem::remove(path, ignored);
+
+      cache->Store(it->key, data);
+      it->archiveModified = false;
     }
-    return buffersById[buffer.id];
   }
 
-  MTL::Buffer * MetalComputeEngine::GetBuffer(const shared_buffer& buffer) {
-    if (!buffersById.contains(buffer.id)) {
-      buffersById[buffer.id] = device->newBuffer(
-        buffer.data, buffer.size, MTL::ResourceStorageModeShared);
-    }
-    return buffersById[buffer.id];
+  void MetalComputeEngine::PrecompileAll() {
+    ComputeEngine::PrecompileAll();
+    SaveArchives();
   }
 
-  void MetalComputeEngine::ReleaseBuffer(std::size_t bufferId) {
-    if (buffersById.contains(bufferId)) {
-      buffersById[bufferId]->release();
-      buffersById.erase(bufferId);
+  std::vector<std::string> MetalComputeEngine::FunctionNames() const {
+    std::lock_guard<std::mutex> lock(libraryMutex);
+    std::vector<std::string> names;
+    for (auto it = libraryByFn.begin(); it != libraryByFn.end(); it++) {
+      names.push_back(it->first);
     }
+    return names;
   }
 
+  bool MetalComputeEngine::ContainsFunction(const std::string& functionName) const {
+    std::lock_guard<std::mutex> lock(libraryMutex);
+    return libraryByFn.count(functionName);
+  }
 
+  BufferPool& MetalComputeEngine::GetBufferPool() {
+    return bufferPool;
+  }
 
-  MetalComputeEngine::BatchBuilder::BatchBuilder(
-      const std::shared_ptr<MetalComputeEngine::Batch>& batch) : batch(batch) {}
-  MetalComputeEngine::BatchBuilder::BatchBuilder(
-      std::shared_ptr<MetalComputeEngine::Batch>&& batch) : batch(std::move(batch)) {}
+  std::shared_ptr<ComputeEngine::Batch> MetalComputeEngine::CreateBatch(bool parallel) {
+    return std::make_shared<MetalBatch>(this, parallel);
+  }
 
-  MetalComputeEngine::CallBuilder MetalComputeEngine::BatchBuilder::WithGrid(
-      std::size_t numRows, std::size_t numCols, 
-      std::size_t workGroupRows, std::size_t workGroupCols) {
+  std::shared_ptr<ResidentStorage> MetalComputeEngine::CreateResidentStorage(std::size_t size) {
+    return std::make_shared<MetalResidentStorage>(device, commandQueues.front(), size);
+  }
 
-    batch->argIndex = 0;
-    batch->numRows = numRows;
-    batch->numCols = numCols;
-    batch->workGroupRows = workGroupRows;
-    batch->workGroupCols = workGroupCols;
+  void MetalComputeEngine::LoadKernel(KernelInfo& kernel) {
+    MTL::ComputePipelineState * pipeline = GetPipeline(kernel.name);
+    kernel.handle = pipeline;
+    kernel.maxThreadsPerWorkGroup = pipeline->maxTotalThreadsPerThreadgroup();
+    kernel.executionWidth = pipeline->threadExecutionWidth();
+  }
 
-    return MetalComputeEngine::CallBuilder(batch);
+  bool MetalComputeEngine::OrdersOnDevice() const {
+    return true;
   }
 
-  MetalComputeEngine::Gate MetalComputeEngine::BatchBuilder::Dispatch() {
-    batch->encoder->endEncoding();
-    batch->encoder = nullptr;
+  MTL::CommandQueue * MetalComputeEngine::NextCommandQueue() {
+    return commandQueues[
+        nextCommandQueue.fetch_add(1, std::memory_order_relaxed) % commandQueues.size()];
+  }
 
+  MTL::ComputePipelineState* MetalComputeEngine::GetPipeline(const std::string& functionName) {
+    LoadedLibrary * library;
+    {
+      std::lock_guard<std::mutex> lock(libraryMutex);
+      if (pipelinesByFn.contains(functionName)) {
+        return pipelinesByFn[functionName];
+      }
 
-    MTL::BlitCommandEncoder * bltEncoder = batch->commandBuffer->blitCommandEncoder();
-    for (auto it = batch->buffers.begin(); it != batch->buffers.end(); it++) {
-      BufferDescriptor& desc = it->second;
-      if (desc.bufferType == BufferType::InOut || desc.bufferType == BufferType::Out) {
-        bltEncoder->synchronizeResource(desc.mtlBuffer);
+      if (!libraryByFn.count(functionName)) {
+        throw FunctionNotFoundException(std::string("Function not found: ") + functionName);
       }
+      library = libraryByFn[functionName];
     }
-    bltEncoder->endEncoding();
 
-    batch->commandBuffer->commit();
-    return MetalComputeEngine::Gate(batch);
-  }
-  
-  MetalComputeEngine::CallBuilder::CallBuilder(
-      const std::shared_ptr<MetalComputeEngine::Batch>& batch) : batch(batch) {}
-  MetalComputeEngine::CallBuilder::CallBuilder(
-      std::shared_ptr<MetalComputeEngine::Batch>&& batch) : batch(std::move(batch)) {}
-
-
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<in_buffer>(const in_buffer& value) {
-    batch->AddBuffer(value);
-  }
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<inout_buffer>(const inout_buffer& value) {
-    batch->AddBuffer(value);
-  }
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<out_buffer>(const out_buffer& value) {
-    batch->AddBuffer(value);
-  }
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<private_buffer>(const private_buffer& value) {
-    batch->AddBuffer(value);
-  }
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<shared_buffer>(const shared_buffer& value) {
-    batch->AddBuffer(value);
-  }
+    // compiled without holding the lock, so that PrecompileAll() can compile
+    // pipelines in parallel
+    MTL::Function * fn = library->library->newFunction(
+        NS::String::string(functionName.c_str(), NS::UTF8StringEncoding));
 
+    if (!fn) {
+      throw FunctionNotFoundException(std::string("Could not load function object: ") + functionName);
+    }
 
-  MetalComputeEngine::Gate::Gate(const std::shared_ptr<MetalComputeEngine::Batch>& batch) 
-      : batch(batch) {}
+    MTL::ComputePipelineDescriptor * descriptor = MTL::ComputePipelineDescriptor::alloc()->init();
+    descriptor->setComputeFunction(fn);
+    NS::Error* error = nullptr;
+    MTL::ComputePipelineState * pipeline = nullptr;
+    bool archived = false;
+    if (library->archive) {
+      descriptor->setBinaryArchives(NS::Array::array(library->archive));
+      pipeline = device->newComputePipelineState(
+          descriptor, MTL::PipelineOptionFailOnBinaryArchiveMiss, nullptr, &error);
+      archived = pipeline != nullptr;
+    }
+    if (!pipeline) {
+      error = nullptr;
+      pipeline = device->newComputePipelineState(
+          descriptor, MTL::PipelineOptionNone, nullptr, &error);
+    }
+    Release(fn);
 
-  void MetalComputeEngine::Gate::Wait() const {
-    batch->commandBuffer->waitUntilCompleted();
-    
-    if (batch->commandBuffer->error()) {
-      throw RuntimeException(batch->commandBuffer->error()->description()->utf8String());
+    if (!pipeline) {
+      descriptor->release();
+      throw FunctionNotFoundException(std::string(error->description()->utf8String()));
     }
 
-    for (auto it = batch->buffers.begin(); it != batch->buffers.end(); it++) {
-      BufferDescriptor& desc = it->second;
-      if (desc.bufferType == BufferType::InOut 
-          || desc.bufferType == BufferType::Out
-          || desc.bufferType == BufferType::Shared) {
-        std::memcpy(desc.appBuffer, desc.mtlBuffer->contents(), desc.size);
-      }
+    std::lock_guard<std::mutex> lock(libraryMutex);
+    if (pipelinesByFn.contains(functionName)) {
+      // some other thread compiled it in the meantime
+      descriptor->release();
+      pipeline->release();
+      return pipelinesByFn[functionName];
     }
+    pipelinesByFn[functionName] = pipeline;
+    if (library->archive && !archived) {
+      library->archiveModified = 
+          library->archive->addComputePipelineFunctions(descriptor, &error)
+          || library->archiveModified;
+    }
+    descriptor->release();
+
+    return pipeline;
   }
 } // compute
 } // mdl
-
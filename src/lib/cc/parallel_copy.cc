@@ -0,0 +1,141 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/parallel_copy.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <latch>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace mdl {
+namespace compute {
+  namespace {
+    constexpr std::size_t kCacheLineSize = 64;
+    constexpr std::size_t kMinChunkSize = 1024 * 1024;
+
+    void Copy(std::byte * dst, const std::byte * src, std::size_t size, bool streaming) {
+      if (streaming) {
+        StreamingCopy(dst, src, size);
+      } else {
+        std::memcpy(dst, src, size);
+      }
+    }
+  }
+
+  void StreamingCopy(void * dst, const void * src, std::size_t size) {
+    // empty buffers may have null data, and memcpy doesn't take null even 
+    // for 0 bytes
+    if (size == 0) {
+      return;
+    }
+#if defined(__SSE2__)
+    std::byte * out = static_cast<std::byte *>(dst);
+    const std::byte * in = static_cast<const std::byte *>(src);
+    // streaming stores need an aligned destination: copy up to the first
+    // cache line normally
+    std::size_t head = std::min(size, 
+        (kCacheLineSize - reinterpret_cast<std::uintptr_t>(out) % kCacheLineSize) % kCacheLineSize);
+    std::memcpy(out, in, head);
+    out += head;
+    in += head;
+    size -= head;
+
+    std::size_t numLines = size / kCacheLineSize;
+    for (std::size_t i = 0; i < numLines; i++) {
+      const __m128i * from = reinterpret_cast<const __m128i *>(in);
+      __m128i * to = reinterpret_cast<__m128i *>(out);
+      __m128i a = _mm_loadu_si128(from);
+      __m128i b = _mm_loadu_si128(from + 1);
+      __m128i c = _mm_loadu_si128(from + 2);
+      __m128i d = _mm_loadu_si128(from + 3);
+      _mm_stream_si128(to, a);
+      _mm_stream_si128(to + 1, b);
+      _mm_stream_si128(to + 2, c);
+      _mm_stream_si128(to + 3, d);
+      out += kCacheLineSize;
+      in += kCacheLineSize;
+    }
+    // streaming stores are weakly ordered: make them visible before whoever
+    // waits on the copy reads the destination
+    _mm_sfence();
+    std::memcpy(out, in, size % kCacheLineSize);
+#else
+    std::memcpy(dst, src, size);
+#endif
+  }
+
+  void ParallelCopy(void * dst, const void * src, std::size_t size, ThreadPool& pool) {
+    if (size == 0) {
+      return;
+    }
+    std::byte * out = static_cast<std::byte *>(dst);
+    const std::byte * in = static_cast<const std::byte *>(src);
+    bool streaming = size >= kStreamingCopyThreshold;
+    if (size < kParallelCopyThreshold || pool.Size() == 0) {
+      Copy(out, in, size, streaming);
+      return;
+    }
+
+    // one chunk per pool thread plus one for this thread, ending on cache 
+    // line boundaries of the destination so that no two threads write the
+    // same line
+    std::size_t numChunks = std::min(pool.Size() + 1, size / kMinChunkSize);
+    std::size_t chunkSize = (size / numChunks + kCacheLineSize - 1) 
+        / kCacheLineSize * kCacheLineSize;
+    std::size_t misalignment = reinterpret_cast<std::uintptr_t>(out) % kCacheLineSize;
+
+    std::vector<std::size_t> bounds = { 0 };
+    for (std::size_t i = 1; i < numChunks; i++) {
+      std::size_t bound = i * chunkSize - misalignment;
+      if (bound <= bounds.back() || bound >= size) {
+        break;
+      }
+      bounds.push_back(bound);
+    }
+    bounds.push_back(size);
+
+    std::latch done(bounds.size() - 2);
+    for (std::size_t i = 1; i + 1 < bounds.size(); i++) {
+      std::size_t begin = bounds[i];
+      std::size_t end = bounds[i + 1];
+      pool.Submit([out, in, begin, end, streaming, &done]() {
+        Copy(out + begin, in + begin, end - begin, streaming);
+        done.count_down();
+      });
+    }
+    Copy(out, in, bounds[1], streaming);
+    done.wait();
+  }
+} // compute
+} // mdl
@@ -0,0 +1,89 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/compute_exception.h"
+#include "../h/resident_buffer.h"
+
+namespace mdl {
+namespace compute {
+  namespace {
+    void CheckRange(const ResidentStorage * storage, std::size_t size, std::size_t offset) {
+      if (!storage) {
+        throw RuntimeException("Empty resident buffer");
+      }
+      if (offset > storage->Size() || size > storage->Size() - offset) {
+        throw RuntimeException("Range outside of resident buffer");
+      }
+    }
+  }
+
+  ResidentStorage::ResidentStorage(std::size_t size) : id(++idSeq), size(size) {}
+
+  ResidentStorage::~ResidentStorage() {}
+
+  std::uint64_t ResidentStorage::Id() const {
+    return id;
+  }
+
+  std::size_t ResidentStorage::Size() const {
+    return size;
+  }
+
+
+  ResidentBuffer::ResidentBuffer() {}
+
+  ResidentBuffer::ResidentBuffer(const std::shared_ptr<ResidentStorage>& storage) 
+      : storage(storage) {}
+
+  std::uint64_t ResidentBuffer::Id() const {
+    return storage ? storage->Id() : 0;
+  }
+
+  std::size_t ResidentBuffer::Size() const {
+    return storage ? storage->Size() : 0;
+  }
+
+  void ResidentBuffer::Update(const void * data, std::size_t size, std::size_t offset) {
+    CheckRange(storage.get(), size, offset);
+    storage->Update(data, size, offset);
+  }
+
+  void ResidentBuffer::Download(void * data, std::size_t size, std::size_t offset) const {
+    CheckRange(storage.get(), size, offset);
+    storage->Download(data, size, offset);
+  }
+
+  ResidentStorage * ResidentBuffer::GetStorage() const {
+    return storage.get();
+  }
+
+  const std::shared_ptr<ResidentStorage>& ResidentBuffer::GetSharedStorage() const {
+    return storage;
+  }
+} // compute
+} // mdl
@@ -0,0 +1,112 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/staging_ring.h"
+
+#include <algorithm>
+
+namespace mdl {
+namespace compute {
+
+  StagingRing::StagingRing(
+      BufferAllocator * allocator, std::size_t capacity, std::uint32_t storageMode)
+      : allocator(allocator), capacity(capacity), storageMode(storageMode) {}
+
+  StagingRing::~StagingRing() {
+    if (handle) {
+      allocator->Free(handle, capacity, storageMode);
+    }
+  }
+
+  StagingRing::Range StagingRing::Allocate(std::size_t size) {
+    std::size_t alignedSize = (std::max<std::size_t>(size, 1) + kAlignment - 1) 
+        / kAlignment * kAlignment;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!handle) {
+      handle = allocator->Allocate(capacity, storageMode);
+      if (!handle) {
+        // retried by the next call
+        return Range { .handle = nullptr, .offset = 0, .size = 0 };
+      }
+    }
+
+    std::size_t begin = capacity;
+    if (spans.empty()) {
+      begin = alignedSize <= capacity ? 0 : capacity;
+    } else if (spans.back().begin >= spans.front().begin) {
+      // free space is after the newest span, and before the oldest one
+      if (capacity - spans.back().end >= alignedSize) {
+        begin = spans.back().end;
+      } else if (spans.front().begin >= alignedSize) {
+        begin = 0;
+      }
+    } else if (spans.front().begin - spans.back().end >= alignedSize) {
+      // wrapped around: free space is between the newest and the oldest span
+      begin = spans.back().end;
+    }
+
+    if (begin == capacity) {
+      return Range { .handle = nullptr, .offset = 0, .size = 0 };
+    }
+    spans.push_back(Span { .begin = begin, .end = begin + alignedSize, .released = false });
+    bytesInUse += alignedSize;
+    return Range { .handle = handle, .offset = begin, .size = alignedSize };
+  }
+
+  void StagingRing::Release(const Range& range) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = spans.begin(); it != spans.end(); it++) {
+      if (it->begin == range.offset && !it->released) {
+        it->released = true;
+        bytesInUse -= it->end - it->begin;
+        break;
+      }
+    }
+    while (!spans.empty() && spans.front().released) {
+      spans.pop_front();
+    }
+  }
+
+  void StagingRing::Trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (handle && spans.empty()) {
+      allocator->Free(handle, capacity, storageMode);
+      handle = nullptr;
+    }
+  }
+
+  std::size_t StagingRing::GetCapacity() const {
+    return capacity;
+  }
+
+  std::size_t StagingRing::GetBytesInUse() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytesInUse;
+  }
+} // compute
+} // mdl
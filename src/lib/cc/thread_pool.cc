@@ -0,0 +1,173 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/thread_pool.h"
+
+#include <algorithm>
+
+namespace mdl {
+namespace compute {
+  namespace {
+    thread_local const ThreadPool* currentPool = nullptr;
+    thread_local std::size_t currentWorker = 0;
+  }
+
+  ThreadPool::ThreadPool(std::size_t numThreads) 
+      : pending(0), nextWorker(0), sleepers(0), stopping(false), wakeUps(0) {
+    if (numThreads == 0) {
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (std::size_t i = 0; i < numThreads; i++) {
+      workers.push_back(std::make_unique<Worker>());
+    }
+    for (std::size_t i = 0; i < numThreads; i++) {
+      threads.emplace_back(&ThreadPool::Run, this, i);
+    }
+  }
+
+  ThreadPool::~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+      it->join();
+    }
+  }
+
+  std::size_t ThreadPool::Size() const {
+    return workers.size();
+  }
+
+  void ThreadPool::Submit(Task&& task) {
+    std::size_t index = currentPool == this 
+        ? currentWorker 
+        : nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    // counted before it's published, so that whoever runs it can't take the
+    // count below zero
+    pending.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(workers[index]->mutex);
+      workers[index]->tasks.push_back(std::move(task));
+    }
+
+    // while every worker is busy, submitting only takes the deque's lock. A
+    // worker counts itself as a sleeper before its last look at the deques: 
+    // either that look finds the task, or "sleepers" is seen here (both 
+    // sides go through the deque's lock)
+    if (sleepers.load() > 0) {
+      {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wakeUps++;
+      }
+      wakeUp.notify_one();
+    }
+  }
+
+  void ThreadPool::Run(std::size_t index) {
+    currentPool = this;
+    currentWorker = index;
+
+    Task task;
+    while (true) {
+      if (stopping.load() && pending.load() == 0) {
+        return;
+      }
+
+      if (TryPop(index, task) || TrySteal(index, task, false)) {
+        RunTask(task);
+        continue;
+      }
+
+      // about to sleep. A steal that loses every try_lock is retried with 
+      // blocking locks, so that the worker only sleeps when the deques were
+      // empty after it became a sleeper, until the next submission 
+      sleepers.fetch_add(1);
+      std::uint64_t seen;
+      {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        seen = wakeUps;
+      }
+      if (TryPop(index, task) || TrySteal(index, task, true)) {
+        sleepers.fetch_sub(1);
+        RunTask(task);
+        continue;
+      }
+      {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this, seen]() { 
+          return wakeUps != seen || (stopping.load() && pending.load() == 0); 
+        });
+      }
+      sleepers.fetch_sub(1);
+    }
+  }
+
+  void ThreadPool::RunTask(Task& task) {
+    if (pending.fetch_sub(1) == 1 && stopping.load()) {
+      // the last task: workers waiting to stop can go
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      wakeUp.notify_all();
+    }
+    task();
+    task = nullptr;
+  }
+
+  bool ThreadPool::TryPop(std::size_t index, Task& task) {
+    Worker& worker = *workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) {
+      return false;
+    }
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+  }
+
+  bool ThreadPool::TrySteal(std::size_t index, Task& task, bool blocking) {
+    for (std::size_t i = 1; i < workers.size(); i++) {
+      Worker& victim = *workers[(index + i) % workers.size()];
+      std::unique_lock<std::mutex> lock(victim.mutex, std::defer_lock);
+      if (blocking) {
+        lock.lock();
+      } else {
+        lock.try_lock();
+      }
+      if (!lock.owns_lock() || victim.tasks.empty()) {
+        continue;
+      }
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+    return false;
+  }
+} // compute
+} // mdl
@@ -0,0 +1,129 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "../h/compute_exception.h"
+#include "../h/file_util.h"
+#include "../h/work_group_tuner.h"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
+namespace mdl {
+namespace compute {
+  namespace {
+    // fields of the file are separated by whitespace
+    bool IsField(const std::string& value) {
+      return !value.empty() && std::none_of(value.begin(), value.end(), 
+          [](unsigned char c) { return std::isspace(c); });
+    }
+  }
+
+  WorkGroupKey::WorkGroupKey(const std::string& backend, const std::string& kernel, 
+      std::size_t numRows, std::size_t numCols) 
+      : backend(backend), kernel(kernel), 
+        rowsBucket(std::bit_width(numRows)), colsBucket(std::bit_width(numCols)) {}
+
+  std::string WorkGroupKey::ToString() const {
+    return backend + " " + kernel + " " + std::to_string(rowsBucket) + " " 
+        + std::to_string(colsBucket);
+  }
+
+
+  WorkGroupTuner::WorkGroupTuner(const std::string& path) : path(path) {
+    if (path.empty()) {
+      return;
+    }
+
+    // one shape per line: backend, kernel, row and column buckets, shape
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      std::istringstream in(line);
+      std::string backend;
+      std::string kernel;
+      int rowsBucket;
+      int colsBucket;
+      WorkGroupShape shape;
+      if (in >> backend >> kernel >> rowsBucket >> colsBucket >> shape.rows >> shape.cols
+          && shape.rows && shape.cols) {
+        shapes[backend + " " + kernel + " " + std::to_string(rowsBucket) + " " 
+            + std::to_string(colsBucket)] = shape;
+      }
+    }
+  }
+
+  bool WorkGroupTuner::Find(const WorkGroupKey& key, WorkGroupShape& shape) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = shapes.find(key.ToString());
+    if (it == shapes.end()) {
+      return false;
+    }
+    shape = it->second;
+    return true;
+  }
+
+  void WorkGroupTuner::Store(const WorkGroupKey& key, const WorkGroupShape& shape) {
+    if (!IsField(key.backend) || !IsField(key.kernel)) {
+      throw RuntimeException(std::string("Can't store work-group shapes of kernel: ") + key.kernel);
+    }
+
+    // the file is written without holding "mutex", so that lookups aren't 
+    // held up by it: only the contents are taken under the lock
+    std::string contents;
+    std::uint64_t current;
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex);
+      shapes[key.ToString()] = shape;
+      if (path.empty()) {
+        return;
+      }
+      for (auto it = shapes.begin(); it != shapes.end(); it++) {
+        contents += it->first + " " + std::to_string(it->second.rows) + " " 
+            + std::to_string(it->second.cols) + "\n";
+      }
+      current = ++version;
+    }
+
+    // stores racing to save skip contents older than what was saved
+    std::lock_guard<std::mutex> lock(saveMutex);
+    if (current > savedVersion) {
+      WriteFileAtomically(path, contents.data(), contents.size());
+      savedVersion = current;
+    }
+  }
+
+  std::size_t WorkGroupTuner::Size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return shapes.size();
+  }
+} // compute
+} // mdl
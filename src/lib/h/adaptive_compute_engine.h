@@ -0,0 +1,169 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_ADAPTIVE_COMPUTE_ENGINE
+#define _MDL_ADAPTIVE_COMPUTE_ENGINE
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "arg_buffers.h"
+#include "compute_engine.h"
+
+namespace mdl {
+namespace compute {
+
+  // Prior costs of running a batch on each backend, used until there's
+  // measured history for batches like it. Times are in seconds.
+  struct AdaptiveCostModel {
+    // fixed cost of a batch: submission, synchronization, completion
+    double cpuLaunchOverhead = 5e-6;
+    double deviceLaunchOverhead = 150e-6;
+    // per grid thread
+    double cpuTimePerThread = 2e-9;
+    double deviceTimePerThread = 0.05e-9;
+    // bytes the device moves to and from application memory per second
+    // (the CPU binds application memory in place)
+    double deviceBytesPerSecond = 8e9;
+    // one in this many batches of a kind runs on the backend the model 
+    // didn't pick, so that history follows changing conditions. 0 disables
+    // exploration.
+    std::size_t explorationInterval = 64;
+  };
+
+  // Runs each batch on a CPU engine or on a device engine, whichever the
+  // cost model expects to finish it first. Small grids stay on the CPU, 
+  // where they don't pay for a device launch, while large ones offload:
+  //
+  //   CpuComputeEngine cpu;
+  //   MetalComputeEngine gpu;
+  //   AdaptiveComputeEngine engine(cpu, gpu);
+  //   engine.LoadLibrary(shaderSrc);      // device kernels
+  //   cpu.RegisterKernel("scale", ...);   // same kernel for the CPU
+  //   engine.NewBatch()
+  //       .WithGrid(1, n, 1, 256).Call("scale", in(a), out(b), 2.0f)
+  //       .Dispatch().Wait();
+  //
+  // Estimates start from the AdaptiveCostModel and are replaced by the 
+  // measured times of previous batches with the same kernels, on the same 
+  // backend, with a similar grid size and transfer size (by powers of two).
+  // Kernels only known to one engine pin their batches to it; kernels are
+  // resolved on both engines the first time they're used here, so they must
+  // be loaded or registered by then. The engines are owned by the caller and
+  // must outlive this one; batches dispatched on them directly aren't checked
+  // for hazards against batches dispatched here. Resident buffers are not 
+  // supported.
+  class AdaptiveComputeEngine : public ComputeEngine {
+    struct AdaptiveKernel {
+      Kernel cpu;
+      Kernel device;
+    };
+
+    struct AdaptiveCall {
+      const KernelInfo * kernel;
+      Grid grid;
+      std::vector<Argument> args;
+      std::vector<std::byte> inlineArgs;
+    };
+
+    struct AdaptiveBatch : public Batch {
+      std::vector<AdaptiveCall> calls;
+
+      AdaptiveBatch(AdaptiveComputeEngine * engine, bool parallel);
+
+      void Encode(const KernelInfo& kernel) override;
+      void Submit() override;
+      void Absorb(Batch& other) override;
+    };
+
+    public:
+      AdaptiveComputeEngine(ComputeEngine& cpu, ComputeEngine& device, 
+          const AdaptiveCostModel& model = {});
+      virtual ~AdaptiveComputeEngine();
+
+      const char * Backend() const override;
+      // Both engines must be available.
+      bool Available() const override;
+      // Loaded on the device engine: the CPU can't compile kernel source.
+      void LoadLibrary(const std::string& sourceCode) override;
+      bool ContainsFunction(const std::string& functionName) const override;
+      // The device engine's pool.
+      BufferPool& GetBufferPool() override;
+
+      // Number of batches run on each backend so far.
+      std::size_t CpuBatches() const;
+      std::size_t DeviceBatches() const;
+    protected:
+      std::shared_ptr<Batch> CreateBatch(bool parallel) override;
+      std::shared_ptr<ResidentStorage> CreateResidentStorage(std::size_t size) override;
+      void LoadKernel(KernelInfo& kernel) override;
+      std::vector<std::string> FunctionNames() const override;
+      // Left to the engine that runs the call. Shapes are tuned on that 
+      // engine too: Autotune() it rather than this one.
+      void SizeWorkGroup(
+          const KernelInfo& kernel, Grid& grid, const std::vector<Argument>& args) const override;
+    private:
+      // kernels, grid size and transfer size of a batch (the latter two as
+      // powers of two), and whether it ran on the device
+      typedef std::tuple<std::uint64_t, int, int, bool> HistoryKey;
+
+      struct History {
+        // exponential moving average of the batch's duration, in seconds
+        double seconds = 0;
+        std::size_t samples = 0;
+        // times the model picked this backend, for exploration
+        std::size_t picks = 0;
+      };
+
+      ComputeEngine& cpu;
+      ComputeEngine& device;
+      AdaptiveCostModel model;
+      mutable std::mutex historyMutex;
+      std::map<HistoryKey, History> history;
+      std::size_t cpuBatches = 0;
+      std::size_t deviceBatches = 0;
+      std::mutex adaptiveKernelsMutex;
+      std::vector<std::unique_ptr<AdaptiveKernel>> adaptiveKernels;
+
+      // Picks a backend for "batch" and runs its calls there.
+      void Submit(const std::shared_ptr<AdaptiveBatch>& batch);
+      // Estimated duration, in seconds, of a batch of the kind "key" 
+      // describes. Must hold "historyMutex".
+      double Estimate(const HistoryKey& key, std::size_t numThreads, std::size_t numBytes) const;
+      void Record(const HistoryKey& key, double seconds);
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_ADAPTIVE_COMPUTE_ENGINE
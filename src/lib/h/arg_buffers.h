@@ -31,17 +31,21 @@
 
 #include <array>
 #include <atomic>
+#include <cstddef>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "compute_exception.h"
+
 namespace mdl {
 namespace compute {
   extern std::atomic_size_t idSeq;
 
   enum class BufferType {
-    In, Out, InOut, Private, Shared
+    In, Out, InOut, Private, Shared, Resident, Local, Inline
   };
+  constexpr std::size_t kNumBufferTypes = static_cast<std::size_t>(BufferType::Inline) + 1;
 
 
   template <BufferType BT, class DT = void*>
@@ -51,14 +55,42 @@ namespace compute {
     std::size_t size;
 
     BufferType GetType() const { return BT; }
+
+    // A view of "length" bytes starting "offset" bytes into the buffer.
+    // Kernels see the first byte of the view at index 0, and only the view
+    // is copied to and from the device. Throws RuntimeException if the view
+    // doesn't fit in the buffer. Only buffers backed by host memory can be
+    // viewed this way.
+    buffer range(std::size_t offset, std::size_t length) const
+        requires (BT == BufferType::In || BT == BufferType::Out 
+            || BT == BufferType::InOut || BT == BufferType::Shared) {
+      if (offset > size || length > size - offset) {
+        throw RuntimeException("Buffer range out of bounds");
+      }
+      typedef std::conditional_t<std::is_const_v<std::remove_pointer_t<DT>>,
+          const std::byte*, std::byte*> bytes;
+      return {
+        .id = ++idSeq,
+        .data = data ? static_cast<DT>(static_cast<bytes>(data) + offset) : data,
+        .size = length
+      };
+    }
   };
 
 
+  template <class T>
+  struct is_buffer : std::false_type {};
+
+  template <BufferType BT, class DT>
+  struct is_buffer<buffer<BT, DT>> : std::true_type {};
+
+
   typedef buffer<BufferType::In, const void*> in_buffer;
   typedef buffer<BufferType::InOut> inout_buffer;
   typedef buffer<BufferType::Out> out_buffer;
   typedef buffer<BufferType::Private, const void*> private_buffer;
   typedef buffer<BufferType::Shared> shared_buffer;
+  typedef buffer<BufferType::Local, const void*> local_buffer;
 
 
   template <class T>
@@ -72,9 +104,9 @@ namespace compute {
     }
   };
   
-  template <class T>
-  struct sizefn<std::vector<T>> {
-    std::size_t operator()(const std::vector<T>& value) {
+  template <class T, class A>
+  struct sizefn<std::vector<T, A>> {
+    std::size_t operator()(const std::vector<T, A>& value) {
       return value.size() * sizeof(T);
     }
   };
@@ -109,13 +141,15 @@ namespace compute {
     }
   };
 
-  template <class T>
-  struct addressfn<std::vector<T>> {
-    void * operator()(std::vector<T>& value) {
+  // any allocator, so that host_vector's page-aligned memory reaches the 
+  // engine as is
+  template <class T, class A>
+  struct addressfn<std::vector<T, A>> {
+    void * operator()(std::vector<T, A>& value) {
       return value.data();
     }
 
-    const void * operator()(const std::vector<T>& value) {
+    const void * operator()(const std::vector<T, A>& value) {
       return value.data();
     }
   };
@@ -132,7 +166,9 @@ namespace compute {
   };
 
 
-
+  // Buffers over application memory, which is bound in place rather than 
+  // copied when passed to Call(): it must outlive the batch, and "in" and 
+  // "inout" memory must not change until the batch completes.
   template <class T>
   in_buffer in(const T& val, std::size_t size = 0) {
     return {
@@ -160,8 +196,22 @@ namespace compute {
     };
   }
 
+  // Device-only scratch memory, shared by the calls of a batch that use the
+  // same handle. Every batch gets buffers of its own, so batches using the 
+  // same handle neither share data nor wait for each other.
   private_buffer priv(std::size_t size);
 
+  // Scratch memory shared by the threads of a work-group (threadgroup memory
+  // on Metal), e.g. to hold a tile of data while the work-group works on it.
+  // Its contents are undefined when a work-group starts. Metal binds local 
+  // arguments to threadgroup indices of their own: the first one in a call to
+  // [[threadgroup(0)]], and so on.
+  local_buffer local(std::size_t size);
+
+  // Memory shared between the application and the device. Memory from 
+  // AllocateHostMemory() (e.g. a host_vector) is bound in place, without 
+  // copies; anything else is copied in and out like an inout buffer on 
+  // backends that can't address host memory directly.
   template <class T>
   shared_buffer shared(T& val, std::size_t size = 0) {
     return {
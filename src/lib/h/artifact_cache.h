@@ -0,0 +1,85 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_ARTIFACT_CACHE
+#define _MDL_COMPUTE_ARTIFACT_CACHE
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+
+  // Stable 64-bit hash (FNV-1a) of kernel source. Unlike std::hash, it's the
+  // same across processes and builds, so it can be used to name artifacts on
+  // disk.
+  std::uint64_t HashSource(std::string_view source);
+
+  // Identifies a compiled artifact: the hash of the source it was compiled 
+  // from, the backend that compiled it and anything else the compiled code 
+  // depends on (compile options, device).
+  struct ArtifactKey {
+    std::uint64_t sourceHash;
+    std::string backend;
+    std::string options;
+
+    // A file-name safe representation of the key.
+    std::string ToString() const;
+  };
+
+  // Storage for compiled artifacts (e.g. Metal binary archives), so that warm
+  // restarts can skip compiling pipelines. Implementations must be safe to
+  // call from multiple threads.
+  class ArtifactCache {
+    public:
+      virtual ~ArtifactCache();
+
+      // Returns false if there's no artifact for "key".
+      virtual bool Load(const ArtifactKey& key, std::vector<std::byte>& data) = 0;
+      virtual void Store(const ArtifactKey& key, const std::vector<std::byte>& data) = 0;
+  };
+
+  // Keeps artifacts as files in a directory, which is created if needed.
+  class DiskArtifactCache : public ArtifactCache {
+    public:
+      DiskArtifactCache(const std::string& directory);
+
+      bool Load(const ArtifactKey& key, std::vector<std::byte>& data) override;
+      void Store(const ArtifactKey& key, const std::vector<std::byte>& data) override;
+    private:
+      std::string directory;
+
+      std::string PathOf(const ArtifactKey& key) const;
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_ARTIFACT_CACHE
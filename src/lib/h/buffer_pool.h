@@ -0,0 +1,109 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_BUFFER_POOL
+#define _MDL_COMPUTE_BUFFER_POOL
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+
+  // Backend hooks used by BufferPool to create and destroy buffers. "handle" 
+  // is whatever the backend uses to represent a buffer (an MTL::Buffer*, a 
+  // pointer to host memory, ...).
+  class BufferAllocator {
+    public:
+      virtual ~BufferAllocator();
+
+      virtual void * Allocate(std::size_t capacity, std::uint32_t storageMode) = 0;
+      virtual void Free(void * handle, std::size_t capacity, std::uint32_t storageMode) = 0;
+  };
+
+  struct BufferPoolStats {
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t evictions = 0;
+    // bytes sitting in free lists, ready to be reused
+    std::size_t bytesRetained = 0;
+    // bytes handed out and not yet released
+    std::size_t bytesInUse = 0;
+  };
+
+  // Caches released buffers in per-storage-mode free lists of power-of-two 
+  // size classes, so that batches reuse device memory instead of allocating
+  // and freeing it every time. Free lists are trimmed (largest buffers first)
+  // whenever the bytes they retain exceed the high-water mark.
+  class BufferPool {
+    public:
+      struct Block {
+        void * handle;
+        std::size_t capacity;
+        std::uint32_t storageMode;
+      };
+
+      static constexpr std::size_t kMinBlockSize = 256;
+      static constexpr std::size_t kDefaultHighWaterMark = 256 * 1024 * 1024;
+
+      BufferPool(BufferAllocator * allocator, 
+          std::size_t highWaterMark = kDefaultHighWaterMark);
+      ~BufferPool();
+
+      BufferPool(const BufferPool& other) = delete;
+      BufferPool& operator=(const BufferPool& other) = delete;
+
+      // Returns a buffer with capacity for at least "size" bytes. Throws
+      // std::bad_alloc if the allocator fails to allocate it.
+      Block Acquire(std::size_t size, std::uint32_t storageMode);
+      void Release(const Block& block);
+
+      // Frees cached buffers until at most "maxBytesRetained" bytes are left.
+      void Trim(std::size_t maxBytesRetained = 0);
+      void SetHighWaterMark(std::size_t highWaterMark);
+      std::size_t GetHighWaterMark() const;
+      BufferPoolStats GetStats() const;
+
+      static std::size_t SizeClass(std::size_t size);
+    private:
+      BufferAllocator * allocator;
+      std::size_t highWaterMark;
+      BufferPoolStats stats;
+      // free lists by storage mode and size class
+      std::unordered_map<std::uint32_t, std::vector<std::vector<void *>>> freeLists;
+      mutable std::mutex mutex;
+
+      void DoTrim(std::size_t maxBytesRetained);
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_BUFFER_POOL
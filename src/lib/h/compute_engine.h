@@ -0,0 +1,829 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_ENGINE
+#define _MDL_COMPUTE_ENGINE
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arg_buffers.h"
+#include "artifact_cache.h"
+#include "buffer_pool.h"
+#include "compute_exception.h"
+#include "engine_stats.h"
+#include "kernel.h"
+#include "resident_buffer.h"
+#include "work_group_tuner.h"
+
+namespace mdl {
+namespace compute {
+
+  // Layout of the grid size read by calls built with 
+  // BatchBuilder::WithIndirectGrid(): numbers of work-groups, in x, y, z 
+  // order (same as Metal's MTLDispatchThreadgroupsIndirectArguments).
+  struct IndirectGrid {
+    std::uint32_t numGroupCols;
+    std::uint32_t numGroupRows;
+    std::uint32_t numGroupLayers;
+  };
+
+  // See ComputeEngine::EnableCoalescing().
+  struct CoalescingOptions {
+    // how long the first batch of a group may wait for others
+    std::chrono::microseconds window = std::chrono::microseconds(200);
+    // groups are submitted as soon as they reach this many batches
+    std::size_t maxBatches = 64;
+  };
+
+  // Backend-neutral compute engine. Batches are built with the same fluent API
+  // regardless of backend:
+  //
+  //   engine.NewBatch()
+  //       .WithGrid(1, kSize, 1, kSize).Call("swap", inout(f1), inout(f2))
+  //       .Dispatch().Wait();
+  //
+  // Arguments are collected into the batch with static dispatch; backends are
+  // only reached through a virtual call once per Call() and Dispatch().
+  //
+  // Buffers (in(), out(), inout(), shared()) bind application memory, which
+  // is read when the batch is submitted and written when it completes, not
+  // at Call(): it must stay alive, and must not be modified, until the batch
+  // completes. Arguments passed by value are copied at Call() instead, so 
+  // they can be temporaries.
+  //
+  // Batches dispatched without waiting run concurrently, except when one of
+  // them writes memory that the other reads or writes: the later batch is then
+  // held back and submitted as soon as the earlier one completes. Batches that
+  // only conflict through resident buffers are, on backends that can order 
+  // them on the device, only held until the earlier one has been submitted.
+  // Read/write sets are inferred from the buffers passed to Call() (see 
+  // BatchBuilder to narrow them down for resident buffers).
+  class ComputeEngine {
+    protected:
+      struct Argument {
+        BufferType type;
+        std::uint64_t id;
+        void * data;
+        std::size_t size;
+        ResidentStorage * resident;
+      };
+
+      // Memory read or written by a batch.
+      struct Access {
+        // id of a resident buffer, 0 for application memory
+        std::uint64_t resource;
+        const void * data;
+        std::size_t size;
+        bool write;
+
+        bool Conflicts(const Access& other) const;
+      };
+
+      struct Grid {
+        std::size_t numRows = 0;
+        std::size_t numCols = 0; 
+        std::size_t workGroupRows = 0;
+        std::size_t workGroupCols = 0;
+        std::size_t numLayers = 1;
+        std::size_t workGroupLayers = 1;
+        // dispatched as a number of whole work-groups, see WithWorkGroups()
+        bool byWorkGroups = false;
+        // read from an IndirectGrid at "indirectOffset" in a private or 
+        // resident buffer when the call runs, see WithIndirectGrid(). The 
+        // grid's dimensions are 0 until then.
+        bool indirect = false;
+        std::uint64_t indirectId = 0;
+        ResidentStorage * indirectResident = nullptr;
+        std::size_t indirectOffset = 0;
+
+        std::size_t NumThreads() const {
+          return numRows * numCols * numLayers;
+        }
+      };
+
+      struct Batch : public std::enable_shared_from_this<Batch> {
+        ComputeEngine * engine;
+        bool parallel;
+
+        // the grid and arguments of the call currently being built
+        Grid grid;
+        std::vector<Argument> args;
+        // values of the call's inline arguments, which point into it
+        std::vector<std::byte> inlineArgs;
+        std::size_t inlineArgsEnd = 0;
+        // keeps resident buffers alive while the batch may use them
+        std::vector<std::shared_ptr<ResidentStorage>> residents;
+        // copies of arguments passed by value that are too large to be 
+        // inline, bound as "in" buffers
+        std::vector<std::shared_ptr<std::byte[]>> values;
+
+        // completion state, see Complete()
+        std::mutex mutex;
+        std::condition_variable completed;
+        bool done = false;
+        std::exception_ptr error;
+        std::vector<std::function<void(std::exception_ptr)>> callbacks;
+
+        // hazard tracking, see ComputeEngine::Schedule(). "accesses" are
+        // inferred from arguments, "declared" overrides them for resources.
+        std::vector<Access> accesses;
+        std::vector<Access> declared;
+        // guarded by the engine's schedulerMutex
+        bool scheduled = false;
+        std::list<std::shared_ptr<Batch>>::iterator inFlight;
+        std::vector<std::shared_ptr<Batch>> dependents;
+        // batches this one waits for, plus one while it's being scheduled
+        std::atomic_size_t pendingDependencies = 0;
+        // batches this one is ordered after on the device: it is submitted 
+        // once they have been, and the backend makes it wait for them. Set
+        // before the batch starts.
+        std::vector<std::shared_ptr<Batch>> after;
+        // dependents waiting for this batch to be submitted rather than to
+        // complete, guarded by "mutex"
+        bool submitted = false;
+        std::vector<std::shared_ptr<Batch>> submissionDependents;
+
+        // only set while the engine is instrumented
+        std::unique_ptr<BatchTrace> trace;
+        // batches whose calls this one runs, when coalesced. Completing it
+        // completes them instead.
+        std::vector<std::shared_ptr<Batch>> members;
+
+        Batch(ComputeEngine * engine, bool parallel);
+        virtual ~Batch();
+
+        // Encodes a call to "kernel" using the current grid and arguments.
+        virtual void Encode(const KernelInfo& kernel) = 0;
+        // Starts executing the batch. Backends must call Complete() once the
+        // batch has finished and its results have been copied back.
+        virtual void Submit() = 0;
+
+        // Encode(), timed when the batch is traced.
+        void EncodeCall(const KernelInfo& kernel);
+        // Moves the calls of "other", which hasn't been submitted, to the end
+        // of this batch. Throws RuntimeException by default.
+        virtual void Absorb(Batch& other);
+
+        // Submit(), timed when the batch is traced, or handed to the engine
+        // to be coalesced with other batches. Completes the batch with the 
+        // error if submitting it throws. Then starts the batches that were
+        // waiting for it to be submitted.
+        void Start();
+        // Start() without the batches waiting for it, which are returned.
+        std::vector<std::shared_ptr<Batch>> Launch();
+        // Returns the batches that were waiting for this one to be submitted 
+        // and are now ready, for the caller to start. Only the first call 
+        // returns any.
+        std::vector<std::shared_ptr<Batch>> MarkSubmitted();
+
+        // Records the memory "arg" reads or writes for hazard tracking.
+        void AddAccess(const Argument& arg);
+
+        // Retires the batch from the scheduler, then marks it as done, wakes
+        // up waiters, starts the batches that were waiting for it and runs 
+        // callbacks, on the calling thread. Past marking the batch as done,
+        // the engine is only touched to start those batches.
+        void Complete(std::exception_ptr error);
+        bool Done();
+        void Wait();
+        void Then(std::function<void(std::exception_ptr)>&& callback);
+      };
+
+    public:
+      class BatchBuilder;
+      class BatchTemplate;
+
+      // Arguments that aren't buffers (scalars, small structs) of up to this
+      // size are passed by value, without allocating a device buffer for them.
+      static constexpr std::size_t kMaxInlineArgumentSize = 64;
+
+      // Completion of a dispatched batch. Besides blocking on Wait(), callers
+      // can be notified asynchronously: with a callback, a future, or by 
+      // co_await'ing the gate from a coroutine. Callbacks and coroutines are
+      // resumed on the thread that completed the batch, after results have 
+      // been copied back, so they should hand off any long-running work.
+      class Gate {
+        public:
+          struct Awaiter {
+            std::shared_ptr<Batch> batch;
+
+            bool await_ready() const;
+            // Returns false, without suspending, if the batch completed 
+            // since await_ready().
+            bool await_suspend(std::coroutine_handle<> handle) const;
+            void await_resume() const;
+          };
+
+          // Blocks until the batch completes. Rethrows the batch's error, if
+          // any.
+          void Wait() const;
+          bool Done() const;
+          // Runs "callback" once the batch completes, or right away if it 
+          // already has. The callback gets the batch's error, if any, and must
+          // not throw.
+          void Then(std::function<void(std::exception_ptr)> callback) const;
+          std::future<void> ToFuture() const;
+          Awaiter operator co_await() const;
+        private:
+          std::shared_ptr<Batch> batch;
+          friend class ComputeEngine::BatchBuilder;
+          friend class ComputeEngine::BatchTemplate;
+
+          Gate(const std::shared_ptr<Batch>& batch);
+      };
+
+      class CallBuilder {
+        public:
+          template <class... Args>
+          BatchBuilder Call(std::string_view fn, Args&&... args);
+
+          template <class... Args>
+          BatchBuilder Call(const Kernel& kernel, Args&&... args);
+
+        private:
+          std::shared_ptr<Batch> batch;
+          friend class ComputeEngine::BatchBuilder;
+
+          CallBuilder(const std::shared_ptr<Batch>& batch);
+          CallBuilder(std::shared_ptr<Batch>&& batch);
+
+          template <class T>
+          void AddArgument(const T& value);
+
+          template <BufferType BT, class DT>
+          void AddArgument(const buffer<BT, DT>& buff);
+
+          void AddArgument(const ResidentBuffer& buff);
+      };
+
+      class BatchBuilder {
+        public:
+          CallBuilder WithGrid(
+              std::size_t numRows, std::size_t numCols, 
+              std::size_t workGroupRows, std::size_t workGroupCols);
+          // Lets the engine pick the work-group shape for the next call: one
+          // tuned with Autotune(), if any, or one that suits the kernel and 
+          // backend. Same as passing 0 for the work-group dimensions.
+          CallBuilder WithGrid(std::size_t numRows, std::size_t numCols);
+          // A 3D grid of layers of rows, so that volumes or stacks of matrices
+          // are processed in one call. Dimensions are in x, y, z order, as
+          // kernels see them: columns, rows, then layers.
+          CallBuilder WithGrid3D(
+              std::size_t numCols, std::size_t numRows, std::size_t numLayers,
+              std::size_t workGroupCols, std::size_t workGroupRows, 
+              std::size_t workGroupLayers);
+          // A grid of whole work-groups, given by their number and size in x, 
+          // y, z order. Unlike other grids, which may end with partial 
+          // work-groups, every work-group is full: kernels must handle 
+          // threads past the end of their data. For kernels that rely on 
+          // full work-groups, and for GPUs without non-uniform threadgroups.
+          CallBuilder WithWorkGroups(
+              std::size_t numGroupCols, std::size_t numGroupRows, std::size_t numGroupLayers,
+              std::size_t workGroupCols, std::size_t workGroupRows, 
+              std::size_t workGroupLayers);
+          // Like WithWorkGroups(), but the number of work-groups is read from
+          // an IndirectGrid at "offset" bytes into "buff" when the call runs, 
+          // so that a kernel earlier in the batch can size it without a round
+          // trip through the host:
+          //
+          //   private_buffer count = priv(sizeof(IndirectGrid));
+          //   engine.NewBatch()
+          //       .WithGrid(1, kSize, 1, 256).Call("compact", in(input), out(output), count)
+          //       .WithIndirectGrid(count, 0, 256).Call("process", inout(output))
+          //       .Dispatch().Wait();
+          //
+          // Private buffers must have been passed to an earlier call of the 
+          // batch. Only serial batches can use indirect grids, as their calls 
+          // run in order. Throws RuntimeException otherwise, or if "offset" 
+          // isn't a multiple of 4 or the grid doesn't fit in the buffer.
+          CallBuilder WithIndirectGrid(
+              const private_buffer& buff, std::size_t offset, 
+              std::size_t workGroupCols, std::size_t workGroupRows = 1, 
+              std::size_t workGroupLayers = 1);
+          CallBuilder WithIndirectGrid(
+              const ResidentBuffer& buff, std::size_t offset, 
+              std::size_t workGroupCols, std::size_t workGroupRows = 1, 
+              std::size_t workGroupLayers = 1);
+          // Declare how the batch uses memory. Resident buffers passed to 
+          // Call() are assumed to be both read and written; declaring them 
+          // read-only lets batches that only read them run concurrently. 
+          // Application memory not passed to Call() can be declared too.
+          BatchBuilder Reads(const ResidentBuffer& buff);
+          BatchBuilder Writes(const ResidentBuffer& buff);
+          template <class T>
+          BatchBuilder Reads(const T& value);
+          template <class T>
+          BatchBuilder Writes(const T& value);
+          // Submits the batch, or holds it back until batches it conflicts 
+          // with have completed (or only been submitted, see ComputeEngine).
+          // Errors submitting the batch are reported through the Gate.
+          Gate Dispatch();
+          // Finishes recording a batch started with NewBatchTemplate(). Throws
+          // RuntimeException for batches started with NewBatch().
+          BatchTemplate Record();
+        private:
+          std::shared_ptr<Batch> batch;
+
+          BatchBuilder(const std::shared_ptr<Batch>& batch);
+          BatchBuilder(std::shared_ptr<Batch>&& batch);
+          friend class ComputeEngine;
+      };
+
+      // A batch recorded once and dispatched any number of times, skipping 
+      // kernel lookups and argument collection. Arguments can be rebound 
+      // between dispatches, by call and argument index, to other memory of
+      // the same kind (or other values of the same size, for inline
+      // arguments):
+      //
+      //   ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+      //       .WithGrid(1, kSize, 1, kSize).Call("scale", in(input), out(output), 2.0f)
+      //       .Record();
+      //   tmpl.Bind(0, 0, in(otherInput));
+      //   tmpl.Bind(0, 2, 3.0f);
+      //   tmpl.Dispatch().Wait();
+      //
+      // Each dispatch is an independent batch. Templates are cheap to copy; 
+      // a single template must not be bound and dispatched from several 
+      // threads at once.
+      class BatchTemplate {
+        public:
+          template <BufferType BT, class DT>
+          void Bind(std::size_t call, std::size_t arg, const buffer<BT, DT>& buff);
+          void Bind(std::size_t call, std::size_t arg, const ResidentBuffer& buff);
+          // Inline values, or values copied into an "in" buffer, as Call() 
+          // does for arguments passed by value. Memory bound in place must 
+          // be passed as a buffer (in(), out(), ...).
+          template <class T>
+          void Bind(std::size_t call, std::size_t arg, const T& value);
+
+          Gate Dispatch() const;
+          std::size_t NumCalls() const;
+        private:
+          struct RecordedCall {
+            const KernelInfo * kernel;
+            // indirect grids read from private buffers keep the buffer's 
+            // slot in "indirectId"
+            Grid grid;
+            std::size_t firstArg;
+            std::size_t numArgs;
+            // the call's inline values, in "inlineValues"
+            std::size_t inlineBegin;
+            std::size_t inlineSize;
+            // keeps the resident buffer of an indirect grid alive
+            std::shared_ptr<ResidentStorage> indirectResident;
+          };
+
+          ComputeEngine * engine;
+          bool parallel;
+          std::vector<RecordedCall> calls;
+          std::vector<Argument> args;
+          // per argument: offset of inline values in their call's block, or
+          // index of buffers in the ids each dispatch allocates (buffers 
+          // recorded with the same id share one)
+          std::vector<std::size_t> slots;
+          std::size_t numIds = 0;
+          std::vector<std::byte> inlineValues;
+          // per argument, keeps resident buffers alive
+          std::vector<std::shared_ptr<ResidentStorage>> residents;
+          // copies of the arguments recorded by value
+          std::vector<std::shared_ptr<std::byte[]>> values;
+          // per argument, copies of the values bound by Bind(), if any
+          std::vector<std::shared_ptr<std::byte[]>> boundValues;
+          std::vector<Access> declared;
+          friend class ComputeEngine;
+
+          BatchTemplate(ComputeEngine * engine, bool parallel);
+          Argument& ArgumentAt(std::size_t call, std::size_t arg, BufferType type);
+      };
+
+      // Creates an engine for the given backend ("cpu" or "metal"). An empty 
+      // name selects the fastest backend available on this machine. Throws 
+      // RuntimeException if the backend is unknown, not compiled in or not 
+      // available.
+      static std::unique_ptr<ComputeEngine> Create(const std::string& backend = "");
+      // The backends compiled into this build, fastest first.
+      static std::vector<std::string> Backends();
+
+      virtual ~ComputeEngine();
+
+      virtual const char * Backend() const = 0;
+      virtual bool Available() const = 0;
+      virtual void LoadLibrary(const std::string& sourceCode) = 0;
+      virtual bool ContainsFunction(const std::string& functionName) const = 0;
+      // Resolves a kernel once, so that calls through the returned handle skip
+      // looking it up by name. Throws FunctionNotFoundException if there is
+      // no such function.
+      //
+      // Like NewBatch() and dispatching batches, this can be called from any 
+      // number of threads at once.
+      Kernel GetKernel(std::string_view functionName);
+      // Resolves every function the engine knows about, compiling their 
+      // pipelines in parallel, so that the first calls don't pay for it. 
+      // Rethrows the first error, after all functions were tried.
+      virtual void PrecompileAll();
+      // Where compiled artifacts are kept across runs, keyed by source hash,
+      // backend and options. Must be set before loading libraries to take 
+      // effect for them. None by default.
+      void SetArtifactCache(const std::shared_ptr<ArtifactCache>& cache);
+      // Pool that batch buffers are allocated from. Can be used to tune its 
+      // high-water mark, trim it and read its hit/miss counters.
+      virtual BufferPool& GetBufferPool() = 0;
+      BatchBuilder NewBatch(bool parallel = false);
+      // Starts recording a BatchTemplate: build it like a batch and finish 
+      // with BatchBuilder::Record() instead of Dispatch().
+      BatchBuilder NewBatchTemplate(bool parallel = false);
+
+      ResidentBuffer NewResidentBuffer(std::size_t size);
+      template <class T>
+      ResidentBuffer NewResidentBuffer(const T& data);
+
+      // Instrumentation, off by default. When on, batches record when they 
+      // go through each stage, when each of their calls runs and how many 
+      // bytes they move. When off, the cost is a pointer check per stage.
+      void EnableInstrumentation(bool enabled = true);
+      // Totals over the batches completed since instrumentation was enabled
+      // or stats were reset.
+      EngineStats GetStats();
+      // Traces of the most recently completed batches (up to kMaxTraces).
+      std::vector<BatchTrace> GetTraces() const;
+      void ResetStats();
+      // Writes the traces of recently completed batches in Chrome's 
+      // trace-event format, which chrome://tracing and Perfetto can open.
+      void WriteChromeTrace(std::ostream& out) const;
+
+      // Coalescing, off by default. When on, batches ready to run are held 
+      // for up to a time window and submitted together with the other batches
+      // that became ready in the meantime, as one backend submission. Each
+      // batch still completes its own Gate, but an error in any batch of a 
+      // group fails all of them. Trades latency for throughput when many 
+      // threads dispatch small batches.
+      void EnableCoalescing(bool enabled = true, const CoalescingOptions& options = {});
+
+      // Where work-group shapes tuned with Autotune() are kept and looked up
+      // by calls that don't specify one. Must be set before dispatching 
+      // batches. None by default.
+      void SetWorkGroupTuner(const std::shared_ptr<WorkGroupTuner>& tuner);
+      // Finds the fastest work-group shape for calls to "fn" over grids of 
+      // about this size, by dispatching the call below with candidate shapes,
+      // and records it in the tuner. Returns right away with the recorded 
+      // shape if there already is one. Blocks while it runs, and must only be
+      // given arguments that can be dispatched repeatedly. Throws 
+      // RuntimeException if no tuner was set.
+      //
+      //   engine.SetWorkGroupTuner(std::make_shared<WorkGroupTuner>("shapes.txt"));
+      //   engine.Autotune("scale", kRows, kCols, in(input), out(output), 2.0f);
+      //   engine.NewBatch().WithGrid(kRows, kCols).Call("scale", ...);
+      template <class... Args>
+      WorkGroupShape Autotune(std::string_view fn, std::size_t numRows, std::size_t numCols, 
+          const Args&... args);
+
+      static constexpr std::size_t kMaxTraces = 100000;
+      // times each candidate shape runs for when tuning, the fastest counting
+      static constexpr int kAutotuneRuns = 3;
+    protected:
+      static constexpr std::size_t kInlineArgumentAlignment = 16;
+
+      template <class T>
+      static constexpr bool IsInlineArgument() {
+        return std::is_trivially_copyable_v<T> 
+            && !is_buffer<T>::value
+            && !std::is_pointer_v<T> 
+            && !std::is_array_v<T>
+            && sizeof(T) <= kMaxInlineArgumentSize;
+      }
+
+      template <class T>
+      static constexpr std::size_t InlineArgumentSlot() {
+        if constexpr (IsInlineArgument<T>()) {
+          return (sizeof(T) + kInlineArgumentAlignment - 1) 
+              / kInlineArgumentAlignment * kInlineArgumentAlignment;
+        } else {
+          return 0;
+        }
+      }
+
+      virtual std::shared_ptr<Batch> CreateBatch(bool parallel) = 0;
+      virtual std::shared_ptr<ResidentStorage> CreateResidentStorage(std::size_t size) = 0;
+      // Fills in the backend handle and limits of "kernel", or throws 
+      // FunctionNotFoundException.
+      virtual void LoadKernel(KernelInfo& kernel) = 0;
+      // Names of all the functions the engine can resolve.
+      virtual std::vector<std::string> FunctionNames() const = 0;
+      // Picks the work-group shape of a call "grid" doesn't have one for. 
+      // Looks up tuned shapes first, then by default fills 
+      // executionWidth-wide rows, up to the kernel's maximum work-group size.
+      virtual void SizeWorkGroup(
+          const KernelInfo& kernel, Grid& grid, const std::vector<Argument>& args) const;
+      // Returns false if no shape was tuned for calls like this one.
+      bool FindTunedWorkGroup(const KernelInfo& kernel, Grid& grid) const;
+      // Shapes Autotune() tries: power of two sizes from the kernel's 
+      // execution width up to its maximum, in a few aspect ratios each.
+      std::vector<WorkGroupShape> WorkGroupCandidates(
+          const KernelInfo& kernel, std::size_t numRows, std::size_t numCols) const;
+      // Submits batches held for coalescing and stops holding new ones. 
+      // Backends must call it before tearing down what batches use.
+      void StopCoalescing();
+      // Whether batches that only conflict through resident buffers can be
+      // submitted as soon as the batches they conflict with have been, the
+      // backend ordering them on the device (see Batch::after). If not, the
+      // default, they are held until those batches complete.
+      virtual bool OrdersOnDevice() const;
+
+      std::shared_ptr<ArtifactCache> GetArtifactCache() const;
+    private:
+      // builds batches on the engines it dispatches to
+      friend class AdaptiveComputeEngine;
+
+      std::atomic_bool instrumented = false;
+      std::atomic_uint64_t nextBatchId = 0;
+      mutable std::mutex statsMutex;
+      TraceTime traceEpoch;
+      EngineStats stats;
+      std::deque<BatchTrace> traces;
+
+      void StartTrace(Batch& batch);
+      void RecordTrace(const BatchTrace& trace);
+
+      // Collects calls into a template rather than encoding them.
+      struct RecordingBatch : public Batch {
+        BatchTemplate recorded;
+        std::unordered_map<std::uint64_t, std::size_t> slotsById;
+
+        RecordingBatch(ComputeEngine * engine, bool parallel);
+
+        void Encode(const KernelInfo& kernel) override;
+        void Submit() override;
+      };
+
+      std::shared_ptr<ArtifactCache> artifactCache;
+      std::shared_ptr<WorkGroupTuner> workGroupTuner;
+
+      // batches held for coalescing, submitted by "coalescer" at the end of
+      // their window or by Coalesce() once there are enough of them
+      std::atomic_bool coalescing = false;
+      std::mutex coalescingMutex;
+      std::condition_variable coalescingWakeUp;
+      CoalescingOptions coalescingOptions;
+      std::vector<std::shared_ptr<Batch>> coalesced;
+      std::chrono::steady_clock::time_point windowStart;
+      // incremented whenever a group starts, so that the coalescer notices
+      // groups submitted before their window ended
+      std::uint64_t window = 0;
+      bool stopCoalescer = false;
+      std::thread coalescer;
+
+      void Coalesce(const std::shared_ptr<Batch>& batch);
+      // Submits "group" as one batch. Errors fail every batch in the group.
+      void SubmitCoalesced(std::vector<std::shared_ptr<Batch>>&& group);
+      void RunCoalescer();
+
+      // batches that were dispatched with accesses and haven't completed yet
+      std::mutex schedulerMutex;
+      std::list<std::shared_ptr<Batch>> inFlight;
+
+      // Submits "batch" once the in-flight batches it conflicts with complete,
+      // or have been submitted, see OrdersOnDevice().
+      void Schedule(const std::shared_ptr<Batch>& batch);
+      // Called as "batch" completes; returns the dependents that became 
+      // ready, for the caller to start.
+      std::vector<std::shared_ptr<Batch>> Retire(Batch * batch);
+
+      // Open addressed, linearly probed table of kernels. Slots are only ever
+      // filled, never cleared or moved, so lookups can probe it while a 
+      // kernel is being added.
+      struct KernelTable {
+        explicit KernelTable(std::size_t capacity) 
+            : capacity(capacity), slots(new std::atomic<KernelInfo *>[capacity]()) {}
+
+        const std::size_t capacity;
+        std::unique_ptr<std::atomic<KernelInfo *>[]> slots;
+      };
+
+      // Kernels are looked up without locking in the current table, 
+      // "kernels". Misses load the kernel, then take "kernelsMutex" and 
+      // publish it in the table; once the table is half full, a table twice
+      // its size replaces it. Replaced tables are kept until the engine goes
+      // away as lookups may still be reading them: they add up to less than
+      // the current one.
+      std::atomic<const KernelTable *> kernels = nullptr;
+      std::mutex kernelsMutex;
+      std::vector<std::unique_ptr<KernelTable>> kernelTables;
+      std::vector<std::unique_ptr<KernelInfo>> kernelInfos;
+
+      static KernelInfo * Find(const KernelTable& table, std::string_view name);
+      static void Insert(KernelTable& table, KernelInfo * kernel);
+  };
+
+  template <class T>
+  ResidentBuffer ComputeEngine::NewResidentBuffer(const T& data) {
+    ResidentBuffer buffer = NewResidentBuffer(sizefn<T>{}(data));
+    buffer.Update(data);
+    return buffer;
+  }
+
+  template <class... Args>
+  WorkGroupShape ComputeEngine::Autotune(
+      std::string_view fn, std::size_t numRows, std::size_t numCols, const Args&... args) {
+    if (!workGroupTuner) {
+      throw RuntimeException("No work-group tuner set");
+    }
+    Kernel kernel = GetKernel(fn);
+    WorkGroupKey key(Backend(), kernel.Name(), numRows, numCols);
+    WorkGroupShape best;
+    if (workGroupTuner->Find(key, best)) {
+      return best;
+    }
+
+    std::vector<WorkGroupShape> candidates = 
+        WorkGroupCandidates(*kernel.GetInfo(), numRows, numCols);
+    // one run first, so that nothing the first call pays for (e.g. caches
+    // warming up) is charged to the first candidate
+    NewBatch()
+        .WithGrid(numRows, numCols, candidates.front().rows, candidates.front().cols)
+        .Call(kernel, args...)
+        .Dispatch().Wait();
+
+    std::chrono::steady_clock::duration bestTime = std::chrono::steady_clock::duration::max();
+    for (auto it = candidates.begin(); it != candidates.end(); it++) {
+      for (int run = 0; run < kAutotuneRuns; run++) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        NewBatch()
+            .WithGrid(numRows, numCols, it->rows, it->cols)
+            .Call(kernel, args...)
+            .Dispatch().Wait();
+        std::chrono::steady_clock::duration time = std::chrono::steady_clock::now() - begin;
+        if (time < bestTime) {
+          bestTime = time;
+          best = *it;
+        }
+      }
+    }
+    workGroupTuner->Store(key, best);
+    return best;
+  }
+
+  template <class... Args>
+  ComputeEngine::BatchBuilder ComputeEngine::CallBuilder::Call(
+      std::string_view fn, Args&&... args) {
+    return Call(batch->engine->GetKernel(fn), std::forward<Args>(args)...);
+  }
+
+  template <class... Args>
+  ComputeEngine::BatchBuilder ComputeEngine::CallBuilder::Call(
+      const Kernel& kernel, Args&&... args) {
+    if (!kernel || kernel.GetInfo()->engine != batch->engine) {
+      throw FunctionNotFoundException("Kernel does not belong to this engine");
+    }
+
+    batch->args.clear();
+    // sized up front so that inline arguments can point into it
+    batch->inlineArgs.resize((InlineArgumentSlot<std::remove_cvref_t<Args>>() + ... + 0));
+    batch->inlineArgsEnd = 0;
+    (AddArgument(args), ...);
+    batch->EncodeCall(*kernel.GetInfo());
+    return BatchBuilder(batch);
+  }
+
+  template <class T>
+  void ComputeEngine::CallBuilder::AddArgument(const T& value) {
+    if constexpr (IsInlineArgument<T>()) {
+      std::byte * slot = batch->inlineArgs.data() + batch->inlineArgsEnd;
+      std::memcpy(slot, &value, sizeof(T));
+      batch->inlineArgsEnd += InlineArgumentSlot<T>();
+      batch->args.push_back(Argument {
+        .type = BufferType::Inline,
+        .id = 0,
+        .data = slot,
+        .size = sizeof(T)
+      });
+    } else {
+      // copied rather than bound in place, as the value may well be a 
+      // temporary that's gone by the time the batch runs
+      std::size_t size = sizefn<T>{}(value);
+      std::shared_ptr<std::byte[]> copy(new std::byte[size]);
+      if (size) {
+        std::memcpy(copy.get(), addressfn<T>{}(value), size);
+      }
+      batch->values.push_back(copy);
+      AddArgument(in_buffer { .id = ++idSeq, .data = copy.get(), .size = size });
+    }
+  }
+
+  template <BufferType BT, class DT>
+  void ComputeEngine::CallBuilder::AddArgument(const buffer<BT, DT>& buff) {
+    batch->args.push_back(Argument {
+      .type = BT,
+      .id = buff.id,
+      .data = const_cast<void *>(static_cast<const void *>(buff.data)),
+      .size = buff.size
+    });
+    batch->AddAccess(batch->args.back());
+  }
+
+  template <BufferType BT, class DT>
+  void ComputeEngine::BatchTemplate::Bind(
+      std::size_t call, std::size_t arg, const buffer<BT, DT>& buff) {
+    Argument& argument = ArgumentAt(call, arg, BT);
+    argument.data = const_cast<void *>(static_cast<const void *>(buff.data));
+    argument.size = buff.size;
+  }
+
+  template <class T>
+  void ComputeEngine::BatchTemplate::Bind(std::size_t call, std::size_t arg, const T& value) {
+    if constexpr (IsInlineArgument<T>()) {
+      Argument& argument = ArgumentAt(call, arg, BufferType::Inline);
+      if (argument.size != sizeof(T)) {
+        throw RuntimeException("Inline argument bound to a value of a different size");
+      }
+      std::memcpy(
+          inlineValues.data() + calls[call].inlineBegin + slots[calls[call].firstArg + arg],
+          &value, sizeof(T));
+    } else {
+      // copied, like Call() copies arguments passed by value, so they can
+      // only take the place of "in" buffers
+      Argument& argument = ArgumentAt(call, arg, BufferType::In);
+      std::size_t size = sizefn<T>{}(value);
+      std::shared_ptr<std::byte[]> copy(new std::byte[size]);
+      if (size) {
+        std::memcpy(copy.get(), addressfn<T>{}(value), size);
+      }
+      if (boundValues.empty()) {
+        boundValues.resize(args.size());
+      }
+      boundValues[calls[call].firstArg + arg] = copy;
+      argument.data = copy.get();
+      argument.size = size;
+    }
+  }
+
+  template <class T>
+  ComputeEngine::BatchBuilder ComputeEngine::BatchBuilder::Reads(const T& value) {
+    batch->declared.push_back(Access {
+      .resource = 0,
+      .data = addressfn<T>{}(value),
+      .size = sizefn<T>{}(value),
+      .write = false
+    });
+    return *this;
+  }
+
+  template <class T>
+  ComputeEngine::BatchBuilder ComputeEngine::BatchBuilder::Writes(const T& value) {
+    batch->declared.push_back(Access {
+      .resource = 0,
+      .data = addressfn<T>{}(value),
+      .size = sizefn<T>{}(value),
+      .write = true
+    });
+    return *this;
+  }
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_ENGINE
@@ -0,0 +1,227 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_CPU_COMPUTE_ENGINE
+#define _MDL_CPU_COMPUTE_ENGINE
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arg_buffers.h"
+#include "compute_engine.h"
+#include "thread_pool.h"
+
+namespace mdl {
+namespace compute {
+
+  // A work-group of a CPU dispatch: its position in the grid of work-groups 
+  // and the (half-open) range of grid threads it covers. Work-groups on the
+  // right/bottom/back edges of the grid may be smaller than requested. 2D
+  // grids have a single layer.
+  struct CpuWorkGroup {
+    std::size_t row;
+    std::size_t col;
+    std::size_t rowBegin;
+    std::size_t rowEnd;
+    std::size_t colBegin;
+    std::size_t colEnd;
+    std::size_t layer = 0;
+    std::size_t layerBegin = 0;
+    std::size_t layerEnd = 1;
+  };
+
+  // Arguments bound to a CPU kernel call, in the order they were passed to
+  // Call(). "in" and "private" arguments must be treated as read-only and 
+  // scratch memory, respectively, just like on the GPU. "local" arguments 
+  // point to scratch memory of the worker thread running the work-group.
+  class CpuKernelArgs {
+    public:
+      CpuKernelArgs(void * const * args, std::size_t count);
+
+      template <class T>
+      T * Get(std::size_t index) const {
+        return static_cast<T *>(args[index]);
+      }
+
+      std::size_t Count() const;
+    private:
+      void * const * args;
+      std::size_t count;
+  };
+
+  // CPU kernels are invoked once per work-group.
+  typedef std::function<void(const CpuWorkGroup&, const CpuKernelArgs&)> CpuKernel;
+
+  // Adapts a per-thread function "void(std::size_t row, std::size_t col, 
+  // const CpuKernelArgs& args)" into a CpuKernel, so kernels can be written
+  // the same way as their Metal counterparts. Kernels for 3D grids take the
+  // layer first: "void(std::size_t layer, std::size_t row, std::size_t col, 
+  // const CpuKernelArgs& args)".
+  template <class Fn>
+  CpuKernel PerThread(Fn fn) {
+    return [fn](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+      for (std::size_t layer = group.layerBegin; layer < group.layerEnd; layer++) {
+        for (std::size_t row = group.rowBegin; row < group.rowEnd; row++) {
+          for (std::size_t col = group.colBegin; col < group.colEnd; col++) {
+            if constexpr (std::is_invocable_v<Fn, std::size_t, std::size_t, std::size_t, 
+                const CpuKernelArgs&>) {
+              fn(layer, row, col, args);
+            } else {
+              fn(row, col, args);
+            }
+          }
+        }
+      }
+    };
+  }
+
+  class CpuComputeEngine : public ComputeEngine {
+    struct Command {
+      const CpuKernel * kernel;
+      Grid grid;
+      std::vector<void *> args;
+      // copies of the call's inline arguments
+      std::vector<std::byte> inlineArgs;
+      // indices of local arguments and their offsets in a work-group's 
+      // scratch memory, of "localSize" bytes
+      std::vector<std::pair<std::size_t, std::size_t>> locals;
+      std::size_t localSize = 0;
+      // where an indirect grid is read from as the command starts
+      const IndirectGrid * indirect = nullptr;
+
+      std::size_t NumGroupRows() const {
+        return (grid.numRows + grid.workGroupRows - 1) / grid.workGroupRows;
+      }
+
+      std::size_t NumGroupCols() const {
+        return (grid.numCols + grid.workGroupCols - 1) / grid.workGroupCols;
+      }
+
+      std::size_t NumGroupLayers() const {
+        return (grid.numLayers + grid.workGroupLayers - 1) / grid.workGroupLayers;
+      }
+
+      std::size_t NumGroups() const {
+        return NumGroupRows() * NumGroupCols() * NumGroupLayers();
+      }
+    };
+
+    struct CpuBufferAllocator : public BufferAllocator {
+      void * Allocate(std::size_t capacity, std::uint32_t storageMode) override;
+      void Free(void * handle, std::size_t capacity, std::uint32_t storageMode) override;
+    };
+
+    struct CpuResidentStorage : public ResidentStorage {
+      std::unique_ptr<std::byte[]> memory;
+
+      CpuResidentStorage(std::size_t size);
+
+      void Update(const void * data, std::size_t size, std::size_t offset) override;
+      void Download(void * data, std::size_t size, std::size_t offset) const override;
+    };
+
+    struct CpuBatch : public Batch {
+      std::unordered_map<std::size_t, BufferPool::Block> privateBuffers;
+      std::vector<Command> commands;
+
+      std::atomic_size_t pendingTasks = 0;
+      std::size_t nextCommand = 0;
+      // first exception thrown by a kernel, guarded by "mutex"
+      std::exception_ptr kernelError;
+
+      CpuBatch(CpuComputeEngine * engine, bool parallel);
+      ~CpuBatch();
+
+      void Encode(const KernelInfo& kernel) override;
+      void Submit() override;
+      void Absorb(Batch& other) override;
+
+      void * GetBuffer(const Argument& arg);
+      void ReleaseBuffers();
+    };
+
+    public:
+      // numThreads == 0 means one worker thread per hardware core.
+      explicit CpuComputeEngine(std::size_t numThreads = 0);
+      virtual ~CpuComputeEngine();
+
+      const char * Backend() const override;
+      bool Available() const override;
+      // CPU kernels are C++ callables: they can't be compiled from source and 
+      // are added with RegisterKernel() instead. Always throws 
+      // CompilationException.
+      void LoadLibrary(const std::string& sourceCode) override;
+      bool ContainsFunction(const std::string& functionName) const override;
+      BufferPool& GetBufferPool() override;
+      // Can be called concurrently with batches being dispatched, but 
+      // replacing a kernel that running batches use is not supported.
+      void RegisterKernel(const std::string& functionName, const CpuKernel& kernel);
+      std::size_t NumThreads() const;
+    protected:
+      std::shared_ptr<Batch> CreateBatch(bool parallel) override;
+      std::shared_ptr<ResidentStorage> CreateResidentStorage(std::size_t size) override;
+      void LoadKernel(KernelInfo& kernel) override;
+      std::vector<std::string> FunctionNames() const override;
+      // A few work-groups per worker thread, each small enough for its share
+      // of the call's buffers to fit in the L2 cache.
+      void SizeWorkGroup(
+          const KernelInfo& kernel, Grid& grid, const std::vector<Argument>& args) const override;
+    private:
+      // assumed when the L2 cache size can't be queried
+      static constexpr std::size_t kDefaultCacheSize = 1 << 20;
+
+      // node based, so kernel handles stay valid as kernels get registered
+      std::unordered_map<std::string, CpuKernel> kernelsByFn;
+      mutable std::mutex kernelsByFnMutex;
+      CpuBufferAllocator allocator;
+      BufferPool bufferPool;
+      ThreadPool pool;
+      std::size_t cacheSize;
+
+      void StartCommands(const std::shared_ptr<CpuBatch>& batch);
+      void TraceCommands(CpuBatch& batch);
+      std::size_t GroupsPerTask(const Command& command) const;
+      std::size_t NumTasks(const Command& command) const;
+      void SubmitCommand(const std::shared_ptr<CpuBatch>& batch, const Command& command);
+      void FinishTask(const std::shared_ptr<CpuBatch>& batch);
+      void Complete(const std::shared_ptr<CpuBatch>& batch);
+  };
+} // compute
+} // mdl
+
+#endif  // _MDL_CPU_COMPUTE_ENGINE
@@ -0,0 +1,102 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_ENGINE_STATS
+#define _MDL_COMPUTE_ENGINE_STATS
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "arg_buffers.h"
+#include "buffer_pool.h"
+
+namespace mdl {
+namespace compute {
+
+  typedef std::chrono::steady_clock::time_point TraceTime;
+
+  struct CallTrace {
+    // name of the kernel, owned by the engine
+    const char * kernel;
+    TraceTime encodeBegin;
+    TraceTime encodeEnd;
+    // left at zero by backends that can't time calls individually. Calls of
+    // parallel batches all start and end with the batch.
+    TraceTime executeBegin;
+    TraceTime executeEnd;
+  };
+
+  // Timeline of one batch. Stages follow each other: encoding (created to 
+  // dispatched), waiting for the batches it depends on (to submitted), upload
+  // (to uploaded), queueing (to started), execution (to executed) and 
+  // copy-back (to completed).
+  struct BatchTrace {
+    std::uint64_t id;
+    bool parallel;
+    TraceTime created;
+    TraceTime dispatched;
+    TraceTime submitted;
+    TraceTime uploaded;
+    TraceTime started;
+    TraceTime executed;
+    TraceTime completed;
+    std::vector<CallTrace> calls;
+    // number of batches submitted together with this one, itself included
+    // (see ComputeEngine::EnableCoalescing())
+    std::size_t coalesced = 1;
+    // bytes copied between application memory and the device, by BufferType
+    std::array<std::size_t, kNumBufferTypes> bytesUploaded {};
+    std::array<std::size_t, kNumBufferTypes> bytesDownloaded {};
+  };
+
+  // Totals over the batches completed while instrumentation was enabled.
+  struct EngineStats {
+    std::size_t batches = 0;
+    std::size_t calls = 0;
+    // batches that were submitted together with others
+    std::size_t coalescedBatches = 0;
+    std::array<std::size_t, kNumBufferTypes> bytesUploaded {};
+    std::array<std::size_t, kNumBufferTypes> bytesDownloaded {};
+    // time spent in each stage, see BatchTrace
+    std::chrono::nanoseconds encodeTime {};
+    std::chrono::nanoseconds dependencyTime {};
+    std::chrono::nanoseconds uploadTime {};
+    std::chrono::nanoseconds queueTime {};
+    std::chrono::nanoseconds executeTime {};
+    std::chrono::nanoseconds copyBackTime {};
+    // current state of the buffer pool, always tracked. Misses are 
+    // allocations.
+    BufferPoolStats bufferPool;
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_ENGINE_STATS
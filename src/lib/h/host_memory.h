@@ -0,0 +1,103 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_HOST_MEMORY
+#define _MDL_COMPUTE_HOST_MEMORY
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+
+  struct HostMemoryOptions {
+    // Back large allocations with transparent huge pages, where the platform
+    // supports them (Linux), to cut TLB misses on large transfers.
+    bool hugePages = false;
+    // Prefer placing the memory on this NUMA node (Linux), or wherever it's
+    // first touched if negative.
+    int numaNode = -1;
+  };
+
+  // Size of a page of host memory, in bytes.
+  std::size_t HostPageSize();
+  bool IsPageAligned(const void * data);
+  std::size_t RoundUpToPage(std::size_t size);
+
+  // Allocates page-aligned, zeroed host memory, rounded up to a whole number
+  // of pages. Backends can bind such memory without copying it (see 
+  // shared()). Throws std::bad_alloc if the memory can't be allocated.
+  void * AllocateHostMemory(std::size_t size, const HostMemoryOptions& options = {});
+  // Frees memory returned by AllocateHostMemory(). "size" is the size it was
+  // allocated with.
+  void FreeHostMemory(void * data, std::size_t size);
+  // Whether the "size" bytes at "data" lie within a single live allocation
+  // of AllocateHostMemory() (including the rest of its last page). Only such
+  // memory is bound without copies: other memory, even if page-aligned, may 
+  // not be mappable by devices.
+  bool IsHostMemory(const void * data, std::size_t size);
+
+  // Standard allocator handing out AllocateHostMemory() memory, so that 
+  // containers using it can be bound without copies.
+  template <class T>
+  class host_allocator {
+    public:
+      typedef T value_type;
+
+      host_allocator() = default;
+      explicit host_allocator(const HostMemoryOptions& options) : options(options) {}
+      template <class U>
+      host_allocator(const host_allocator<U>& other) : options(other.GetOptions()) {}
+
+      T * allocate(std::size_t n) {
+        if (n > static_cast<std::size_t>(-1) / sizeof(T)) {
+          throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(AllocateHostMemory(n * sizeof(T), options));
+      }
+
+      void deallocate(T * data, std::size_t n) {
+        FreeHostMemory(data, n * sizeof(T));
+      }
+
+      const HostMemoryOptions& GetOptions() const { return options; }
+
+      // memory from any host_allocator can be freed by any other
+      template <class U>
+      bool operator==(const host_allocator<U>& other) const { return true; }
+    private:
+      HostMemoryOptions options;
+  };
+
+  template <class T>
+  using host_vector = std::vector<T, host_allocator<T>>;
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_HOST_MEMORY
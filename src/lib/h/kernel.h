@@ -0,0 +1,77 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_KERNEL
+#define _MDL_COMPUTE_KERNEL
+
+#include <cstddef>
+#include <string>
+
+namespace mdl {
+namespace compute {
+  class ComputeEngine;
+
+  // Everything an engine needs to encode a call to a kernel, resolved once 
+  // and cached by the engine.
+  struct KernelInfo {
+    std::string name;
+    const ComputeEngine * engine;
+    // backend object for the kernel (e.g. its MTL::ComputePipelineState)
+    void * handle = nullptr;
+    std::size_t maxThreadsPerWorkGroup = 0;
+    std::size_t executionWidth = 1;
+  };
+
+  // Lightweight handle to a kernel resolved by ComputeEngine::GetKernel(). 
+  // Calling through a handle skips the by-name lookup of the kernel:
+  //
+  //   Kernel swap = engine.GetKernel("swap");
+  //   for (...) {
+  //     engine.NewBatch().WithGrid(1, kSize, 1, kSize).Call(swap, inout(f1), inout(f2))
+  //         .Dispatch().Wait();
+  //   }
+  //
+  // Handles are valid for as long as the engine that created them.
+  class Kernel {
+    public:
+      Kernel();
+      Kernel(const KernelInfo * info);
+
+      const std::string& Name() const;
+      std::size_t MaxThreadsPerWorkGroup() const;
+      std::size_t ExecutionWidth() const;
+      const KernelInfo * GetInfo() const;
+
+      explicit operator bool() const;
+    private:
+      const KernelInfo * info;
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_KERNEL
@@ -33,130 +33,195 @@
 #include <Metal/Metal.hpp>
 #include <QuartzCore/QuartzCore.hpp>
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <latch>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "arg_buffers.h"
+#include "artifact_cache.h"
+#include "compute_engine.h"
+#include "staging_ring.h"
+#include "thread_pool.h"
 
 namespace mdl {
 namespace compute {
 
-  class MetalComputeEngine {
-    struct BufferDescriptor {
-      MTL::Buffer* mtlBuffer;
-      void * appBuffer;
-      size_t size;
+  class MetalComputeEngine : public ComputeEngine {
+    // Part of a HostRegion written by an argument.
+    struct HostRange {
+      std::size_t offset;
+      std::size_t size;
       BufferType bufferType;
     };
 
-    struct Batch {
-      NS::AutoreleasePool* autoReleasePool;
-      MetalComputeEngine * engine;
-      MTL::CommandBuffer * commandBuffer;
-      MTL::ComputeCommandEncoder * encoder;
-
-      std::unordered_map<std::size_t, BufferDescriptor> buffers;
-
-      int argIndex = 0;
-      std::size_t numRows = 0;
-      std::size_t numCols = 0; 
-      std::size_t workGroupRows = 0;
-      std::size_t workGroupCols = 0;
-
-      Batch(MetalComputeEngine * engine, bool parallel);
-      ~Batch();
-
-      template <class Buff>
-      void AddBuffer(const Buff& buff) {
-        if (!buffers.contains(buff.id)) {
-          buffers[buff.id] = BufferDescriptor {
-            .mtlBuffer = engine->GetBuffer(buff),
-            .appBuffer = buff.data,
-            .size = buff.size,
-            .bufferType = buff.GetType()
-          };
-        }
-        encoder->setBuffer(buffers[buff.id].mtlBuffer, 0, argIndex);
-        argIndex++;
-      }
+    // Application memory bound by the arguments of a batch. Arguments whose
+    // ranges overlap or touch share one region, and so one device buffer 
+    // that is uploaded and copied back once.
+    struct HostRegion {
+      std::byte * data;
+      std::size_t size;
+      MTL::Buffer * mtlBuffer;
+      // where the region starts in mtlBuffer
+      std::size_t offset;
+      // set when mtlBuffer is the engine's staging ring, or a pooled buffer
+      StagingRing::Range staged;
+      BufferPool::Block block;
+      // mtlBuffer wraps the application's memory: nothing to copy, and it 
+      // isn't pooled
+      bool wrapped;
+      // whether any argument reads the region, and the first one's type
+      bool upload;
+      BufferType uploadType;
+      // ranges written by arguments, copied back on completion
+      std::vector<HostRange> writes;
     };
 
-    public:
-      class BatchBuilder;
-
-      class Gate {
-        public:
-          void Wait() const;
-        private:
-          std::shared_ptr<Batch> batch;
-          friend class MetalComputeEngine::BatchBuilder;
-
-          Gate(const std::shared_ptr<Batch>& batch);
-      };
-
-      class CallBuilder {
-        public:
-          template <class... Args>
-          BatchBuilder Call(const std::string& fn, Args&&... args);
+    // A call, encoded on submission once all the memory the batch binds is
+    // known.
+    struct MetalCommand {
+      MTL::ComputePipelineState * pipeline;
+      Grid grid;
+      std::vector<Argument> args;
+      std::vector<std::byte> inlineArgs;
+      // per argument, the HostRegion it's bound to (application memory only)
+      std::vector<std::size_t> regions;
+    };
 
-        private:
-          std::shared_ptr<Batch> batch;
-          friend class MetalComputeEngine::BatchBuilder;
+    struct MetalBufferAllocator : public BufferAllocator {
+      MTL::Device * device;
 
-          CallBuilder(const std::shared_ptr<Batch>& batch);
-          CallBuilder(std::shared_ptr<Batch>&& batch);
+      void * Allocate(std::size_t capacity, std::uint32_t storageMode) override;
+      void Free(void * handle, std::size_t capacity, std::uint32_t storageMode) override;
+    };
 
-          template <class T, class... Args>
-          BatchBuilder DoCall(const T& arg1, Args&&... args);
+    struct MetalResidentStorage : public ResidentStorage {
+      MTL::Buffer * mtlBuffer;
+      // for the blits synchronizing the buffer back on Download()
+      MTL::CommandQueue * commandQueue;
 
-          template <class T>
-          BatchBuilder DoCall(const T& arg);
+      MetalResidentStorage(MTL::Device * device, MTL::CommandQueue * commandQueue, std::size_t size);
+      ~MetalResidentStorage();
 
-          template <class T>
-          void AddBuffer(const T& value);
-      };
+      void Update(const void * data, std::size_t size, std::size_t offset) override;
+      void Download(void * data, std::size_t size, std::size_t offset) const override;
+    };
 
-      class BatchBuilder {
-        public:
-          CallBuilder WithGrid(
-              std::size_t numRows, std::size_t numCols, 
-              std::size_t workGroupRows, std::size_t workGroupCols);
-          Gate Dispatch();
-        private:
-          std::shared_ptr<Batch> batch;
-
-          BatchBuilder(const std::shared_ptr<Batch>& batch);
-          BatchBuilder(std::shared_ptr<Batch>&& batch);
-          friend class MetalComputeEngine;
-      };
+    struct MetalBatch : public Batch {
+      // created by Submit()
+      MTL::CommandBuffer * commandBuffer;
+      MTL::ComputeCommandEncoder * encoder;
+      // signaled once the batch has run, for batches ordered after it on the
+      // device. Only batches using resident buffers can have any, and only 
+      // those get one, as they are submitted.
+      MTL::SharedEvent * event;
+
+      std::vector<MetalCommand> commands;
+      std::vector<HostRegion> regions;
+      // private buffers, by id
+      std::unordered_map<std::size_t, BufferPool::Block> buffers;
+
+      MetalBatch(MetalComputeEngine * engine, bool parallel);
+      ~MetalBatch();
+
+      void Encode(const KernelInfo& kernel) override;
+      void Submit() override;
+      void Absorb(Batch& other) override;
+
+      // Groups the application memory bound by all commands into regions and
+      // allocates their device buffers, and the batch's private buffers. 
+      // Throws std::bad_alloc if the buffer pool can't allocate them.
+      void MapRegions();
+      // Copies application memory into the regions that read it. Large 
+      // regions are copied in chunks on the engine's copy threads, which count
+      // down "fence" as they finish each of the NumUploadChunks() chunks.
+      std::size_t NumUploadChunks() const;
+      void StartUploads(std::latch& fence);
+      void EncodeCommands();
+      // Copies results back to the application and completes the batch. Runs
+      // on a Metal thread once the command buffer completes.
+      void Finish();
+      void ReleaseBuffers();
+      // This batch, or the batches it runs the calls of when coalesced.
+      std::vector<MetalBatch *> Submitted();
+    };
 
+    public:
       MetalComputeEngine();
+      // Saves pipelines compiled since the last save to the artifact cache,
+      // if any.
       virtual ~MetalComputeEngine();
 
-      bool Available() const;
-      BatchBuilder NewBatch(bool parallel = false);
-      void LoadLibrary(const std::string& sourceCode);
-      bool ContainsFunction(const std::string& functionName) const;
+      const char * Backend() const override;
+      bool Available() const override;
+      // Libraries are deduplicated by source hash: loading the same source
+      // again is a no-op.
+      void LoadLibrary(const std::string& sourceCode) override;
+      bool ContainsFunction(const std::string& functionName) const override;
+      BufferPool& GetBufferPool() override;
+      // Also saves newly compiled pipelines to the artifact cache, if any. 
+      // Pipelines compiled lazily, on first use, are only saved by this or
+      // by the destructor.
+      void PrecompileAll() override;
+    protected:
+      std::shared_ptr<Batch> CreateBatch(bool parallel) override;
+      std::shared_ptr<ResidentStorage> CreateResidentStorage(std::size_t size) override;
+      void LoadKernel(KernelInfo& kernel) override;
+      std::vector<std::string> FunctionNames() const override;
+      // Batches that conflict through resident buffers are ordered with 
+      // shared events rather than by waiting for each other to complete.
+      bool OrdersOnDevice() const override;
     private:
+      // batches are spread over a few queues so that threads submitting 
+      // concurrently don't all serialize on one
+      static constexpr std::size_t kNumCommandQueues = 4;
+      // regions of up to kMaxStagedSize bytes are staged in a ring shared by
+      // all batches, larger ones get a buffer of their own
+      static constexpr std::size_t kStagingRingSize = 64 * 1024 * 1024;
+      static constexpr std::size_t kMaxStagedSize = 1024 * 1024;
+      // uploads are split in chunks of this size, copied in parallel while
+      // the batch is encoded. Results are copied back in parallel too (see 
+      // ParallelCopy()).
+      static constexpr std::size_t kCopyChunkSize = 1024 * 1024;
+      static constexpr std::size_t kNumCopyThreads = 4;
+
       MTL::Device* device;
-      MTL::CommandQueue* commandQueue;
-      std::list<MTL::Library*> libraries;
-      std::unordered_map<std::string, MTL::Library*> libraryByFn;
+      std::vector<MTL::CommandQueue*> commandQueues;
+      std::atomic_size_t nextCommandQueue = 0;
+      struct LoadedLibrary {
+        MTL::Library * library;
+        ArtifactKey key;
+        // pipelines compiled from the library, when there's an artifact cache
+        MTL::BinaryArchive * archive;
+        bool archiveModified;
+      };
+
+      // libraries and pipelines are only touched when loading a library or 
+      // resolving a kernel for the first time: lookups go through the base
+      // class' lock-free kernel cache
+      mutable std::mutex libraryMutex;
+      std::list<LoadedLibrary> libraries;
+      std::unordered_map<std::uint64_t, LoadedLibrary *> librariesByHash;
+      std::unordered_map<std::string, LoadedLibrary *> libraryByFn;
       std::unordered_map<std::string, MTL::ComputePipelineState*> pipelinesByFn;
-      std::unordered_map<std::size_t, MTL::Buffer *> buffersById;
+      MetalBufferAllocator allocator;
+      BufferPool bufferPool;
+      StagingRing stagingRing;
+      ThreadPool copyPool;
 
       template <class Ref>
       void Release(Ref*& referencing);
 
+      MTL::CommandQueue * NextCommandQueue();
+      MTL::BinaryArchive * OpenArchive(const ArtifactKey& key);
+      void SaveArchives();
       MTL::ComputePipelineState* GetPipeline(const std::string& functionName);
-      MTL::Buffer * GetBuffer(const in_buffer& buffer);
-      MTL::Buffer * GetBuffer(const inout_buffer& buffer);
-      MTL::Buffer * GetBuffer(const out_buffer& buffer);
-      MTL::Buffer * GetBuffer(const private_buffer& buffer);
-      MTL::Buffer * GetBuffer(const shared_buffer& buffer);
-      void ReleaseBuffer(std::size_t bufferId);
   };
 
   template <class Ref>
@@ -166,46 +231,8 @@ namespace compute {
       referencing = nullptr;
     }
   }
-
-  template <class... Args>
-  MetalComputeEngine::BatchBuilder MetalComputeEngine::CallBuilder::Call(
-      const std::string& fn, Args&&... args) {
-    batch->encoder->setComputePipelineState(batch->engine->GetPipeline(fn));
-    return DoCall(std::forward<Args>(args)...);
-  }
-
-  template <class T, class... Args>
-  MetalComputeEngine::BatchBuilder  MetalComputeEngine::CallBuilder::DoCall(const T& arg1, Args&&... args) {
-    AddBuffer(arg1);
-    return DoCall(std::forward<Args>(args)...);
-  }
-
-  template <class T>
-  MetalComputeEngine::BatchBuilder MetalComputeEngine::CallBuilder::DoCall(const T& arg) {
-    AddBuffer(arg);
-    MTL::Size threadGroupSize(batch->workGroupCols, batch->workGroupRows, 1);
-    MTL::Size gridSize(batch->numCols, batch->numRows, 1);
-    batch->encoder->dispatchThreads(gridSize, threadGroupSize);
-    return BatchBuilder(batch);
-  }
-
-  template <class T>
-  void MetalComputeEngine::CallBuilder::AddBuffer(const T& value) {
-    AddBuffer(in(value));
-  }
-
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<in_buffer>(const in_buffer& value);
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<inout_buffer>(const inout_buffer& value);
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<out_buffer>(const out_buffer& value);
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<private_buffer>(const private_buffer& value);
-  template <>
-  void MetalComputeEngine::CallBuilder::AddBuffer<shared_buffer>(const shared_buffer& value);
 } // comput
 } // mdl
 
 
-#endif  // _MDL_METAL_COMPUTE_ENGINE
\ No newline at end of file
+#endif  // _MDL_METAL_COMPUTE_ENGINE
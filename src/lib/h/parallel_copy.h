@@ -0,0 +1,58 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_PARALLEL_COPY
+#define _MDL_COMPUTE_PARALLEL_COPY
+
+#include <cstddef>
+
+#include "thread_pool.h"
+
+namespace mdl {
+namespace compute {
+
+  // Copies below this size are done by the calling thread alone.
+  constexpr std::size_t kParallelCopyThreshold = 4 * 1024 * 1024;
+  // Copies of at least this size use non-temporal stores, which bypass the
+  // caches: the destination wouldn't fit in them anyway, and it spares the
+  // data the caller is working on.
+  constexpr std::size_t kStreamingCopyThreshold = 8 * 1024 * 1024;
+
+  // memcpy() with non-temporal stores where the platform has them (x86), 
+  // plain memcpy() elsewhere.
+  void StreamingCopy(void * dst, const void * src, std::size_t size);
+
+  // Copies "size" bytes from "src" to "dst", splitting large copies in 
+  // cache-line-aligned chunks (of the destination) spread over "pool" and
+  // the calling thread. Returns once the whole copy is done; must not be 
+  // called from one of "pool"'s threads.
+  void ParallelCopy(void * dst, const void * src, std::size_t size, ThreadPool& pool);
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_PARALLEL_COPY
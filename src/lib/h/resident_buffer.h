@@ -0,0 +1,94 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_RESIDENT_BUFFER
+#define _MDL_COMPUTE_RESIDENT_BUFFER
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "arg_buffers.h"
+
+namespace mdl {
+namespace compute {
+
+  // Backend memory behind a ResidentBuffer.
+  class ResidentStorage {
+    public:
+      ResidentStorage(std::size_t size);
+      virtual ~ResidentStorage();
+
+      std::uint64_t Id() const;
+      std::size_t Size() const;
+
+      virtual void Update(const void * data, std::size_t size, std::size_t offset) = 0;
+      virtual void Download(void * data, std::size_t size, std::size_t offset) const = 0;
+    private:
+      std::uint64_t id;
+      std::size_t size;
+  };
+
+  // A device buffer owned by the application rather than by a batch: it can be
+  // bound (as an "inout" argument) to any number of batches and its contents
+  // survive between them, so data such as model weights or lookup tables is 
+  // only uploaded once. Created by ComputeEngine::NewResidentBuffer(). 
+  //
+  // Update() and Download() must not be called while a batch using the buffer
+  // is in flight.
+  class ResidentBuffer {
+    public:
+      ResidentBuffer();
+      ResidentBuffer(const std::shared_ptr<ResidentStorage>& storage);
+
+      std::uint64_t Id() const;
+      std::size_t Size() const;
+
+      // Throws RuntimeException if the range falls outside the buffer.
+      void Update(const void * data, std::size_t size, std::size_t offset = 0);
+      void Download(void * data, std::size_t size, std::size_t offset = 0) const;
+
+      template <class T>
+      void Update(const T& value, std::size_t offset = 0) {
+        Update(addressfn<T>{}(value), sizefn<T>{}(value), offset);
+      }
+
+      template <class T>
+      void Download(T& value, std::size_t offset = 0) const {
+        Download(addressfn<T>{}(value), sizefn<T>{}(value), offset);
+      }
+
+      ResidentStorage * GetStorage() const;
+      const std::shared_ptr<ResidentStorage>& GetSharedStorage() const;
+    private:
+      std::shared_ptr<ResidentStorage> storage;
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_RESIDENT_BUFFER
@@ -0,0 +1,97 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_STAGING_RING
+#define _MDL_COMPUTE_STAGING_RING
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+#include "buffer_pool.h"
+
+namespace mdl {
+namespace compute {
+
+  // A single large buffer that batches stage their uploads in, carved into 
+  // consecutive ranges in allocation order. Ranges are released as batches
+  // complete, in any order; space is reclaimed from the oldest range on, so
+  // a long-running batch holds back reuse of everything allocated after it.
+  // Allocations that don't fit fail, and callers fall back to a BufferPool.
+  class StagingRing {
+    public:
+      struct Range {
+        // backend handle of the ring's buffer, null if allocation failed
+        void * handle;
+        std::size_t offset;
+        std::size_t size;
+      };
+
+      // Ranges start at multiples of this, which satisfies the offset
+      // alignment backends require when binding a buffer.
+      static constexpr std::size_t kAlignment = 256;
+
+      // The buffer is allocated on first use.
+      StagingRing(BufferAllocator * allocator, std::size_t capacity, std::uint32_t storageMode);
+      ~StagingRing();
+
+      StagingRing(const StagingRing& other) = delete;
+      StagingRing& operator=(const StagingRing& other) = delete;
+
+      // Returns a range of at least "size" bytes, or one with a null handle
+      // if there isn't enough contiguous free space or the ring's buffer
+      // can't be allocated.
+      Range Allocate(std::size_t size);
+      void Release(const Range& range);
+      // Frees the ring's buffer if no range is in use. It's allocated again 
+      // on next use.
+      void Trim();
+
+      std::size_t GetCapacity() const;
+      std::size_t GetBytesInUse() const;
+    private:
+      struct Span {
+        std::size_t begin;
+        std::size_t end;
+        bool released;
+      };
+
+      BufferAllocator * allocator;
+      std::size_t capacity;
+      std::uint32_t storageMode;
+      void * handle = nullptr;
+      // live spans, oldest first
+      std::deque<Span> spans;
+      std::size_t bytesInUse = 0;
+      mutable std::mutex mutex;
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_STAGING_RING
@@ -0,0 +1,93 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_THREAD_POOL
+#define _MDL_COMPUTE_THREAD_POOL
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+
+  // Work-stealing thread pool. Each worker owns a deque of tasks: tasks 
+  // submitted from a worker thread are pushed to (and popped from) the back
+  // of that worker's own deque, while idle workers steal from the front of
+  // the other deques. Tasks submitted from outside the pool are distributed
+  // round-robin.
+  class ThreadPool {
+    public:
+      typedef std::function<void()> Task;
+
+      // numThreads == 0 means one thread per hardware core.
+      explicit ThreadPool(std::size_t numThreads = 0);
+      ~ThreadPool();
+
+      ThreadPool(const ThreadPool& other) = delete;
+      ThreadPool& operator=(const ThreadPool& other) = delete;
+
+      void Submit(Task&& task);
+      std::size_t Size() const;
+    private:
+      struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+      };
+
+      std::vector<std::unique_ptr<Worker>> workers;
+      std::vector<std::thread> threads;
+      std::atomic_size_t pending;
+      std::atomic_size_t nextWorker;
+      // workers about to sleep or sleeping: submissions only wake them up 
+      // (and take "sleepMutex") while there are any
+      std::atomic_size_t sleepers;
+      std::atomic_bool stopping;
+      std::mutex sleepMutex;
+      std::condition_variable wakeUp;
+      // wake-ups so far, so that sleepers only sleep until the next one
+      std::uint64_t wakeUps;
+
+      void Run(std::size_t index);
+      void RunTask(Task& task);
+      bool TryPop(std::size_t index, Task& task);
+      // Skips deques whose lock is taken, unless "blocking".
+      bool TrySteal(std::size_t index, Task& task, bool blocking);
+  };
+
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_THREAD_POOL
@@ -0,0 +1,90 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _MDL_COMPUTE_WORK_GROUP_TUNER
+#define _MDL_COMPUTE_WORK_GROUP_TUNER
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+
+namespace mdl {
+namespace compute {
+
+  struct WorkGroupShape {
+    std::size_t rows;
+    std::size_t cols;
+  };
+
+  // Grids of similar sizes (by powers of two) share their tuned shape.
+  struct WorkGroupKey {
+    std::string backend;
+    std::string kernel;
+    int rowsBucket;
+    int colsBucket;
+
+    WorkGroupKey(const std::string& backend, const std::string& kernel, 
+        std::size_t numRows, std::size_t numCols);
+
+    std::string ToString() const;
+  };
+
+  // Work-group shapes found by ComputeEngine::Autotune(), kept in a text file
+  // so that later runs reuse them without tuning again. Shared by any number
+  // of engines and threads.
+  class WorkGroupTuner {
+    public:
+      // Loads shapes tuned on earlier runs from "path", if it exists. An 
+      // empty path keeps shapes in memory only.
+      explicit WorkGroupTuner(const std::string& path = "");
+
+      // Returns false if "key" wasn't tuned.
+      bool Find(const WorkGroupKey& key, WorkGroupShape& shape) const;
+      // Records the shape tuned for "key" and rewrites the file. Throws 
+      // RuntimeException if the backend or kernel name is empty or contains
+      // whitespace, which the file can't hold, or if the file can't be 
+      // written.
+      void Store(const WorkGroupKey& key, const WorkGroupShape& shape);
+      std::size_t Size() const;
+    private:
+      std::string path;
+      mutable std::shared_mutex mutex;
+      std::map<std::string, WorkGroupShape> shapes;
+      // incremented by every Store(), under "mutex"
+      std::uint64_t version = 0;
+      // serializes writing the file, and the version it has, under "saveMutex"
+      std::mutex saveMutex;
+      std::uint64_t savedVersion = 0;
+  };
+} // compute
+} // mdl
+
+#endif // _MDL_COMPUTE_WORK_GROUP_TUNER
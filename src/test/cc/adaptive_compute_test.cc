@@ -0,0 +1,156 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <string>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  // "fill" stores a value that tells which of the two engines ran it.
+  void RegisterFill(CpuComputeEngine& engine, float value) {
+    engine.RegisterKernel("fill", PerThread(
+        [value](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(0)[col] = value + *args.Get<const float>(1);
+        }));
+  }
+
+  TEST(AdaptiveComputeTestSuite, TestSmallBatchesStayOnCpu) {
+    CpuComputeEngine cpu;
+    CpuComputeEngine device;
+    RegisterFill(cpu, 1.0f);
+    RegisterFill(device, 2.0f);
+    AdaptiveComputeEngine engine(cpu, device, AdaptiveCostModel {
+      .explorationInterval = 0
+    });
+    engine.EnableInstrumentation();
+
+    const int kSize = 16;
+    float f[kSize];
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("fill", out(f), 10.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(11.0f, f[i]);
+    }
+    ASSERT_EQ(1, engine.CpuBatches());
+    ASSERT_EQ(0, engine.DeviceBatches());
+    EngineStats stats = engine.GetStats();
+    ASSERT_EQ(1, stats.batches);
+    ASSERT_EQ(1, stats.calls);
+  }
+
+  TEST(AdaptiveComputeTestSuite, TestLargeBatchesOffload) {
+    CpuComputeEngine cpu;
+    CpuComputeEngine device;
+    RegisterFill(cpu, 1.0f);
+    RegisterFill(device, 2.0f);
+    AdaptiveComputeEngine engine(cpu, device, AdaptiveCostModel {
+      .deviceLaunchOverhead = 0,
+      .cpuTimePerThread = 1.0,
+      .explorationInterval = 0
+    });
+
+    const int kSize = 1024;
+    std::vector<float> f(kSize);
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, 64).Call("fill", out(f), 10.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(12.0f, f[i]);
+    }
+    ASSERT_EQ(0, engine.CpuBatches());
+    ASSERT_EQ(1, engine.DeviceBatches());
+  }
+
+  TEST(AdaptiveComputeTestSuite, TestKernelOnOneEngine) {
+    CpuComputeEngine cpu;
+    CpuComputeEngine device;
+    RegisterFill(device, 2.0f);
+    AdaptiveComputeEngine engine(cpu, device);
+
+    ASSERT_TRUE(engine.ContainsFunction("fill"));
+    ASSERT_FALSE(engine.ContainsFunction("bogus"));
+    ASSERT_THROW(engine.GetKernel("bogus"), FunctionNotFoundException);
+
+    // cheaper on the CPU, but only the device has it
+    const int kSize = 4;
+    float f[kSize];
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("fill", out(f), 0.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, f[i]);
+    }
+    ASSERT_EQ(0, engine.CpuBatches());
+    ASSERT_EQ(1, engine.DeviceBatches());
+  }
+
+  TEST(AdaptiveComputeTestSuite, TestExploration) {
+    CpuComputeEngine cpu;
+    CpuComputeEngine device;
+    RegisterFill(cpu, 1.0f);
+    RegisterFill(device, 2.0f);
+    AdaptiveComputeEngine engine(cpu, device, AdaptiveCostModel {
+      .explorationInterval = 2
+    });
+
+    const int kSize = 4;
+    float f1[kSize];
+    float f2[kSize];
+    Kernel fill = engine.GetKernel("fill");
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call(fill, out(f1), 0.0f)
+        .Dispatch().Wait();
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call(fill, out(f2), 0.0f)
+        .Dispatch().Wait();
+
+    ASSERT_FLOAT_EQ(1.0f, f1[0]);
+    ASSERT_FLOAT_EQ(2.0f, f2[0]);
+    ASSERT_EQ(1, engine.CpuBatches());
+    ASSERT_EQ(1, engine.DeviceBatches());
+  }
+
+  TEST(AdaptiveComputeTestSuite, TestResidentBuffers) {
+    CpuComputeEngine cpu;
+    CpuComputeEngine device;
+    AdaptiveComputeEngine engine(cpu, device);
+
+    ASSERT_THROW(engine.NewResidentBuffer(16), RuntimeException);
+  }
+} // compute_test
+} // compute
+} // mdl
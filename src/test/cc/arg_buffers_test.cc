@@ -144,6 +144,43 @@ namespace compute_test {
     ASSERT_EQ(a.size() * sizeof(std::uint16_t), buff.size);
   }
 
+  TEST(ArgBuffersTetSuite, TestRange) {
+    std::vector<int> v = {10, 20, 30, 40};
+
+    out_buffer buff = out(v);
+    out_buffer view = buff.range(sizeof(int), 2 * sizeof(int));
+    ASSERT_EQ(v.data() + 1, view.data);
+    ASSERT_EQ(2 * sizeof(int), view.size);
+    ASSERT_NE(buff.id, view.id);
+
+    in_buffer inView = in(v).range(3 * sizeof(int), sizeof(int));
+    ASSERT_EQ(v.data() + 3, inView.data);
+    ASSERT_EQ(sizeof(int), inView.size);
+
+    ASSERT_EQ(0, buff.range(buff.size, 0).size);
+  }
+
+  TEST(ArgBuffersTetSuite, TestRange_OutOfBounds) {
+    std::vector<int> v = {10, 20, 30, 40};
+
+    ASSERT_THROW(out(v).range(0, 5 * sizeof(int)), RuntimeException);
+    ASSERT_THROW(out(v).range(3 * sizeof(int), 2 * sizeof(int)), RuntimeException);
+    ASSERT_THROW(out(v).range(5 * sizeof(int), 0), RuntimeException);
+  }
+
+  template <class B>
+  concept HasRange = requires(B b) { b.range(0, 1); };
+
+  TEST(ArgBuffersTetSuite, TestRange_HostBuffersOnly) {
+    static_assert(HasRange<in_buffer>);
+    static_assert(HasRange<out_buffer>);
+    static_assert(HasRange<inout_buffer>);
+    static_assert(HasRange<shared_buffer>);
+    static_assert(!HasRange<private_buffer>);
+    static_assert(!HasRange<local_buffer>);
+    static_assert(!HasRange<buffer<BufferType::Inline>>);
+  }
+
 } // compute_test
 } // compute
 } // mdl
\ No newline at end of file
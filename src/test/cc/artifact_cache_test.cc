@@ -0,0 +1,98 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl; 
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  std::vector<std::byte> ToBytes(const std::string& value) {
+    std::vector<std::byte> bytes;
+    for (auto it = value.begin(); it != value.end(); it++) {
+      bytes.push_back(static_cast<std::byte>(*it));
+    }
+    return bytes;
+  }
+
+  TEST(ArtifactCacheTestSuite, TestHashSource) {
+    // FNV-1a reference values: must never change, or artifacts cached by 
+    // earlier versions are silently orphaned
+    ASSERT_EQ(0xcbf29ce484222325ull, HashSource(""));
+    ASSERT_EQ(0xaf63dc4c8601ec8cull, HashSource("a"));
+    ASSERT_NE(HashSource("kernel void a() {}"), HashSource("kernel void b() {}"));
+  }
+
+  TEST(ArtifactCacheTestSuite, TestArtifactKey) {
+    ArtifactKey key { .sourceHash = 0x1234, .backend = "metal", .options = "Apple M1" };
+    std::string name = key.ToString();
+    ASSERT_EQ(0, name.rfind("metal-0000000000001234-", 0));
+    ASSERT_EQ(std::string::npos, name.find(' '));
+
+    ArtifactKey other = key;
+    other.options = "Apple M2";
+    ASSERT_NE(name, other.ToString());
+  }
+
+  TEST(ArtifactCacheTestSuite, TestDiskArtifactCache) {
+    std::filesystem::path directory = 
+        std::filesystem::temp_directory_path() / "mdlcompute_artifact_cache_test";
+    std::filesystem::remove_all(directory);
+
+    DiskArtifactCache cache(directory.string());
+    ArtifactKey key { .sourceHash = HashSource("source"), .backend = "cpu", .options = "" };
+    std::vector<std::byte> data;
+    ASSERT_FALSE(cache.Load(key, data));
+
+    cache.Store(key, ToBytes("artifact"));
+    ASSERT_TRUE(cache.Load(key, data));
+    ASSERT_EQ(ToBytes("artifact"), data);
+
+    // overwrites
+    cache.Store(key, ToBytes("newer artifact"));
+    ASSERT_TRUE(cache.Load(key, data));
+    ASSERT_EQ(ToBytes("newer artifact"), data);
+
+    // survives the cache object, no temporary files left behind
+    ASSERT_TRUE(DiskArtifactCache(directory.string()).Load(key, data));
+    ASSERT_EQ(1, std::distance(
+        std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator()));
+
+    std::filesystem::remove_all(directory);
+  }
+} // compute_test
+} // compute
+} // mdl
@@ -0,0 +1,171 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using std::cout;
+using std::endl; 
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  class CountingAllocator : public BufferAllocator {
+    public:
+      int allocations = 0;
+      int frees = 0;
+
+      void * Allocate(std::size_t capacity, std::uint32_t storageMode) override {
+        allocations++;
+        return std::malloc(capacity);
+      }
+
+      void Free(void * handle, std::size_t capacity, std::uint32_t storageMode) override {
+        frees++;
+        std::free(handle);
+      }
+  };
+
+  TEST(BufferPoolTestSuite, TestSizeClass) {
+    ASSERT_EQ(8, BufferPool::SizeClass(1));
+    ASSERT_EQ(8, BufferPool::SizeClass(256));
+    ASSERT_EQ(9, BufferPool::SizeClass(257));
+    ASSERT_EQ(20, BufferPool::SizeClass(1024 * 1024));
+  }
+
+  TEST(BufferPoolTestSuite, TestAcquireRelease) {
+    CountingAllocator allocator;
+    BufferPool pool(&allocator);
+
+    BufferPool::Block b1 = pool.Acquire(1000, 0);
+    ASSERT_EQ(1024, b1.capacity);
+    ASSERT_EQ(1, allocator.allocations);
+    ASSERT_EQ(1024, pool.GetStats().bytesInUse);
+
+    pool.Release(b1);
+    ASSERT_EQ(0, pool.GetStats().bytesInUse);
+    ASSERT_EQ(1024, pool.GetStats().bytesRetained);
+
+    // same size class, same storage mode: reused
+    BufferPool::Block b2 = pool.Acquire(600, 0);
+    ASSERT_EQ(b1.handle, b2.handle);
+    ASSERT_EQ(1, allocator.allocations);
+
+    // different storage mode: not reused
+    pool.Release(b2);
+    BufferPool::Block b3 = pool.Acquire(1000, 1);
+    ASSERT_EQ(2, allocator.allocations);
+    pool.Release(b3);
+
+    BufferPoolStats stats = pool.GetStats();
+    ASSERT_EQ(1, stats.hits);
+    ASSERT_EQ(2, stats.misses);
+    ASSERT_EQ(2048, stats.bytesRetained);
+    ASSERT_EQ(0, stats.bytesInUse);
+  }
+
+  TEST(BufferPoolTestSuite, TestHighWaterMark) {
+    CountingAllocator allocator;
+    {
+      BufferPool pool(&allocator, 4096);
+
+      BufferPool::Block big = pool.Acquire(4096, 0);
+      BufferPool::Block small1 = pool.Acquire(1024, 0);
+      BufferPool::Block small2 = pool.Acquire(1024, 0);
+      pool.Release(small1);
+      pool.Release(small2);
+      ASSERT_EQ(0, allocator.frees);
+
+      // over the mark: the largest buffer goes first
+      pool.Release(big);
+      ASSERT_EQ(1, allocator.frees);
+      ASSERT_EQ(2048, pool.GetStats().bytesRetained);
+      ASSERT_EQ(1, pool.GetStats().evictions);
+
+      pool.Trim(1024);
+      ASSERT_EQ(2, allocator.frees);
+      ASSERT_EQ(1024, pool.GetStats().bytesRetained);
+
+      pool.SetHighWaterMark(0);
+      ASSERT_EQ(3, allocator.frees);
+      ASSERT_EQ(0, pool.GetStats().bytesRetained);
+
+      pool.Release(pool.Acquire(10, 0));
+      ASSERT_EQ(4, allocator.frees);
+    }
+    ASSERT_EQ(allocator.allocations, allocator.frees);
+  }
+
+  class FailingAllocator : public CountingAllocator {
+    public:
+      void * Allocate(std::size_t capacity, std::uint32_t storageMode) override {
+        allocations++;
+        return nullptr;
+      }
+  };
+
+  TEST(BufferPoolTestSuite, TestAcquire_AllocationFails) {
+    FailingAllocator allocator;
+    BufferPool pool(&allocator);
+
+    ASSERT_THROW(pool.Acquire(1000, 0), std::bad_alloc);
+    ASSERT_EQ(1, allocator.allocations);
+    ASSERT_EQ(0, pool.GetStats().bytesInUse);
+    ASSERT_EQ(0, pool.GetStats().bytesRetained);
+  }
+
+  TEST(BufferPoolTestSuite, TestCpuEngine) {
+    CpuComputeEngine engine;
+    engine.RegisterKernel("copy", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(1)[col] = args.Get<const float>(0)[col];
+        }));
+
+    float f1[10] = {};
+    float f2[10];
+    for (int i = 0; i < 3; i++) {
+      auto p1 = priv(sizeof(f1));
+      engine.NewBatch()
+          .WithGrid(1, 10, 1, 10).Call("copy", f1, p1)
+          .WithGrid(1, 10, 1, 10).Call("copy", p1, out(f2))
+          .Dispatch().Wait();
+    }
+
+    BufferPoolStats stats = engine.GetBufferPool().GetStats();
+    ASSERT_EQ(1, stats.misses);
+    ASSERT_EQ(2, stats.hits);
+    ASSERT_EQ(0, stats.bytesInUse);
+  }
+} // compute_test
+} // compute
+} // mdl
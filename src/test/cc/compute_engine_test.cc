@@ -0,0 +1,84 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl; 
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  TEST(ComputeEngineTestSuite, TestBackends) {
+    std::vector<std::string> backends = ComputeEngine::Backends();
+    ASSERT_FALSE(backends.empty());
+    // the CPU backend is always compiled in, as the last resort
+    ASSERT_EQ("cpu", backends.back());
+  }
+
+  TEST(ComputeEngineTestSuite, TestCreate) {
+    std::unique_ptr<ComputeEngine> engine = ComputeEngine::Create("cpu");
+    ASSERT_STREQ("cpu", engine->Backend());
+    ASSERT_TRUE(engine->Available());
+
+    engine = ComputeEngine::Create();
+    ASSERT_TRUE(engine->Available());
+    ASSERT_EQ(ComputeEngine::Backends().front(), engine->Backend());
+  }
+
+  TEST(ComputeEngineTestSuite, TestCreate_UnknownBackend) {
+    ASSERT_THROW(ComputeEngine::Create("bogus"), RuntimeException);
+  }
+
+  TEST(ComputeEngineTestSuite, TestCall_ThroughBaseClass) {
+    std::unique_ptr<ComputeEngine> engine = ComputeEngine::Create("cpu");
+    static_cast<CpuComputeEngine *>(engine.get())->RegisterKernel("set", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(0)[col] = *args.Get<const float>(1);
+        }));
+    ASSERT_TRUE(engine->ContainsFunction("set"));
+
+    std::vector<float> v(10);
+    engine->NewBatch()
+        .WithGrid(1, v.size(), 1, v.size()).Call("set", out(v), 3.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < v.size(); i++) {
+      ASSERT_FLOAT_EQ(3.0f, v[i]);
+    }
+  }
+} // compute_test
+} // compute
+} // mdl
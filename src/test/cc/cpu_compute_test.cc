@@ -0,0 +1,1399 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstring>
+#include <cstdint>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cout;
+using std::endl; 
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  void RegisterTestKernels(CpuComputeEngine& engine) {
+    engine.RegisterKernel("swap", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          float * inA = args.Get<float>(0);
+          float * inB = args.Get<float>(1);
+          float tmp = inA[col];
+          inA[col] = inB[col];
+          inB[col] = tmp;
+        }));
+    engine.RegisterKernel("copy", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(1)[col] = args.Get<const float>(0)[col];
+        }));
+    engine.RegisterKernel("set", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(0)[col] = *args.Get<const float>(1);
+        }));
+    engine.RegisterKernel("add_rows", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          std::size_t numCols = *args.Get<const std::size_t>(2);
+          args.Get<float>(1)[row * numCols + col] += args.Get<const float>(0)[row];
+        }));
+  }
+
+  TEST(CpuComputeTestSuite, TestComputeEngineAvailable) {
+    CpuComputeEngine engine;
+    ASSERT_TRUE(engine.Available());
+    ASSERT_TRUE(engine.NumThreads() > 0);
+  }
+
+  TEST(CpuComputeTestSuite, TestRegisterKernel) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+    ASSERT_TRUE(engine.ContainsFunction("swap"));
+    ASSERT_TRUE(engine.ContainsFunction("copy"));
+    ASSERT_FALSE(engine.ContainsFunction("bogus"));
+  }
+
+  TEST(CpuComputeTestSuite, TestLoadLibrary) {
+    CpuComputeEngine engine;
+    ASSERT_THROW(engine.LoadLibrary("kernel void bogus() {}"), CompilationException);
+  }
+
+  TEST(CpuComputeTestSuite, TestGetKernel) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    Kernel swap = engine.GetKernel("swap");
+    ASSERT_TRUE(swap);
+    ASSERT_EQ("swap", swap.Name());
+    ASSERT_TRUE(swap.MaxThreadsPerWorkGroup() > 0);
+    ASSERT_EQ(swap.GetInfo(), engine.GetKernel(std::string("swap")).GetInfo());
+    ASSERT_THROW(engine.GetKernel("bogus"), FunctionNotFoundException);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+      f2[i] = kSize - i - 1;
+    }
+
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call(swap, inout(f1), inout(f2))
+        .WithGrid(1, kSize, 1, kSize).Call(swap, inout(f1), inout(f2))
+        .WithGrid(1, kSize, 1, kSize).Call(swap, inout(f1), inout(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(kSize - i - 1, f1[i]);
+      ASSERT_FLOAT_EQ(i, f2[i]);
+    }
+
+    // handles are bound to the engine that resolved them
+    CpuComputeEngine other;
+    RegisterTestKernels(other);
+    ASSERT_THROW(
+        other.NewBatch().WithGrid(1, kSize, 1, kSize).Call(swap, inout(f1), inout(f2)),
+        FunctionNotFoundException);
+    ASSERT_THROW(
+        other.NewBatch().WithGrid(1, kSize, 1, kSize).Call(Kernel(), inout(f1), inout(f2)),
+        FunctionNotFoundException);
+  }
+
+  TEST(CpuComputeTestSuite, TestGetKernel_ManyKernels) {
+    CpuComputeEngine engine;
+    const int kKernels = 200;
+    for (int i = 0; i < kKernels; i++) {
+      engine.RegisterKernel("kernel" + std::to_string(i), PerThread(
+          [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {}));
+    }
+
+    // lookups race with the kernels being loaded, across table growth
+    std::vector<std::thread> threads;
+    std::vector<std::vector<const KernelInfo *>> found(4);
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&engine, &found, t]() {
+        for (int i = 0; i < kKernels; i++) {
+          found[t].push_back(engine.GetKernel("kernel" + std::to_string((i * 7 + t) % kKernels))
+              .GetInfo());
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    for (int t = 0; t < 4; t++) {
+      for (int i = 0; i < kKernels; i++) {
+        std::string name = "kernel" + std::to_string((i * 7 + t) % kKernels);
+        ASSERT_EQ(name, found[t][i]->name);
+        ASSERT_EQ(found[t][i], engine.GetKernel(name).GetInfo());
+      }
+    }
+    ASSERT_THROW(engine.GetKernel("bogus"), FunctionNotFoundException);
+  }
+
+  TEST(CpuComputeTestSuite, TestPrecompileAll) {
+    CpuComputeEngine engine;
+    engine.PrecompileAll();
+
+    RegisterTestKernels(engine);
+    engine.PrecompileAll();
+    const KernelInfo * swap = engine.GetKernel("swap").GetInfo();
+    engine.PrecompileAll();
+    ASSERT_EQ(swap, engine.GetKernel("swap").GetInfo());
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_InOut) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+      f2[i] = kSize - i - 1;
+    }
+    
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("swap", inout(f1), inout(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(kSize - i - 1, f1[i]);
+      ASSERT_FLOAT_EQ(i, f2[i]);
+    }
+
+    engine.NewBatch()
+        .WithGrid(1, kSize - 1, 1, 4).Call("swap", inout(f1), inout(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize - 1; i++) {
+      ASSERT_FLOAT_EQ(i, f1[i]);
+      ASSERT_FLOAT_EQ(kSize - i - 1, f2[i]);
+    }
+    ASSERT_FLOAT_EQ(9, f2[9]);
+    ASSERT_FLOAT_EQ(kSize - 9- 1, f1[9]);
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_DefaultArgumentType) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 2.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, f1[i]);
+    }
+  }  
+
+  struct Affine {
+    float scale;
+    float offset;
+  };
+
+  TEST(CpuComputeTestSuite, TestCall_LargeValueArguments) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    // too large to be inline, but still copied at Call()
+    const int kSize = 32;
+    struct Values { float v[kSize]; };
+    Values values;
+    for (int i = 0; i < kSize; i++) {
+      values.v[i] = i;
+    }
+    float f1[kSize];
+    float f2[kSize];
+    ComputeEngine::BatchBuilder batch = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", values, out(f1));
+    values.v[0] = -1.0f;
+    batch.Dispatch().Wait();
+
+    // temporaries can be passed
+    ComputeEngine::BatchBuilder other = [&]() {
+      Values temporary = values;
+      return engine.NewBatch().WithGrid(1, kSize, 1, kSize).Call("copy", temporary, out(f2));
+    }();
+    other.Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i, f1[i]);
+      ASSERT_FLOAT_EQ(i ? i : -1.0f, f2[i]);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_InlineArguments) {
+    CpuComputeEngine engine;
+    engine.RegisterKernel("affine", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          const Affine& affine = *args.Get<const Affine>(1);
+          std::int8_t sign = *args.Get<const std::int8_t>(2);
+          double bias = *args.Get<const double>(3);
+          args.Get<float>(0)[col] = sign * (affine.scale * col + affine.offset) + bias;
+        }));
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+
+    std::size_t firstId = idSeq;
+    std::int8_t sign = -1;
+    auto builder = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("affine", out(f1), Affine{2.0f, 1.0f}, sign, 0.5)
+        .WithGrid(1, kSize, 1, kSize).Call("affine", out(f2), Affine{1.0f, 0.0f}, std::int8_t(1), 0.0);
+    // values were captured by the calls
+    sign = 1;
+    builder.Dispatch().Wait();
+
+    // scalars take no buffer ids and no buffers
+    ASSERT_EQ(firstId + 2, idSeq);
+    ASSERT_EQ(0, engine.GetBufferPool().GetStats().misses);
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(-(2.0f * i + 1.0f) + 0.5f, f1[i]);
+      ASSERT_FLOAT_EQ(i, f2[i]);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_Shared) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+      f2[i] = kSize - i - 1;
+    }
+    
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("swap", shared(f1), shared(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(kSize - i - 1, f1[i]);
+      ASSERT_FLOAT_EQ(i, f2[i]);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_PrivateBuffer) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+    }
+    
+    auto p1 = priv(sizeof(f1));
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", f1, p1)    // same as in(f1)
+        .WithGrid(1, kSize, 1, kSize).Call("copy", p1, out(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(f1[i], f2[i]);
+    }
+  }  
+
+  TEST(CpuComputeTestSuite, TestCall_InexistentFn) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+
+    auto p1 = priv(sizeof(f1));
+    ASSERT_THROW(
+        engine.NewBatch()
+          .WithGrid(1, kSize, 1, kSize).Call("copy", f1, p1)    // same as in(f1)
+          .WithGrid(1, kSize, 1, kSize).Call("copyBogus", p1, out(f2))
+          .Dispatch().Wait(), 
+        FunctionNotFoundException);
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_KernelException) {
+    CpuComputeEngine engine;
+    engine.RegisterKernel("fail", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+      throw std::logic_error("kernel failure");
+    });
+
+    float f1[10];
+    ASSERT_THROW(
+        engine.NewBatch().WithGrid(1, 10, 1, 2).Call("fail", out(f1)).Dispatch().Wait(), 
+        std::logic_error);
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_Vector) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    std::vector<float> v1(10);
+    std::vector<float> v2(10);
+    
+    engine.NewBatch()
+        .WithGrid(1, v1.size(), 1, v1.size()).Call("set", out(v1), 11.0f)
+        .WithGrid(1, v2.size(), 1, v2.size()).Call("set", out(v2), 12.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < v1.size(); i++) {
+      ASSERT_FLOAT_EQ(11.0f, v1[i]);
+      ASSERT_FLOAT_EQ(12.0f, v2[i]);
+    }
+
+    std::vector<float>* p1 = &v1;
+    std::vector<float>* p2 = &v2;
+
+    engine.NewBatch()
+        .WithGrid(1, v2.size(), 1, v2.size()).Call("copy", p1, out(p2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < v1.size(); i++) {
+      ASSERT_FLOAT_EQ(11.0f, v1[i]);
+      ASSERT_FLOAT_EQ(11.0f, v2[i]);
+    }
+  }  
+
+  TEST(CpuComputeTestSuite, TestCall_Range) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    std::vector<float> v1(10, 1.0f);
+    
+    engine.NewBatch()
+        .WithGrid(1, 4, 1, 4).Call("set", out(v1).range(3 * sizeof(float), 4 * sizeof(float)), 5.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < v1.size(); i++) {
+      ASSERT_FLOAT_EQ(i >= 3 && i < 7 ? 5.0f : 1.0f, v1[i]);
+    }
+  }  
+
+  TEST(CpuComputeTestSuite, TestCall_AliasedBuffers) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    std::vector<float> v(2 * kSize);
+    std::vector<float> w(2 * kSize);
+    
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(v).range(0, kSize * sizeof(float)), 1.0f)
+        .WithGrid(1, kSize, 1, kSize).Call("set", 
+            out(v).range(kSize * sizeof(float), kSize * sizeof(float)), 2.0f)
+        .WithGrid(1, 2 * kSize, 1, 2 * kSize).Call("copy", in(v), out(w))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < 2 * kSize; i++) {
+      ASSERT_FLOAT_EQ(i < kSize ? 1.0f : 2.0f, v[i]);
+      ASSERT_FLOAT_EQ(i < kSize ? 1.0f : 2.0f, w[i]);
+    }
+  }  
+
+  TEST(CpuComputeTestSuite, TestCall_LargeGrid) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const std::size_t kRows = 100;
+    const std::size_t kCols = 1000;
+    std::vector<float> rows(kRows);
+    std::vector<float> matrix(kRows * kCols, 1.0f);
+    for (std::size_t i = 0; i < kRows; i++) {
+      rows[i] = i;
+    }
+
+    // work-groups don't evenly divide the grid
+    engine.NewBatch()
+        .WithGrid(kRows, kCols, 8, 64).Call("add_rows", in(rows), inout(matrix), kCols)
+        .WithGrid(kRows, kCols, 3, 100).Call("add_rows", in(rows), inout(matrix), kCols)
+        .Dispatch().Wait();
+
+    for (std::size_t row = 0; row < kRows; row++) {
+      for (std::size_t col = 0; col < kCols; col++) {
+        ASSERT_FLOAT_EQ(1.0f + 2 * row, matrix[row * kCols + col]);
+      }
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_ParallelBatch) {
+    CpuComputeEngine engine(4);
+    std::atomic_int count = 0;
+    engine.RegisterKernel("count", [&count](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+      count += (group.rowEnd - group.rowBegin) * (group.colEnd - group.colBegin);
+    });
+
+    int dummy;
+    engine.NewBatch(true)
+        .WithGrid(10, 10, 2, 2).Call("count", in(dummy))
+        .WithGrid(0, 10, 2, 2).Call("count", in(dummy))
+        .WithGrid(5, 7, 2, 2).Call("count", in(dummy))
+        .Dispatch().Wait();
+
+    ASSERT_EQ(135, count);
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_ResidentBuffer) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+    engine.RegisterKernel("increment", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(0)[col] += 1.0f;
+        }));
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+    }
+
+    ResidentBuffer resident = engine.NewResidentBuffer(f1);
+    ASSERT_EQ(sizeof(f1), resident.Size());
+
+    for (int i = 0; i < 3; i++) {
+      engine.NewBatch()
+          .WithGrid(1, kSize, 1, kSize).Call("increment", resident)
+          .Dispatch().Wait();
+    }
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", resident, out(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i, f1[i]);
+      ASSERT_FLOAT_EQ(i + 3, f2[i]);
+    }
+
+    resident.Download(f1);
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i + 3, f1[i]);
+    }
+
+    float value = 100.0f;
+    resident.Update(value, 2 * sizeof(float));
+    resident.Download(&value, sizeof(value), 3 * sizeof(float));
+    ASSERT_FLOAT_EQ(6.0f, value);
+    resident.Download(&value, sizeof(value), 2 * sizeof(float));
+    ASSERT_FLOAT_EQ(100.0f, value);
+
+    ASSERT_THROW(resident.Update(f1, sizeof(f1), sizeof(float)), RuntimeException);
+    ASSERT_THROW(ResidentBuffer().Download(value), RuntimeException);
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_EmptyBatch) {
+    CpuComputeEngine engine;
+    engine.NewBatch().Dispatch().Wait();
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_Then) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    std::promise<float> first;
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 3.0f)
+        .Dispatch().Then([&](std::exception_ptr error) {
+          // results are copied back by the time callbacks run
+          first.set_value(error ? -1.0f : f1[0]);
+        });
+    ASSERT_FLOAT_EQ(3.0f, first.get_future().get());
+
+    // callbacks registered after completion run right away
+    ComputeEngine::Gate gate = engine.NewBatch().Dispatch();
+    gate.Wait();
+    ASSERT_TRUE(gate.Done());
+    bool called = false;
+    gate.Then([&](std::exception_ptr error) { called = !error; });
+    ASSERT_TRUE(called);
+
+    engine.RegisterKernel("fail", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+      throw std::logic_error("kernel failure");
+    });
+    std::promise<std::exception_ptr> failed;
+    engine.NewBatch().WithGrid(1, kSize, 1, 2).Call("fail", out(f1))
+        .Dispatch().Then([&](std::exception_ptr error) { failed.set_value(error); });
+    ASSERT_THROW(std::rethrow_exception(failed.get_future().get()), std::logic_error);
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_ToFuture) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    std::future<void> future = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 5.0f)
+        .Dispatch().ToFuture();
+    future.get();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(5.0f, f1[i]);
+    }
+
+    engine.RegisterKernel("fail", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+      throw std::logic_error("kernel failure");
+    });
+    ASSERT_THROW(
+        engine.NewBatch().WithGrid(1, kSize, 1, 2).Call("fail", out(f1))
+            .Dispatch().ToFuture().get(),
+        std::logic_error);
+  }
+
+  // Bare bones coroutine type: starts eagerly and is never awaited.
+  struct FireAndForget {
+    struct promise_type {
+      FireAndForget get_return_object() { return {}; }
+      std::suspend_never initial_suspend() { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+  };
+
+  FireAndForget SetThenCopy(
+      CpuComputeEngine& engine, std::vector<float>& v1, std::vector<float>& v2,
+      std::promise<bool>& result) {
+    std::size_t size = v1.size();
+    co_await engine.NewBatch()
+        .WithGrid(1, size, 1, size).Call("set", out(v1), 7.0f)
+        .Dispatch();
+    co_await engine.NewBatch()
+        .WithGrid(1, size, 1, size).Call("copy", in(v1), out(v2))
+        .Dispatch();
+
+    try {
+      co_await engine.NewBatch().WithGrid(1, size, 1, 2).Call("fail", out(v1))
+          .Dispatch();
+      result.set_value(false);
+    } catch (const std::logic_error& e) {
+      result.set_value(true);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_CoAwait) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+    engine.RegisterKernel("fail", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+      throw std::logic_error("kernel failure");
+    });
+
+    std::vector<float> v1(10);
+    std::vector<float> v2(10);
+    std::promise<bool> result;
+    SetThenCopy(engine, v1, v2, result);
+
+    ASSERT_TRUE(result.get_future().get());
+    for (std::size_t i = 0; i < v2.size(); i++) {
+      ASSERT_FLOAT_EQ(7.0f, v2[i]);
+    }
+  }
+
+  // Registers "blocked_copy", which copies like "copy" but only once "release"
+  // is set.
+  void RegisterBlockedCopy(CpuComputeEngine& engine, std::shared_future<void> release) {
+    engine.RegisterKernel("blocked_copy", PerThread(
+        [release](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          release.wait();
+          args.Get<float>(1)[col] = args.Get<const float>(0)[col];
+        }));
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_CoAwaitCompleted) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+    std::promise<void> release;
+    RegisterBlockedCopy(engine, release.get_future().share());
+
+    std::vector<float> v1(10);
+    std::vector<float> v2(10);
+    ComputeEngine::Gate gate = engine.NewBatch()
+        .WithGrid(1, 10, 1, 10).Call("blocked_copy", in(v1), out(v2))
+        .Dispatch();
+    ComputeEngine::Gate::Awaiter awaiter = gate.operator co_await();
+    ASSERT_FALSE(awaiter.await_ready());
+
+    // completed between await_ready() and await_suspend(): doesn't suspend
+    release.set_value();
+    gate.Wait();
+    ASSERT_FALSE(awaiter.await_suspend(std::noop_coroutine()));
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_HostMemoryHazards) {
+    CpuComputeEngine engine(4);
+    RegisterTestKernels(engine);
+    std::promise<void> release;
+    RegisterBlockedCopy(engine, release.get_future().share());
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    float f3[kSize];
+    float f4[kSize];
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+    }
+
+    ComputeEngine::Gate writer = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("blocked_copy", in(f1), out(f2))
+        .Dispatch();
+    // reads what "writer" writes, so it's held back
+    ComputeEngine::Gate reader = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", in(f2), out(f3))
+        .Dispatch();
+    // only reads what "writer" reads, so it runs right away
+    ComputeEngine::Gate independent = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", in(f1), out(f4))
+        .Dispatch();
+    independent.Wait();
+    ASSERT_FALSE(writer.Done());
+    ASSERT_FALSE(reader.Done());
+
+    release.set_value();
+    reader.Wait();
+    ASSERT_TRUE(writer.Done());
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i, f3[i]);
+      ASSERT_FLOAT_EQ(i, f4[i]);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_ResidentBufferHazards) {
+    CpuComputeEngine engine(4);
+    RegisterTestKernels(engine);
+    std::promise<void> release;
+    RegisterBlockedCopy(engine, release.get_future().share());
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    float f3[kSize];
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+    }
+    ResidentBuffer resident = engine.NewResidentBuffer(f1);
+
+    // batches that only read a resident buffer don't conflict
+    ComputeEngine::Gate blockedReader = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("blocked_copy", resident, out(f2))
+        .Reads(resident)
+        .Dispatch();
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", resident, out(f3))
+        .Reads(resident)
+        .Dispatch().Wait();
+    ASSERT_FALSE(blockedReader.Done());
+
+    // resident buffers are assumed to be written unless declared otherwise
+    ComputeEngine::Gate writer = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", resident, 5.0f)
+        .Dispatch();
+    ASSERT_FALSE(writer.Done());
+
+    release.set_value();
+    writer.Wait();
+    ASSERT_TRUE(blockedReader.Done());
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i, f2[i]);
+      ASSERT_FLOAT_EQ(i, f3[i]);
+    }
+    resident.Download(f1);
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(5.0f, f1[i]);
+    }
+  }
+
+  // Fails to submit batches while "failing" is set.
+  class FailingSubmitEngine : public CpuComputeEngine {
+    public:
+      bool failing = true;
+    protected:
+      struct FailingBatch : public Batch {
+        FailingBatch(ComputeEngine * engine) : Batch(engine, false) {}
+        void Encode(const KernelInfo& kernel) override {}
+        void Absorb(Batch& other) override {}
+        void Submit() override {
+          if (static_cast<FailingSubmitEngine *>(engine)->failing) {
+            throw RuntimeException("submission failure");
+          }
+          Complete(nullptr);
+        }
+      };
+
+      std::shared_ptr<Batch> CreateBatch(bool parallel) override {
+        return std::make_shared<FailingBatch>(this);
+      }
+  };
+
+  TEST(CpuComputeTestSuite, TestDispatch_SubmitFails) {
+    FailingSubmitEngine engine;
+    RegisterTestKernels(engine);
+    float f1[10];
+
+    ComputeEngine::Gate failed = engine.NewBatch()
+        .WithGrid(1, 10, 1, 2).Call("set", out(f1), 1.0f)
+        .Dispatch();
+    ASSERT_TRUE(failed.Done());
+    ASSERT_THROW(failed.Wait(), RuntimeException);
+
+    // the failed batch was retired: batches touching the same memory run
+    engine.failing = false;
+    engine.NewBatch()
+        .WithGrid(1, 10, 1, 2).Call("set", out(f1), 1.0f)
+        .Dispatch().Wait();
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_DestroyEngineAfterWait) {
+    float f1[10];
+    for (int i = 0; i < 100; i++) {
+      // the engine goes away as soon as Wait() returns, while the thread
+      // that completed the batch may still be running
+      CpuComputeEngine engine(2);
+      RegisterTestKernels(engine);
+      engine.NewBatch()
+          .WithGrid(1, 10, 1, 2).Call("set", out(f1), 1.0f)
+          .Dispatch().Wait();
+    }
+    ASSERT_FLOAT_EQ(1.0f, f1[9]);
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_PrivateBuffersDontConflict) {
+    CpuComputeEngine engine(4);
+    RegisterTestKernels(engine);
+    std::promise<void> release;
+    RegisterBlockedCopy(engine, release.get_future().share());
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+    }
+    private_buffer tmp = priv(sizeof(f1));
+
+    ComputeEngine::Gate blocked = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("blocked_copy", in(f1), tmp)
+        .Dispatch();
+    // same handle, but a buffer of its own: runs right away
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", in(f1), tmp)
+        .WithGrid(1, kSize, 1, kSize).Call("copy", tmp, out(f2))
+        .Dispatch().Wait();
+    ASSERT_FALSE(blocked.Done());
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i, f2[i]);
+    }
+
+    release.set_value();
+    blocked.Wait();
+  }
+
+  TEST(CpuComputeTestSuite, TestDispatch_ConcurrentThreads) {
+    CpuComputeEngine engine(4);
+    RegisterTestKernels(engine);
+    ResidentBuffer resident = engine.NewResidentBuffer(std::vector<float>(10, 2.0f));
+
+    const int kNumThreads = 8;
+    const int kNumBatches = 50;
+    std::atomic_int failures = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kNumThreads; t++) {
+      threads.emplace_back([&, t]() {
+        std::vector<float> v1(10);
+        std::vector<float> v2(10);
+        for (int i = 0; i < kNumBatches; i++) {
+          // threads race to resolve kernels and to register new ones
+          std::string name = "set_" + std::to_string(t) + "_" + std::to_string(i % 5);
+          engine.RegisterKernel(name, PerThread(
+              [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+                args.Get<float>(0)[col] = *args.Get<const float>(1);
+              }));
+
+          float value = t * kNumBatches + i;
+          engine.NewBatch()
+              .WithGrid(1, v1.size(), 1, 2).Call(name, out(v1), value)
+              .WithGrid(1, v1.size(), 1, 2).Call(engine.GetKernel("copy"), in(v1), out(v2))
+              .WithGrid(1, v1.size(), 1, 2).Call("copy", resident, priv(v1.size() * sizeof(float)))
+              .Reads(resident)
+              .Dispatch().Wait();
+          for (std::size_t j = 0; j < v2.size(); j++) {
+            if (v2[j] != value) {
+              failures++;
+            }
+          }
+        }
+      });
+    }
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+      it->join();
+    }
+    ASSERT_EQ(0, failures);
+  }
+
+  TEST(CpuComputeTestSuite, TestBatchTemplate) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    std::vector<float> v1(kSize);
+    std::vector<float> v2(kSize);
+    auto tmp = priv(kSize * sizeof(float));
+    ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+        .WithGrid(1, kSize, 1, kSize).Call("set", tmp, 2.0f)
+        .WithGrid(1, kSize, 1, kSize).Call("copy", tmp, out(v1))
+        .Record();
+    ASSERT_EQ(2, tmpl.NumCalls());
+    // nothing ran yet
+    ASSERT_FLOAT_EQ(0.0f, v1[0]);
+
+    tmpl.Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, v1[i]);
+    }
+
+    tmpl.Bind(0, 1, 3.0f);
+    tmpl.Bind(1, 1, out(v2));
+    tmpl.Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, v1[i]);
+      ASSERT_FLOAT_EQ(3.0f, v2[i]);
+    }
+
+    // copies are independent, and can be in flight at the same time
+    std::vector<float> v3(kSize);
+    ComputeEngine::BatchTemplate other = tmpl;
+    other.Bind(0, 1, 4.0f);
+    other.Bind(1, 1, out(v3));
+    ComputeEngine::Gate gate = other.Dispatch();
+    tmpl.Bind(0, 1, 5.0f);
+    tmpl.Dispatch().Wait();
+    gate.Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(5.0f, v2[i]);
+      ASSERT_FLOAT_EQ(4.0f, v3[i]);
+    }
+
+    ASSERT_THROW(tmpl.Bind(0, 1, in(v1)), RuntimeException);
+    ASSERT_THROW(tmpl.Bind(0, 1, 1.0), RuntimeException);
+    ASSERT_THROW(tmpl.Bind(1, 2, 1.0f), RuntimeException);
+    ASSERT_THROW(tmpl.Bind(2, 0, out(v1)), RuntimeException);
+    ASSERT_THROW(tmpl.Bind(0, 0, v1), RuntimeException);
+    // values are copied into "in" buffers, memory written in place is bound
+    // as a buffer
+    ASSERT_THROW(tmpl.Bind(1, 1, v1), RuntimeException);
+    ASSERT_THROW(engine.NewBatch().Record(), RuntimeException);
+    ASSERT_THROW(engine.NewBatchTemplate().Dispatch(), RuntimeException);
+  }
+
+  TEST(CpuComputeTestSuite, TestBatchTemplate_LargeValueArguments) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    // too large to be inline: bound values are copied, like at Call()
+    const int kSize = 32;
+    struct Values { float v[kSize]; };
+    auto makeValues = [](float value) {
+      Values values;
+      for (int i = 0; i < kSize; i++) {
+        values.v[i] = value;
+      }
+      return values;
+    };
+    float f1[kSize];
+    ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", makeValues(1.0f), out(f1))
+        .Record();
+    tmpl.Bind(0, 0, makeValues(5.0f));
+    // overwrites the stack the temporary was on
+    makeValues(-1.0f);
+    tmpl.Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(5.0f, f1[i]);
+    }
+
+    std::vector<float> v(kSize, 6.0f);
+    tmpl.Bind(0, 0, in(v));
+    tmpl.Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(6.0f, f1[i]);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestBatchTemplate_ResidentBuffer) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    ResidentBuffer r1 = engine.NewResidentBuffer(kSize * sizeof(float));
+    ResidentBuffer r2 = engine.NewResidentBuffer(kSize * sizeof(float));
+    ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+        .WithGrid(1, kSize, 1, kSize).Call("set", r1, 6.0f)
+        .Record();
+
+    tmpl.Dispatch().Wait();
+    r1.Download(f1);
+    ASSERT_FLOAT_EQ(6.0f, f1[0]);
+
+    tmpl.Bind(0, 0, r2);
+    tmpl.Bind(0, 1, 7.0f);
+    tmpl.Dispatch().Wait();
+    r2.Download(f1);
+    ASSERT_FLOAT_EQ(7.0f, f1[0]);
+    r1.Download(f1);
+    ASSERT_FLOAT_EQ(6.0f, f1[0]);
+  }
+
+  TEST(CpuComputeTestSuite, TestInstrumentation) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 1.0f)
+        .Dispatch().Wait();
+    ASSERT_EQ(0, engine.GetStats().batches);
+    ASSERT_TRUE(engine.GetTraces().empty());
+
+    engine.EnableInstrumentation();
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 1.0f)
+        .WithGrid(1, kSize, 1, 2).Call("copy", in(f1), priv(sizeof(f2)))
+        .Dispatch().Wait();
+    engine.NewBatch().Dispatch().Wait();
+
+    EngineStats stats = engine.GetStats();
+    ASSERT_EQ(2, stats.batches);
+    ASSERT_EQ(2, stats.calls);
+    // the CPU binds application memory in place
+    for (std::size_t i = 0; i < kNumBufferTypes; i++) {
+      ASSERT_EQ(0, stats.bytesUploaded[i]);
+      ASSERT_EQ(0, stats.bytesDownloaded[i]);
+    }
+    ASSERT_TRUE(stats.executeTime.count() >= 0);
+    ASSERT_EQ(1, stats.bufferPool.misses);
+
+    std::vector<BatchTrace> traces = engine.GetTraces();
+    ASSERT_EQ(2, traces.size());
+    const BatchTrace& trace = traces[0];
+    ASSERT_EQ(2, trace.calls.size());
+    ASSERT_STREQ("set", trace.calls[0].kernel);
+    ASSERT_TRUE(trace.created <= trace.dispatched);
+    ASSERT_TRUE(trace.dispatched <= trace.submitted);
+    ASSERT_TRUE(trace.submitted <= trace.started);
+    ASSERT_TRUE(trace.started <= trace.executed);
+    ASSERT_TRUE(trace.executed <= trace.completed);
+    // serial batch: calls run one after the other
+    ASSERT_TRUE(trace.calls[0].encodeBegin <= trace.calls[0].encodeEnd);
+    ASSERT_TRUE(trace.started <= trace.calls[0].executeBegin);
+    ASSERT_TRUE(trace.calls[0].executeBegin <= trace.calls[0].executeEnd);
+    ASSERT_TRUE(trace.calls[0].executeEnd <= trace.calls[1].executeBegin);
+    ASSERT_TRUE(trace.calls[1].executeEnd <= trace.executed);
+    ASSERT_TRUE(traces[0].id < traces[1].id);
+
+    std::ostringstream json;
+    engine.WriteChromeTrace(json);
+    ASSERT_EQ(0, json.str().find("{\"traceEvents\":["));
+    ASSERT_NE(std::string::npos, json.str().find("\"name\":\"copy\""));
+    ASSERT_NE(std::string::npos, json.str().find("\"name\":\"execute\""));
+
+    engine.ResetStats();
+    ASSERT_EQ(0, engine.GetStats().batches);
+    ASSERT_TRUE(engine.GetTraces().empty());
+
+    engine.EnableInstrumentation(false);
+    engine.NewBatch().Dispatch().Wait();
+    ASSERT_EQ(0, engine.GetStats().batches);
+  }
+  TEST(CpuComputeTestSuite, TestWithGrid_Auto) {
+    CpuComputeEngine engine(4);
+    std::atomic_size_t groupRows = 0;
+    std::atomic_size_t groupCols = 0;
+    engine.RegisterKernel("fill", 
+        [&](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+          groupRows = std::max<std::size_t>(groupRows, group.rowEnd - group.rowBegin);
+          groupCols = std::max<std::size_t>(groupCols, group.colEnd - group.colBegin);
+          std::size_t numCols = *args.Get<const std::size_t>(1);
+          for (std::size_t row = group.rowBegin; row < group.rowEnd; row++) {
+            for (std::size_t col = group.colBegin; col < group.colEnd; col++) {
+              args.Get<float>(0)[row * numCols + col] = 1.0f;
+            }
+          }
+        });
+
+    // four work-groups per thread, split along the row
+    std::vector<float> f(1000);
+    engine.NewBatch().WithGrid(1, 1000).Call("fill", out(f), std::size_t(1000))
+        .Dispatch().Wait();
+    ASSERT_EQ(1, groupRows);
+    ASSERT_EQ(63, groupCols);
+    for (auto it = f.begin(); it != f.end(); it++) {
+      ASSERT_FLOAT_EQ(1.0f, *it);
+    }
+
+    // or made of whole rows
+    groupRows = 0;
+    groupCols = 0;
+    std::fill(f.begin(), f.end(), 0.0f);
+    engine.NewBatch().WithGrid(100, 10).Call("fill", out(f), std::size_t(10))
+        .Dispatch().Wait();
+    ASSERT_EQ(6, groupRows);
+    ASSERT_EQ(10, groupCols);
+    for (auto it = f.begin(); it != f.end(); it++) {
+      ASSERT_FLOAT_EQ(1.0f, *it);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestWithGrid3D) {
+    CpuComputeEngine engine;
+    engine.RegisterKernel("index", PerThread(
+        [](std::size_t layer, std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(0)[(layer * 3 + row) * 5 + col] = layer * 100 + row * 10 + col;
+        }));
+
+    // partial work-groups on every edge
+    std::vector<float> f(4 * 3 * 5);
+    engine.NewBatch().WithGrid3D(5, 3, 4, 2, 2, 3).Call("index", out(f))
+        .Dispatch().Wait();
+
+    for (int layer = 0; layer < 4; layer++) {
+      for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 5; col++) {
+          ASSERT_FLOAT_EQ(layer * 100 + row * 10 + col, f[(layer * 3 + row) * 5 + col]);
+        }
+      }
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestWithWorkGroups) {
+    CpuComputeEngine engine;
+    std::atomic_size_t numThreads = 0;
+    engine.RegisterKernel("fill", PerThread(
+        [&](std::size_t layer, std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          numThreads++;
+          std::size_t index = (layer * 2 + row) * 10 + col;
+          if (col < 10) {
+            args.Get<float>(0)[index] = 1.0f;
+          }
+        }));
+
+    // whole work-groups: 3 x 4 threads wide, past the end of each row
+    std::vector<float> f(2 * 2 * 10);
+    engine.NewBatch().WithWorkGroups(3, 1, 2, 4, 2, 1).Call("fill", out(f))
+        .Dispatch().Wait();
+
+    ASSERT_EQ(3 * 4 * 2 * 2, numThreads);
+    for (auto it = f.begin(); it != f.end(); it++) {
+      ASSERT_FLOAT_EQ(1.0f, *it);
+    }
+    ASSERT_THROW(engine.NewBatch().WithWorkGroups(1, 1, 1, 0, 1, 1), RuntimeException);
+  }
+
+  TEST(CpuComputeTestSuite, TestCall_Local) {
+    CpuComputeEngine engine;
+    // sums each work-group's tile of the input, staged in local memory
+    engine.RegisterKernel("tile_sum", 
+        [](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+          const float * input = args.Get<const float>(0);
+          float * tile = args.Get<float>(1);
+          ASSERT_EQ(0, reinterpret_cast<std::uintptr_t>(tile) % 64);
+          std::size_t size = group.colEnd - group.colBegin;
+          std::memcpy(tile, input + group.colBegin, size * sizeof(float));
+          float sum = 0;
+          for (std::size_t i = 0; i < size; i++) {
+            sum += tile[i];
+          }
+          args.Get<float>(2)[group.col] = sum;
+        });
+
+    const int kSize = 1000;
+    const int kTile = 8;
+    std::vector<float> input(kSize);
+    for (int i = 0; i < kSize; i++) {
+      input[i] = i;
+    }
+    std::vector<float> sums(kSize / kTile);
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kTile)
+        .Call("tile_sum", in(input), local(kTile * sizeof(float)), out(sums))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize / kTile; i++) {
+      float expected = 0;
+      for (int j = 0; j < kTile; j++) {
+        expected += i * kTile + j;
+      }
+      ASSERT_FLOAT_EQ(expected, sums[i]);
+    }
+  }
+
+  void RegisterIndirectKernels(CpuComputeEngine& engine, std::atomic_size_t& numThreads) {
+    // sizes the next call: one work-group of 4 threads per 4 positive values
+    engine.RegisterKernel("count", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          const float * input = args.Get<const float>(0);
+          std::uint32_t count = 0;
+          for (std::size_t i = 0; i < *args.Get<const std::size_t>(1); i++) {
+            count += input[i] > 0;
+          }
+          *args.Get<IndirectGrid>(2) = IndirectGrid { (count + 3) / 4, 1, 1 };
+        }));
+    engine.RegisterKernel("mark", PerThread(
+        [&numThreads](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          numThreads++;
+          args.Get<float>(0)[col] = 1.0f;
+        }));
+  }
+
+  TEST(CpuComputeTestSuite, TestIndirectGrid) {
+    CpuComputeEngine engine;
+    std::atomic_size_t numThreads = 0;
+    RegisterIndirectKernels(engine, numThreads);
+
+    const std::size_t kSize = 32;
+    std::vector<float> input(kSize, -1.0f);
+    for (std::size_t i = 0; i < 10; i++) {
+      input[i * 3] = 1.0f;
+    }
+    std::vector<float> output(kSize, 0.0f);
+    private_buffer grid = priv(sizeof(IndirectGrid));
+    engine.NewBatch()
+        .WithGrid(1, 1, 1, 1).Call("count", in(input), kSize, grid)
+        .WithIndirectGrid(grid, 0, 4).Call("mark", inout(output))
+        .Dispatch().Wait();
+
+    // 10 positive values: 3 work-groups of 4
+    ASSERT_EQ(12, numThreads);
+    for (std::size_t i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i < 12 ? 1.0f : 0.0f, output[i]);
+    }
+  }
+
+  TEST(CpuComputeTestSuite, TestIndirectGrid_ResidentBuffer) {
+    CpuComputeEngine engine;
+    std::atomic_size_t numThreads = 0;
+    RegisterIndirectKernels(engine, numThreads);
+
+    // the grid is at offset 4
+    std::uint32_t values[] = { 0, 2, 1, 1 };
+    ResidentBuffer grid = engine.NewResidentBuffer(values);
+    std::vector<float> output(16, 0.0f);
+    engine.NewBatch()
+        .WithIndirectGrid(grid, sizeof(std::uint32_t), 4).Call("mark", inout(output))
+        .Dispatch().Wait();
+    ASSERT_EQ(8, numThreads);
+
+    // and can be recorded
+    ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+        .WithIndirectGrid(grid, sizeof(std::uint32_t), 4).Call("mark", inout(output))
+        .Record();
+    tmpl.Dispatch().Wait();
+    ASSERT_EQ(16, numThreads);
+  }
+
+  TEST(CpuComputeTestSuite, TestIndirectGrid_Template) {
+    CpuComputeEngine engine;
+    std::atomic_size_t numThreads = 0;
+    RegisterIndirectKernels(engine, numThreads);
+
+    const std::size_t kSize = 8;
+    std::vector<float> input(kSize, 1.0f);
+    std::vector<float> output(kSize, 0.0f);
+    private_buffer grid = priv(sizeof(IndirectGrid));
+    ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+        .WithGrid(1, 1, 1, 1).Call("count", in(input), kSize, grid)
+        .WithIndirectGrid(grid, 0, 4).Call("mark", inout(output))
+        .Record();
+    tmpl.Dispatch().Wait();
+    ASSERT_EQ(8, numThreads);
+
+    std::vector<float> fewer(kSize, -1.0f);
+    fewer[0] = 1.0f;
+    tmpl.Bind(0, 0, in(fewer));
+    tmpl.Dispatch().Wait();
+    ASSERT_EQ(12, numThreads);
+  }
+
+  TEST(CpuComputeTestSuite, TestIndirectGrid_Errors) {
+    CpuComputeEngine engine;
+    std::atomic_size_t numThreads = 0;
+    RegisterIndirectKernels(engine, numThreads);
+
+    float output[4];
+    private_buffer grid = priv(sizeof(IndirectGrid));
+    ASSERT_THROW(engine.NewBatch(true).WithIndirectGrid(grid, 0, 4), RuntimeException);
+    ASSERT_THROW(engine.NewBatch().WithIndirectGrid(grid, 2, 4), RuntimeException);
+    ASSERT_THROW(engine.NewBatch().WithIndirectGrid(grid, 4, 4), RuntimeException);
+    // nothing wrote the grid
+    ASSERT_THROW(
+        engine.NewBatch().WithIndirectGrid(grid, 0, 4).Call("mark", out(output)), 
+        RuntimeException);
+
+    // a failed call leaves the batch as it was
+    ComputeEngine::BatchBuilder builder = engine.NewBatch()
+        .WithGrid(1, 4, 1, 4).Call("mark", out(output));
+    ASSERT_THROW(builder.WithIndirectGrid(grid, 4, 4), RuntimeException);
+    builder.Dispatch().Wait();
+    ASSERT_EQ(4, numThreads);
+  }
+
+  TEST(CpuComputeTestSuite, TestCoalescing) {
+    CpuComputeEngine engine;
+    RegisterTestKernels(engine);
+    engine.EnableInstrumentation();
+    // a window long enough that only the size limit submits the group
+    engine.EnableCoalescing(true, CoalescingOptions {
+      .window = std::chrono::seconds(60), 
+      .maxBatches = 3
+    });
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    float f3[kSize];
+    ComputeEngine::Gate g1 = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 1.0f)
+        .Dispatch();
+    ComputeEngine::Gate g2 = engine.NewBatch(true)
+        .WithGrid(1, kSize, 1, 2).Call("set", out(f2), 2.0f)
+        .WithGrid(1, kSize, 1, 2).Call("set", priv(sizeof(f2)), 2.0f)
+        .Dispatch();
+    ASSERT_FALSE(g1.Done());
+    ASSERT_FALSE(g2.Done());
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f3), 3.0f)
+        .Dispatch().Wait();
+    g1.Wait();
+    g2.Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(1.0f, f1[i]);
+      ASSERT_FLOAT_EQ(2.0f, f2[i]);
+      ASSERT_FLOAT_EQ(3.0f, f3[i]);
+    }
+    EngineStats stats = engine.GetStats();
+    ASSERT_EQ(3, stats.batches);
+    ASSERT_EQ(4, stats.calls);
+    ASSERT_EQ(3, stats.coalescedBatches);
+    std::vector<BatchTrace> traces = engine.GetTraces();
+    for (auto it = traces.begin(); it != traces.end(); it++) {
+      ASSERT_EQ(3, it->coalesced);
+      ASSERT_TRUE(it->submitted <= it->started);
+      ASSERT_TRUE(it->started <= it->executed);
+    }
+
+    // a lone batch goes at the end of its window
+    engine.EnableCoalescing(true, CoalescingOptions {
+      .window = std::chrono::milliseconds(1)
+    });
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 4.0f)
+        .Dispatch().Wait();
+    ASSERT_FLOAT_EQ(4.0f, f1[0]);
+
+    // an error fails the whole group
+    engine.RegisterKernel("fail", [](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+      throw std::logic_error("kernel failure");
+    });
+    engine.EnableCoalescing(true, CoalescingOptions {
+      .window = std::chrono::seconds(60),
+      .maxBatches = 2
+    });
+    ComputeEngine::Gate failed = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 5.0f)
+        .Dispatch();
+    ASSERT_THROW(
+        engine.NewBatch().WithGrid(1, kSize, 1, 2).Call("fail", out(f2)).Dispatch().Wait(),
+        std::logic_error);
+    ASSERT_THROW(failed.Wait(), std::logic_error);
+
+    // pending batches are submitted when coalescing is turned off
+    ComputeEngine::Gate pending = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 6.0f)
+        .Dispatch();
+    engine.EnableCoalescing(false);
+    pending.Wait();
+    ASSERT_FLOAT_EQ(6.0f, f1[0]);
+  }
+
+  TEST(CpuComputeTestSuite, TestCoalescing_SubmitFails) {
+    FailingSubmitEngine engine;
+    RegisterTestKernels(engine);
+    float f1[10];
+    float f2[10];
+
+    // a lone batch, submitted by the coalescer thread
+    engine.EnableCoalescing(true, CoalescingOptions {
+      .window = std::chrono::milliseconds(1)
+    });
+    ASSERT_THROW(
+        engine.NewBatch().WithGrid(1, 10, 1, 2).Call("set", out(f1), 1.0f).Dispatch().Wait(),
+        RuntimeException);
+
+    // a group: every batch in it fails
+    engine.EnableCoalescing(true, CoalescingOptions {
+      .window = std::chrono::seconds(60),
+      .maxBatches = 2
+    });
+    ComputeEngine::Gate g1 = engine.NewBatch()
+        .WithGrid(1, 10, 1, 2).Call("set", out(f1), 1.0f)
+        .Dispatch();
+    ComputeEngine::Gate g2 = engine.NewBatch()
+        .WithGrid(1, 10, 1, 2).Call("set", out(f2), 2.0f)
+        .Dispatch();
+    ASSERT_THROW(g1.Wait(), RuntimeException);
+    ASSERT_THROW(g2.Wait(), RuntimeException);
+  }
+
+} // compute_test
+} // compute
+} // mdl
@@ -0,0 +1,164 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+using std::cout;
+using std::endl; 
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  TEST(HostMemoryTestSuite, TestRoundUpToPage) {
+    std::size_t pageSize = HostPageSize();
+    ASSERT_EQ(0, RoundUpToPage(0));
+    ASSERT_EQ(pageSize, RoundUpToPage(1));
+    ASSERT_EQ(pageSize, RoundUpToPage(pageSize));
+    ASSERT_EQ(2 * pageSize, RoundUpToPage(pageSize + 1));
+  }
+
+  TEST(HostMemoryTestSuite, TestAllocateHostMemory) {
+    const std::size_t kSize = 3 * HostPageSize() + 10;
+    std::uint8_t * data = static_cast<std::uint8_t *>(AllocateHostMemory(kSize));
+    ASSERT_TRUE(IsPageAligned(data));
+    ASSERT_FALSE(IsPageAligned(data + 1));
+
+    // the whole last page is usable
+    for (std::size_t i = 0; i < RoundUpToPage(kSize); i++) {
+      ASSERT_EQ(0, data[i]);
+      data[i] = i;
+    }
+    FreeHostMemory(data, kSize);
+  }
+
+  TEST(HostMemoryTestSuite, TestIsHostMemory) {
+    const std::size_t kSize = 2 * HostPageSize() + 10;
+    std::uint8_t * data = static_cast<std::uint8_t *>(AllocateHostMemory(kSize));
+    ASSERT_TRUE(IsHostMemory(data, kSize));
+    ASSERT_TRUE(IsHostMemory(data + HostPageSize(), 10));
+    // the rest of the last page is part of the allocation too
+    ASSERT_TRUE(IsHostMemory(data, RoundUpToPage(kSize)));
+    ASSERT_FALSE(IsHostMemory(data, RoundUpToPage(kSize) + 1));
+
+    // page-aligned memory from elsewhere isn't
+    std::vector<std::uint8_t> v(4 * HostPageSize());
+    ASSERT_FALSE(IsHostMemory(v.data(), v.size()));
+
+    FreeHostMemory(data, kSize);
+    ASSERT_FALSE(IsHostMemory(data, kSize));
+
+    host_vector<float> hv(1000);
+    ASSERT_TRUE(IsHostMemory(hv.data(), hv.size() * sizeof(float)));
+  }
+
+  TEST(HostMemoryTestSuite, TestAllocateHostMemory_Options) {
+    const std::size_t kSize = 4 * 1024 * 1024 + 10;
+    HostMemoryOptions options;
+    options.hugePages = true;
+    options.numaNode = 0;
+    std::uint8_t * data = static_cast<std::uint8_t *>(AllocateHostMemory(kSize, options));
+    ASSERT_TRUE(IsPageAligned(data));
+
+    for (std::size_t i = 0; i < kSize; i += 4096) {
+      ASSERT_EQ(0, data[i]);
+      data[i] = 1;
+    }
+    FreeHostMemory(data, kSize);
+  }
+
+  TEST(HostMemoryTestSuite, TestHostVector) {
+    host_vector<float> v(1000, 1.0f);
+    ASSERT_TRUE(IsPageAligned(v.data()));
+    v.resize(100000, 2.0f);
+    ASSERT_TRUE(IsPageAligned(v.data()));
+    ASSERT_FLOAT_EQ(1.0f, v[999]);
+    ASSERT_FLOAT_EQ(2.0f, v[1000]);
+
+    in_buffer buff = in(v);
+    ASSERT_EQ(v.data(), buff.data);
+    ASSERT_EQ(v.size() * sizeof(float), buff.size);
+
+    HostMemoryOptions options;
+    options.hugePages = true;
+    host_vector<int> huge(1 << 20, host_allocator<int>(options));
+    ASSERT_TRUE(huge.get_allocator().GetOptions().hugePages);
+    ASSERT_TRUE(IsPageAligned(huge.data()));
+  }
+
+  TEST(HostMemoryTestSuite, TestCall_SharedHostMemory) {
+    CpuComputeEngine engine;
+    engine.RegisterKernel("double", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(0)[col] *= 2;
+        }));
+
+    const int kSize = 1000;
+    float * f = static_cast<float *>(AllocateHostMemory(kSize * sizeof(float)));
+    for (int i = 0; i < kSize; i++) {
+      f[i] = i;
+    }
+
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, 100).Call("double", shared(f, kSize * sizeof(float)))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f * i, f[i]);
+    }
+    FreeHostMemory(f, kSize * sizeof(float));
+  }
+
+  TEST(HostMemoryTestSuite, TestCall_HostVector) {
+    CpuComputeEngine engine;
+    engine.RegisterKernel("add", PerThread(
+        [](std::size_t row, std::size_t col, const CpuKernelArgs& args) {
+          args.Get<float>(2)[col] = args.Get<float>(0)[col] + args.Get<float>(1)[col];
+        }));
+
+    host_vector<float> a(1000, 1.0f);
+    host_vector<float> b(1000, 2.0f);
+    host_vector<float> c(1000);
+
+    engine.NewBatch()
+        .WithGrid(1, a.size(), 1, 100).Call("add", in(a), in(b), out(c))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < c.size(); i++) {
+      ASSERT_FLOAT_EQ(3.0f, c[i]);
+    }
+  }
+
+} // compute_test
+} // compute
+} // mdl
@@ -29,8 +29,13 @@
 #include <gtest/gtest.h>
 
 #include <mdl/compute.h>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 using std::cout;
@@ -96,6 +101,69 @@ namespace compute_test {
       }
   )";
 
+  const char* shaderSrc3D = R"(
+      #include <metal_stdlib>
+      using namespace metal;
+
+      kernel void index3d(device float* outA [[buffer(0)]], 
+                          constant uint3& size [[buffer(1)]],
+                          uint3 pos [[ thread_position_in_grid ]])
+      {
+          if (pos.x < size.x && pos.y < size.y && pos.z < size.z) {
+              outA[(pos.z * size.y + pos.y) * size.x + pos.x] = pos.z * 100 + pos.y * 10 + pos.x;
+          }
+      }
+  )";
+
+  const char* shaderSrcLocal = R"(
+      #include <metal_stdlib>
+      using namespace metal;
+
+      kernel void tile_sum(device const float* input [[buffer(0)]], 
+                           device float* sums [[buffer(2)]],
+                           threadgroup float* tile [[threadgroup(0)]],
+                           uint index [[ thread_position_in_grid ]],
+                           uint lid [[ thread_position_in_threadgroup ]],
+                           uint group [[ threadgroup_position_in_grid ]],
+                           uint size [[ threads_per_threadgroup ]])
+      {
+          tile[lid] = input[index];
+          threadgroup_barrier(mem_flags::mem_threadgroup);
+          if (lid == 0) {
+              float sum = 0;
+              for (uint i = 0; i < size; i++) {
+                  sum += tile[i];
+              }
+              sums[group] = sum;
+          }
+      }
+  )";
+
+  const char* shaderSrcIndirect = R"(
+      #include <metal_stdlib>
+      using namespace metal;
+
+      kernel void count(device const float* input [[buffer(0)]], 
+                        constant uint& size [[buffer(1)]],
+                        device uint* grid [[buffer(2)]],
+                        uint index [[ thread_position_in_grid ]])
+      {
+          uint count = 0;
+          for (uint i = 0; i < size; i++) {
+              count += input[i] > 0;
+          }
+          grid[0] = (count + 3) / 4;
+          grid[1] = 1;
+          grid[2] = 1;
+      }
+
+      kernel void mark(device float* output [[buffer(0)]],
+                       uint index [[ thread_position_in_grid ]])
+      {
+          output[index] = 1;
+      }
+  )";
+
   const char* shaderSrcWithError = R"(
       #include <metal_stdlib>
       using namespace metal;
@@ -125,6 +193,43 @@ namespace compute_test {
     ASSERT_THROW(engine.LoadLibrary(shaderSrcWithError), CompilationException);
   }
 
+  TEST(ComputeTestSuite, TestPrecompileAll) {
+    std::filesystem::path directory = 
+        std::filesystem::temp_directory_path() / "mdlcompute_metal_artifacts_test";
+    std::filesystem::remove_all(directory);
+    std::shared_ptr<ArtifactCache> cache = 
+        std::make_shared<DiskArtifactCache>(directory.string());
+
+    {
+      MetalComputeEngine engine;
+      engine.SetArtifactCache(cache);
+      engine.LoadLibrary(shaderSrc2);
+      engine.LoadLibrary(shaderSrc3);
+      // same source, deduplicated
+      engine.LoadLibrary(shaderSrc3);
+      engine.PrecompileAll();
+      ASSERT_TRUE(engine.ContainsFunction("copy"));
+    }
+    ASSERT_EQ(2, std::distance(
+        std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator()));
+
+    // warm start, pipelines come from the cached archives
+    MetalComputeEngine engine;
+    engine.SetArtifactCache(cache);
+    engine.LoadLibrary(shaderSrc3);
+    engine.PrecompileAll();
+
+    const int kSize = 10;
+    float f1[kSize];
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 2.0f)
+        .Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, f1[i]);
+    }
+    std::filesystem::remove_all(directory);
+  }
+
   TEST(ComputeTestSuite, TestCall_InOut) {
     MetalComputeEngine engine;
     engine.LoadLibrary(shaderSrc2);
@@ -159,6 +264,34 @@ namespace compute_test {
     ASSERT_FLOAT_EQ(kSize - 9- 1, f1[9]);
   }
 
+  TEST(ComputeTestSuite, TestGetKernel) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc2);
+
+    Kernel swap = engine.GetKernel("swap");
+    ASSERT_EQ("swap", swap.Name());
+    ASSERT_TRUE(swap.MaxThreadsPerWorkGroup() > 0);
+    ASSERT_TRUE(swap.ExecutionWidth() > 0);
+    ASSERT_THROW(engine.GetKernel("bogus"), FunctionNotFoundException);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+      f2[i] = kSize - i - 1;
+    }
+
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call(swap, inout(f1), inout(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(kSize - i - 1, f1[i]);
+      ASSERT_FLOAT_EQ(i, f2[i]);
+    }
+  }
+
   TEST(ComputeTestSuite, TestCall_In) {
     MetalComputeEngine engine;
     engine.LoadLibrary(shaderSrc2);
@@ -220,6 +353,103 @@ namespace compute_test {
     }
   }  
 
+  TEST(ComputeTestSuite, TestWithGrid_Auto) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    const int kSize = 1000;
+    std::vector<float> f1(kSize);
+    engine.NewBatch()
+        .WithGrid(1, kSize).Call("set", out(f1), 2.0f)
+        .Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, f1[i]);
+    }
+
+    engine.SetWorkGroupTuner(std::make_shared<WorkGroupTuner>());
+    WorkGroupShape shape = engine.Autotune("set", 1, kSize, out(f1), 3.0f);
+    ASSERT_EQ(1, shape.rows);
+    ASSERT_EQ(0, shape.cols % engine.GetKernel("set").ExecutionWidth());
+    engine.NewBatch()
+        .WithGrid(1, kSize).Call("set", out(f1), 4.0f)
+        .Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(4.0f, f1[i]);
+    }
+  }
+
+  TEST(ComputeTestSuite, TestWithGrid3D) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3D);
+
+    struct { std::uint32_t x, y, z, pad; } size { 5, 3, 4, 0 };
+    std::vector<float> f1(4 * 3 * 5);
+    std::vector<float> f2(4 * 3 * 5);
+    engine.NewBatch()
+        .WithGrid3D(5, 3, 4, 2, 2, 3).Call("index3d", out(f1), size)
+        .Dispatch().Wait();
+    // whole work-groups, past the end of the data in every dimension
+    engine.NewBatch()
+        .WithWorkGroups(3, 2, 2, 2, 2, 3).Call("index3d", out(f2), size)
+        .Dispatch().Wait();
+
+    for (int z = 0; z < 4; z++) {
+      for (int y = 0; y < 3; y++) {
+        for (int x = 0; x < 5; x++) {
+          ASSERT_FLOAT_EQ(z * 100 + y * 10 + x, f1[(z * 3 + y) * 5 + x]);
+          ASSERT_FLOAT_EQ(z * 100 + y * 10 + x, f2[(z * 3 + y) * 5 + x]);
+        }
+      }
+    }
+  }
+
+  TEST(ComputeTestSuite, TestCall_Local) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrcLocal);
+
+    const int kSize = 1024;
+    const int kTile = 64;
+    std::vector<float> input(kSize);
+    for (int i = 0; i < kSize; i++) {
+      input[i] = i % 7;
+    }
+    std::vector<float> sums(kSize / kTile);
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kTile)
+        .Call("tile_sum", in(input), local(kTile * sizeof(float)), out(sums))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize / kTile; i++) {
+      float expected = 0;
+      for (int j = 0; j < kTile; j++) {
+        expected += (i * kTile + j) % 7;
+      }
+      ASSERT_FLOAT_EQ(expected, sums[i]);
+    }
+  }
+
+  TEST(ComputeTestSuite, TestIndirectGrid) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrcIndirect);
+
+    const std::uint32_t kSize = 32;
+    std::vector<float> input(kSize, -1.0f);
+    for (std::size_t i = 0; i < 10; i++) {
+      input[i * 3] = 1.0f;
+    }
+    std::vector<float> output(kSize, 0.0f);
+    private_buffer grid = priv(sizeof(IndirectGrid));
+    engine.NewBatch()
+        .WithGrid(1, 1, 1, 1).Call("count", in(input), kSize, grid)
+        .WithIndirectGrid(grid, 0, 4).Call("mark", inout(output))
+        .Dispatch().Wait();
+
+    // 10 positive values: 3 work-groups of 4
+    for (std::size_t i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i < 12 ? 1.0f : 0.0f, output[i]);
+    }
+  }
+
   TEST(ComputeTestSuite, TestCall_Shared) {
     MetalComputeEngine engine;
     engine.LoadLibrary(shaderSrc2);
@@ -324,6 +554,144 @@ namespace compute_test {
     }
   }  
 
+  TEST(ComputeTestSuite, TestCall_Range) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    std::vector<float> v(10, 1.0f);
+    
+    engine.NewBatch()
+        .WithGrid(1, 4, 1, 4).Call("set", out(v).range(3 * sizeof(float), 4 * sizeof(float)), 5.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < v.size(); i++) {
+      ASSERT_FLOAT_EQ(i >= 3 && i < 7 ? 5.0f : 1.0f, v[i]);
+    }
+  }  
+
+  TEST(ComputeTestSuite, TestCall_SharedHostMemory) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    const int kSize = 1000;
+    float * f = static_cast<float *>(AllocateHostMemory(kSize * sizeof(float)));
+    
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, 100).Call("set", shared(f, kSize * sizeof(float)), 3.0f)
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(3.0f, f[i]);
+    }
+    FreeHostMemory(f, kSize * sizeof(float));
+  }  
+
+  TEST(ComputeTestSuite, TestCall_SharedOtherMemory) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+    engine.EnableInstrumentation();
+
+    // page-aligned, but not from AllocateHostMemory(): copied in and out
+    const std::size_t kSize = HostPageSize() / sizeof(float);
+    float * f = static_cast<float *>(std::aligned_alloc(HostPageSize(), kSize * sizeof(float)));
+    
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, 128).Call("set", shared(f, kSize * sizeof(float)), 3.0f)
+        .Dispatch().Wait();
+
+    for (std::size_t i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(3.0f, f[i]);
+    }
+    EngineStats stats = engine.GetStats();
+    ASSERT_EQ(kSize * sizeof(float), 
+        stats.bytesDownloaded[static_cast<std::size_t>(BufferType::Shared)]);
+
+    // same for in(), out() and inout(), even with unified memory
+    std::vector<float> v(kSize);
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, 128).Call("copy", in(f, kSize * sizeof(float)), out(v))
+        .Dispatch().Wait();
+    ASSERT_FLOAT_EQ(3.0f, v[kSize - 1]);
+    stats = engine.GetStats();
+    ASSERT_EQ(kSize * sizeof(float), 
+        stats.bytesUploaded[static_cast<std::size_t>(BufferType::In)]);
+    std::free(f);
+  }  
+
+  TEST(ComputeTestSuite, TestCall_HostVector) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    host_vector<float> v1(1000, 4.0f);
+    host_vector<float> v2(1000);
+    
+    engine.NewBatch()
+        .WithGrid(1, v1.size(), 1, 100).Call("copy", in(v1), out(v2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < v2.size(); i++) {
+      ASSERT_FLOAT_EQ(4.0f, v2[i]);
+    }
+  }  
+
+  TEST(ComputeTestSuite, TestCall_AliasedBuffers) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+    engine.EnableInstrumentation();
+
+    const int kSize = 10;
+    std::vector<float> v(2 * kSize);
+    std::vector<float> w(2 * kSize);
+    
+    // views of the same vector share a device buffer, so the last call sees
+    // what the first two wrote, and "v" is uploaded once
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(v).range(0, kSize * sizeof(float)), 1.0f)
+        .WithGrid(1, kSize, 1, kSize).Call("set", 
+            out(v).range(kSize * sizeof(float), kSize * sizeof(float)), 2.0f)
+        .WithGrid(1, 2 * kSize, 1, 2 * kSize).Call("copy", in(v), out(w))
+        .WithGrid(1, 2 * kSize, 1, 2 * kSize).Call("copy", in(v), out(w))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < 2 * kSize; i++) {
+      ASSERT_FLOAT_EQ(i < kSize ? 1.0f : 2.0f, v[i]);
+      ASSERT_FLOAT_EQ(i < kSize ? 1.0f : 2.0f, w[i]);
+    }
+    EngineStats stats = engine.GetStats();
+    ASSERT_EQ(2 * kSize * sizeof(float), stats.bytesUploaded[static_cast<std::size_t>(BufferType::In)]);
+  }  
+
+  TEST(ComputeTestSuite, TestCall_LargeUploads) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    // large enough to be uploaded in parallel chunks, along with small 
+    // buffers staged in the ring
+    const std::size_t kSize = 4 * 1024 * 1024 + 3;
+    std::vector<float> v1(kSize);
+    std::vector<float> v2(kSize);
+    std::vector<float> s1(100);
+    std::vector<float> s2(100);
+    for (std::size_t i = 0; i < kSize; i++) {
+      v1[i] = i % 1000;
+    }
+    for (std::size_t i = 0; i < s1.size(); i++) {
+      s1[i] = i;
+    }
+    
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, 256).Call("copy", in(v1), out(v2))
+        .WithGrid(1, s1.size(), 1, s1.size()).Call("copy", in(s1), out(s2))
+        .Dispatch().Wait();
+
+    for (std::size_t i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i % 1000, v2[i]);
+    }
+    for (std::size_t i = 0; i < s1.size(); i++) {
+      ASSERT_FLOAT_EQ(i, s2[i]);
+    }
+  }  
+
   TEST(ComputeTestSuite, TestCall_PointerToVector) {
     MetalComputeEngine engine;
     engine.LoadLibrary(shaderSrc2);
@@ -354,6 +722,149 @@ namespace compute_test {
       ASSERT_FLOAT_EQ(11.0f, v2[i]);
     }
   }  
+
+  TEST(ComputeTestSuite, TestCall_ResidentBuffer) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc2);
+    engine.LoadLibrary(shaderSrc3);
+
+    const int kSize = 10;
+    float f1[kSize];
+    float f2[kSize];
+    for (int i = 0; i < kSize; i++) {
+      f1[i] = i;
+    }
+
+    ResidentBuffer resident = engine.NewResidentBuffer(f1);
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", resident, 2.0f)
+        .Dispatch().Wait();
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("copy", resident, out(f2))
+        .Dispatch().Wait();
+
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(i, f1[i]);
+      ASSERT_FLOAT_EQ(2.0f, f2[i]);
+    }
+
+    resident.Download(f1);
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, f1[i]);
+    }
+  }
+
+  TEST(ComputeTestSuite, TestDispatch_ResidentBufferChain) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc2);
+
+    // batches conflicting through resident buffers only are ordered on the 
+    // GPU: an odd number of swaps, none waited for but the last
+    const int kSize = 10;
+    const int kNumBatches = 51;
+    ResidentBuffer r1 = engine.NewResidentBuffer(std::vector<float>(kSize, 1.0f));
+    ResidentBuffer r2 = engine.NewResidentBuffer(std::vector<float>(kSize, 2.0f));
+    ComputeEngine::Gate last = engine.NewBatch().Dispatch();
+    for (int i = 0; i < kNumBatches; i++) {
+      last = engine.NewBatch()
+          .WithGrid(1, kSize, 1, kSize).Call("swap", r1, r2)
+          .Dispatch();
+    }
+    last.Wait();
+
+    std::vector<float> v1(kSize);
+    std::vector<float> v2(kSize);
+    r1.Download(v1);
+    r2.Download(v2);
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, v1[i]);
+      ASSERT_FLOAT_EQ(1.0f, v2[i]);
+    }
+  }
+
+  TEST(ComputeTestSuite, TestDispatch_Then) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    const int kSize = 10;
+    float f1[kSize];
+    std::promise<float> first;
+    engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 3.0f)
+        .Dispatch().Then([&](std::exception_ptr error) {
+          first.set_value(error ? -1.0f : f1[0]);
+        });
+    ASSERT_FLOAT_EQ(3.0f, first.get_future().get());
+
+    ComputeEngine::Gate gate = engine.NewBatch()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(f1), 4.0f)
+        .Dispatch();
+    gate.ToFuture().get();
+    ASSERT_TRUE(gate.Done());
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(4.0f, f1[i]);
+    }
+  }
+
+  TEST(ComputeTestSuite, TestDispatch_ConcurrentThreads) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    const int kNumThreads = 8;
+    const int kNumBatches = 20;
+    std::atomic_int failures = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kNumThreads; t++) {
+      threads.emplace_back([&, t]() {
+        std::vector<float> v1(10);
+        std::vector<float> v2(10);
+        for (int i = 0; i < kNumBatches; i++) {
+          float value = t * kNumBatches + i;
+          engine.NewBatch()
+              .WithGrid(1, v1.size(), 1, v1.size()).Call("set", out(v1), value)
+              .Dispatch().Wait();
+          engine.NewBatch()
+              .WithGrid(1, v1.size(), 1, v1.size()).Call(engine.GetKernel("copy"), in(v1), out(v2))
+              .Dispatch().Wait();
+          for (std::size_t j = 0; j < v2.size(); j++) {
+            if (v2[j] != value) {
+              failures++;
+            }
+          }
+        }
+      });
+    }
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+      it->join();
+    }
+    ASSERT_EQ(0, failures);
+  }
+
+  TEST(ComputeTestSuite, TestBatchTemplate) {
+    MetalComputeEngine engine;
+    engine.LoadLibrary(shaderSrc3);
+
+    const int kSize = 10;
+    std::vector<float> v1(kSize);
+    std::vector<float> v2(kSize);
+    ComputeEngine::BatchTemplate tmpl = engine.NewBatchTemplate()
+        .WithGrid(1, kSize, 1, kSize).Call("set", out(v1), 2.0f)
+        .WithGrid(1, kSize, 1, kSize).Call("copy", in(v1), out(v2))
+        .Record();
+    tmpl.Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, v2[i]);
+    }
+
+    std::vector<float> v3(kSize);
+    tmpl.Bind(0, 1, 3.0f);
+    tmpl.Bind(1, 1, out(v3));
+    tmpl.Dispatch().Wait();
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(2.0f, v2[i]);
+      ASSERT_FLOAT_EQ(3.0f, v3[i]);
+    }
+  }
 } // compute_test
 } // compute
 } // mdl
\ No newline at end of file
@@ -0,0 +1,97 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl; 
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  void AssertCopies(std::size_t size, std::size_t dstOffset, std::size_t srcOffset, 
+      ThreadPool& pool) {
+    std::vector<std::uint8_t> src(size + srcOffset);
+    std::vector<std::uint8_t> dst(size + dstOffset + 1, 0xff);
+    for (std::size_t i = 0; i < src.size(); i++) {
+      src[i] = i * 7 + 3;
+    }
+
+    ParallelCopy(dst.data() + dstOffset, src.data() + srcOffset, size, pool);
+
+    for (std::size_t i = 0; i < dstOffset; i++) {
+      ASSERT_EQ(0xff, dst[i]);
+    }
+    for (std::size_t i = 0; i < size; i++) {
+      ASSERT_EQ(src[srcOffset + i], dst[dstOffset + i]) << "at " << i;
+    }
+    ASSERT_EQ(0xff, dst[dstOffset + size]);
+  }
+
+  TEST(ParallelCopyTestSuite, TestParallelCopy) {
+    ThreadPool pool(3);
+    AssertCopies(0, 0, 0, pool);
+    AssertCopies(1000, 3, 5, pool);
+    // parallel
+    AssertCopies(kParallelCopyThreshold + 1, 0, 0, pool);
+    AssertCopies(kParallelCopyThreshold + 100, 7, 1, pool);
+    // parallel and streaming
+    AssertCopies(kStreamingCopyThreshold + 77, 13, 3, pool);
+  }
+
+  TEST(ParallelCopyTestSuite, TestStreamingCopy) {
+    std::vector<std::uint8_t> src(1000);
+    for (std::size_t i = 0; i < src.size(); i++) {
+      src[i] = i;
+    }
+    for (std::size_t offset = 0; offset < 70; offset += 3) {
+      std::vector<std::uint8_t> dst(src.size() + offset);
+      StreamingCopy(dst.data() + offset, src.data(), src.size() - offset);
+      for (std::size_t i = 0; i < src.size() - offset; i++) {
+        ASSERT_EQ(src[i], dst[offset + i]);
+      }
+    }
+  }
+
+  TEST(ParallelCopyTestSuite, TestCopy_Empty) {
+    ThreadPool pool(1);
+    // data of empty vectors may be null
+    StreamingCopy(nullptr, nullptr, 0);
+    ParallelCopy(nullptr, nullptr, 0, pool);
+  }
+
+} // compute_test
+} // compute
+} // mdl
@@ -0,0 +1,140 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using std::cout;
+using std::endl; 
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  class MallocAllocator : public BufferAllocator {
+    public:
+      int allocations = 0;
+
+      void * Allocate(std::size_t capacity, std::uint32_t storageMode) override {
+        allocations++;
+        return std::malloc(capacity);
+      }
+
+      void Free(void * handle, std::size_t capacity, std::uint32_t storageMode) override {
+        std::free(handle);
+      }
+  };
+
+  TEST(StagingRingTestSuite, TestAllocateRelease) {
+    MallocAllocator allocator;
+    StagingRing ring(&allocator, 4096, 0);
+    ASSERT_EQ(0, allocator.allocations);
+
+    StagingRing::Range r1 = ring.Allocate(100);
+    StagingRing::Range r2 = ring.Allocate(1000);
+    ASSERT_EQ(1, allocator.allocations);
+    ASSERT_NE(nullptr, r1.handle);
+    ASSERT_EQ(r1.handle, r2.handle);
+    ASSERT_EQ(0, r1.offset);
+    ASSERT_EQ(256, r1.size);
+    ASSERT_EQ(256, r2.offset);
+    ASSERT_EQ(1024, r2.size);
+    ASSERT_EQ(1280, ring.GetBytesInUse());
+
+    // too big
+    ASSERT_EQ(nullptr, ring.Allocate(8192).handle);
+
+    ring.Release(r1);
+    ring.Release(r2);
+    ASSERT_EQ(0, ring.GetBytesInUse());
+  }
+
+  TEST(StagingRingTestSuite, TestWrapAround) {
+    MallocAllocator allocator;
+    StagingRing ring(&allocator, 4096, 0);
+
+    StagingRing::Range r1 = ring.Allocate(1024);
+    StagingRing::Range r2 = ring.Allocate(2048);
+    StagingRing::Range r3 = ring.Allocate(512);
+    ASSERT_EQ(3072, r3.offset);
+
+    // no room at the end, and the oldest range is still in use
+    ASSERT_EQ(nullptr, ring.Allocate(1024).handle);
+
+    // released out of order: space is only reclaimed from the oldest range
+    ring.Release(r2);
+    ASSERT_EQ(nullptr, ring.Allocate(1024).handle);
+    ring.Release(r1);
+
+    StagingRing::Range r4 = ring.Allocate(2048);
+    ASSERT_NE(nullptr, r4.handle);
+    ASSERT_EQ(0, r4.offset);
+    // wrapped: only the space between the newest and the oldest range is free
+    StagingRing::Range r5 = ring.Allocate(1024);
+    ASSERT_EQ(2048, r5.offset);
+    ASSERT_EQ(nullptr, ring.Allocate(256).handle);
+
+    ring.Release(r3);
+    ring.Release(r4);
+    ring.Release(r5);
+    ASSERT_EQ(0, ring.GetBytesInUse());
+    ASSERT_EQ(0, ring.Allocate(4096).offset);
+  }
+
+  class FailOnceAllocator : public MallocAllocator {
+    public:
+      void * Allocate(std::size_t capacity, std::uint32_t storageMode) override {
+        return allocations++ ? std::malloc(capacity) : nullptr;
+      }
+  };
+
+  TEST(StagingRingTestSuite, TestAllocate_AllocationFails) {
+    FailOnceAllocator allocator;
+    StagingRing ring(&allocator, 4096, 0);
+
+    StagingRing::Range r1 = ring.Allocate(100);
+    ASSERT_EQ(nullptr, r1.handle);
+    ASSERT_EQ(0, r1.size);
+    ASSERT_EQ(0, ring.GetBytesInUse());
+
+    // nothing was recorded for the failed allocation: the ring starts empty
+    StagingRing::Range r2 = ring.Allocate(4096);
+    ASSERT_EQ(2, allocator.allocations);
+    ASSERT_NE(nullptr, r2.handle);
+    ASSERT_EQ(0, r2.offset);
+    ring.Release(r2);
+    ASSERT_EQ(0, ring.GetBytesInUse());
+  }
+
+} // compute_test
+} // compute
+} // mdl
@@ -0,0 +1,125 @@
+// Copyright (c) 2022, Marcio Lucca
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+
+#include <mdl/compute.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace mdl {
+namespace compute {
+namespace compute_test {
+
+  TEST(WorkGroupTunerTestSuite, TestWorkGroupKey) {
+    // grids of similar size share a key
+    ASSERT_EQ(
+        WorkGroupKey("cpu", "scale", 1, 1000).ToString(), 
+        WorkGroupKey("cpu", "scale", 1, 600).ToString());
+    ASSERT_NE(
+        WorkGroupKey("cpu", "scale", 1, 1000).ToString(), 
+        WorkGroupKey("cpu", "scale", 1, 2000).ToString());
+    ASSERT_NE(
+        WorkGroupKey("cpu", "scale", 1, 1000).ToString(), 
+        WorkGroupKey("metal", "scale", 1, 1000).ToString());
+  }
+
+  TEST(WorkGroupTunerTestSuite, TestStore) {
+    std::filesystem::path path = 
+        std::filesystem::temp_directory_path() / "mdlcompute_work_group_tuner_test.txt";
+    std::filesystem::remove(path);
+
+    WorkGroupKey key("cpu", "scale", 16, 1024);
+    WorkGroupShape shape;
+    {
+      WorkGroupTuner tuner(path.string());
+      ASSERT_FALSE(tuner.Find(key, shape));
+      tuner.Store(key, WorkGroupShape { .rows = 2, .cols = 256 });
+      ASSERT_TRUE(tuner.Find(key, shape));
+      ASSERT_EQ(2, shape.rows);
+      ASSERT_EQ(256, shape.cols);
+    }
+
+    // reused by later runs
+    WorkGroupTuner tuner(path.string());
+    ASSERT_EQ(1, tuner.Size());
+    ASSERT_TRUE(tuner.Find(key, shape));
+    ASSERT_EQ(2, shape.rows);
+    ASSERT_EQ(256, shape.cols);
+
+    // names the file can't hold are rejected rather than lost on reload
+    ASSERT_THROW(tuner.Store(WorkGroupKey("cpu", "my kernel", 16, 1024), shape), 
+        RuntimeException);
+    ASSERT_EQ(1, tuner.Size());
+    std::filesystem::remove(path);
+  }
+
+  TEST(WorkGroupTunerTestSuite, TestAutotune) {
+    CpuComputeEngine engine(2);
+    std::atomic_size_t groupCols = 0;
+    std::atomic_size_t runs = 0;
+    engine.RegisterKernel("fill", 
+        [&](const CpuWorkGroup& group, const CpuKernelArgs& args) {
+          groupCols = group.colEnd - group.colBegin;
+          runs++;
+          for (std::size_t col = group.colBegin; col < group.colEnd; col++) {
+            args.Get<float>(0)[col] = 1.0f;
+          }
+        });
+
+    const int kSize = 256;
+    std::vector<float> f(kSize);
+    ASSERT_THROW(engine.Autotune("fill", 1, kSize, out(f)), RuntimeException);
+
+    std::shared_ptr<WorkGroupTuner> tuner = std::make_shared<WorkGroupTuner>();
+    engine.SetWorkGroupTuner(tuner);
+    WorkGroupShape shape = engine.Autotune("fill", 1, kSize, out(f));
+    ASSERT_EQ(1, shape.rows);
+    ASSERT_TRUE(shape.cols >= 1 && shape.cols <= kSize);
+    ASSERT_EQ(1, tuner->Size());
+
+    // already tuned
+    std::size_t runsBefore = runs;
+    WorkGroupShape again = engine.Autotune("fill", 1, kSize, out(f));
+    ASSERT_EQ(runsBefore, runs);
+    ASSERT_EQ(shape.cols, again.cols);
+
+    // calls that leave the shape to the engine get the tuned one
+    std::fill(f.begin(), f.end(), 0.0f);
+    engine.NewBatch().WithGrid(1, kSize).Call("fill", out(f)).Dispatch().Wait();
+    ASSERT_EQ(shape.cols, groupCols);
+    for (int i = 0; i < kSize; i++) {
+      ASSERT_FLOAT_EQ(1.0f, f[i]);
+    }
+  }
+} // compute_test
+} // compute
+} // mdl